@@ -0,0 +1,229 @@
+#include "AllocProfile.h"
+
+#ifdef MILKBOTTLE_ALLOC_PROFILE
+
+#include <malloc.h>
+#include <stdio.h>
+#include <new>
+
+#define ALLOC_MAX_THREADS 16
+#define ALLOC_MAX_TAGS 32
+#define ALLOC_REPORT_TAGS 5
+#define ALLOC_LOGGED_VIOLATIONS 20
+
+struct AllocTagCount {
+	const char *tag;
+	UINT64 allocations;
+	UINT64 bytes;
+};
+
+struct AllocThread {
+	DWORD threadId;
+	const char *threadName;
+	bool hot;
+	UINT64 allocations;
+	UINT64 frees;
+	UINT64 bytes;
+	UINT64 packets;
+	// Totals at the previous report, for the per-interval figures.
+	UINT64 reportedAllocations;
+	UINT64 reportedBytes;
+	UINT64 reportedPackets;
+	LONG tagCount;
+	AllocTagCount tags[ALLOC_MAX_TAGS];
+};
+
+static volatile LONG allocThreads = 0;
+static AllocThread allocThreadStats[ALLOC_MAX_THREADS];
+static __declspec(thread) AllocThread *allocThread = NULL;
+static __declspec(thread) const char *allocThreadName = NULL;
+static __declspec(thread) const char *allocTag = NULL;
+// Set while the profiler itself is logging, so its own work is not counted.
+static __declspec(thread) bool allocInside = false;
+static volatile LONGLONG allocPackets = 0;
+static volatile LONGLONG allocWarmupPackets = -1;
+static volatile LONG allocViolations = 0;
+
+static AllocThread *AllocThreadStats(void) {
+	if (!allocThread) {
+		LONG index = InterlockedIncrement(&allocThreads) - 1;
+		if (index >= ALLOC_MAX_THREADS)
+			return NULL;
+		allocThreadStats[index].threadId = GetCurrentThreadId();
+		allocThreadStats[index].threadName = allocThreadName;
+		allocThread = &allocThreadStats[index];
+	}
+	return allocThread;
+}
+
+static void AllocCount(size_t size) {
+	if (allocInside)
+		return;
+	AllocThread *stats = AllocThreadStats();
+	if (!stats)
+		return;
+	stats->allocations++;
+	stats->bytes += size;
+
+	const char *tag = allocTag ? allocTag : "(untagged)";
+	LONG i;
+	for (i = 0; i < stats->tagCount; i++)
+		if (stats->tags[i].tag == tag)
+			break;
+	if (i == stats->tagCount && i < ALLOC_MAX_TAGS) {
+		stats->tags[i].tag = tag;
+		stats->tagCount++;
+	}
+	if (i < ALLOC_MAX_TAGS) {
+		stats->tags[i].allocations++;
+		stats->tags[i].bytes += size;
+	}
+
+	if (stats->hot && allocWarmupPackets >= 0 && allocPackets >= allocWarmupPackets) {
+		LONG violation = InterlockedIncrement(&allocViolations);
+		if (violation <= ALLOC_LOGGED_VIOLATIONS) {
+			allocInside = true;
+			wchar_t buffer[256];
+			swprintf_s(buffer, _countof(buffer), L"Error: steady-state allocation %d of %u bytes in %S on thread %S after %I64d packets\n",
+				violation, (UINT)size, tag, stats->threadName ? stats->threadName : "?", allocPackets);
+			OutputDebugStringW(buffer);
+			allocInside = false;
+		}
+	}
+}
+
+static void *AllocProfileMalloc(size_t size) {
+	void *p = malloc(size ? size : 1);
+	if (p)
+		AllocCount(size);
+	return p;
+}
+
+static void AllocProfileFree(void *p) {
+	if (!p)
+		return;
+	if (!allocInside && allocThread)
+		allocThread->frees++;
+	free(p);
+}
+
+void *operator new(size_t size) {
+	void *p = AllocProfileMalloc(size);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t size) {
+	void *p = AllocProfileMalloc(size);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new(size_t size, const std::nothrow_t&) throw() {
+	return AllocProfileMalloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) throw() {
+	return AllocProfileMalloc(size);
+}
+
+void operator delete(void *p) throw() {
+	AllocProfileFree(p);
+}
+
+void operator delete[](void *p) throw() {
+	AllocProfileFree(p);
+}
+
+void operator delete(void *p, const std::nothrow_t&) throw() {
+	AllocProfileFree(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t&) throw() {
+	AllocProfileFree(p);
+}
+
+AllocTag::AllocTag(const char *name) : previous(allocTag) {
+	allocTag = name;
+}
+
+AllocTag::~AllocTag() {
+	allocTag = previous;
+}
+
+void AllocProfileSetThreadName(const char *name) {
+	allocThreadName = name;
+	if (allocThread)
+		allocThread->threadName = name;
+}
+
+void AllocProfileExternal(size_t size) {
+	AllocCount(size);
+}
+
+void AllocProfilePacket(void) {
+	AllocThread *stats = AllocThreadStats();
+	if (!stats)
+		return;
+	stats->hot = true;
+	stats->packets++;
+	InterlockedIncrement64(&allocPackets);
+}
+
+void AllocProfileAssertSteadyState(UINT64 warmupPackets) {
+	InterlockedExchange64(&allocWarmupPackets, (LONGLONG)warmupPackets);
+}
+
+LONG AllocProfileViolations(void) {
+	return allocViolations;
+}
+
+void AllocProfileReport(void) {
+	allocInside = true;
+	wchar_t buffer[512];
+	LONG threads = allocThreads < ALLOC_MAX_THREADS ? allocThreads : ALLOC_MAX_THREADS;
+	for (LONG t = 0; t < threads; t++) {
+		AllocThread &stats = allocThreadStats[t];
+		UINT64 allocations = stats.allocations - stats.reportedAllocations;
+		UINT64 bytes = stats.bytes - stats.reportedBytes;
+		UINT64 packets = stats.packets - stats.reportedPackets;
+		stats.reportedAllocations += allocations;
+		stats.reportedBytes += bytes;
+		stats.reportedPackets += packets;
+
+		int length = swprintf_s(buffer, _countof(buffer), L"Allocations on %S (%u): %I64u, %I64u bytes",
+			stats.threadName ? stats.threadName : "?", stats.threadId, allocations, bytes);
+		if (packets && length > 0)
+			length += swprintf_s(buffer + length, _countof(buffer) - length, L", %.2f per packet over %I64u packets",
+				(double)allocations / packets, packets);
+
+		// Busiest tags since the thread started, by count.
+		bool shown[ALLOC_MAX_TAGS] = { false };
+		LONG tagCount = stats.tagCount < ALLOC_MAX_TAGS ? stats.tagCount : ALLOC_MAX_TAGS;
+		for (int n = 0; n < ALLOC_REPORT_TAGS && length > 0; n++) {
+			LONG best = -1;
+			for (LONG i = 0; i < tagCount; i++)
+				if (!shown[i] && (best < 0 || stats.tags[i].allocations > stats.tags[best].allocations))
+					best = i;
+			if (best < 0)
+				break;
+			shown[best] = true;
+			length += swprintf_s(buffer + length, _countof(buffer) - length, L"%s %S %I64u", n ? L"," : L"; total", stats.tags[best].tag,
+				stats.tags[best].allocations);
+		}
+		if (length > 0 && length + 1 < _countof(buffer)) {
+			buffer[length] = L'\n';
+			buffer[length + 1] = L'\0';
+		}
+		OutputDebugStringW(buffer);
+	}
+	if (allocWarmupPackets >= 0) {
+		swprintf_s(buffer, _countof(buffer), L"Steady-state allocations: %d after %I64d warm-up packets\n", allocViolations, allocWarmupPackets);
+		OutputDebugStringW(buffer);
+	}
+	allocInside = false;
+}
+
+#endif
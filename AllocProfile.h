@@ -0,0 +1,65 @@
+#pragma once
+
+#include <windows.h>
+
+/// Heap allocation counters for the steady-state capture and render paths.
+///
+/// Built only when MILKBOTTLE_ALLOC_PROFILE is defined; otherwise every call
+/// below compiles to nothing. The profile build replaces the global operator
+/// new and delete and counts, per thread, allocations, bytes and the tag that
+/// was current when each allocation happened. Tags are scoped with ALLOC_TAG
+/// and every TRACE_SPAN sets one, so the existing spans name the call sites.
+///
+/// Only C++ heap allocations are seen on their own. Memory Media Foundation and
+/// COM hand out (MFCreateMemoryBuffer, CoTaskMemAlloc) does not pass through
+/// operator new; code that creates such objects reports them with
+/// AllocProfileExternal().
+
+#ifdef MILKBOTTLE_ALLOC_PROFILE
+
+class AllocTag {
+public:
+	AllocTag(const char *name);
+	~AllocTag();
+
+private:
+	const char *previous;
+};
+
+#  define ALLOC_TAG_CONCAT2(a, b) a##b
+#  define ALLOC_TAG_CONCAT(a, b) ALLOC_TAG_CONCAT2(a, b)
+#  define ALLOC_TAG(name) AllocTag ALLOC_TAG_CONCAT(allocTag, __LINE__)(name)
+
+/// Names the calling thread in reports.
+void AllocProfileSetThreadName(const char *name);
+
+/// Counts an allocation made outside operator new, such as a Media Foundation
+/// sample or buffer, against the calling thread and the current tag.
+void AllocProfileExternal(size_t size);
+
+/// Counts one captured packet on the calling thread. A thread that counts packets
+/// is on the hot path and is held to the steady-state assertion.
+void AllocProfilePacket(void);
+
+/// Arms the steady-state assertion: once warmupPackets packets have been counted,
+/// every allocation on a hot-path thread is a violation and is logged.
+void AllocProfileAssertSteadyState(UINT64 warmupPackets);
+
+/// Violations since the assertion was armed.
+LONG AllocProfileViolations(void);
+
+/// Logs per-thread allocations, bytes and allocations per packet since the last
+/// report, and each thread's busiest tags.
+void AllocProfileReport(void);
+
+#else
+
+#  define ALLOC_TAG(name)
+#  define AllocProfileSetThreadName(name)
+#  define AllocProfileExternal(size)
+#  define AllocProfilePacket()
+#  define AllocProfileAssertSteadyState(warmupPackets)
+#  define AllocProfileViolations() 0
+#  define AllocProfileReport()
+
+#endif
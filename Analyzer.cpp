@@ -0,0 +1,291 @@
+#include "Analyzer.h"
+
+#include <math.h>
+#include <string.h>
+#include <xmmintrin.h>
+
+#define ANALYZER_PI 3.14159265358979323846
+#define BASS_MAX_HZ 250.0
+#define MID_MAX_HZ 4000.0
+// Time constant of the running band averages behind bassAtt, midAtt and trebleAtt.
+#define ATT_SECONDS 1.0
+// An onset needs flux this many deviations above the recent mean, and at least this far apart.
+#define ONSET_DEVIATIONS 1.5f
+#define ONSET_FLOOR 1e-3f
+// It must also rise this far above the mean relative to the mean itself; over steady noise the
+// deviation is tiny and every flicker of the flux would otherwise count.
+#define ONSET_MIN_RISE 1.0f
+#define ONSET_MIN_SECONDS 0.1
+#define TEMPO_MIN_BPM 60.0
+#define TEMPO_MAX_BPM 200.0
+// Autocorrelation peaks are weighted by a log-normal around this tempo, one octave wide,
+// which settles the usual half/double tempo ambiguity.
+#define TEMPO_PREFERRED_BPM 120.0
+#define TEMPO_EVERY_HOPS 32
+#define TEMPO_SMOOTHING 0.25f
+
+static inline float HorizontalSum(__m128 v) {
+	__m128 shuffled = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+	__m128 sums = _mm_add_ps(v, shuffled);
+	shuffled = _mm_movehl_ps(shuffled, sums);
+	sums = _mm_add_ss(sums, shuffled);
+	return _mm_cvtss_f32(sums);
+}
+
+// Sum over bins [begin, end) of (a^2 + b^2) / 2.
+static float BandEnergy(const float *a, const float *b, int begin, int end) {
+	__m128 sum = _mm_setzero_ps();
+	int k = begin;
+	for (; k + 4 <= end; k += 4) {
+		__m128 x = _mm_loadu_ps(a + k);
+		__m128 y = _mm_loadu_ps(b + k);
+		sum = _mm_add_ps(sum, _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)));
+	}
+	float total = HorizontalSum(sum);
+	for (; k < end; k++)
+		total += a[k] * a[k] + b[k] * b[k];
+	return total * 0.5f;
+}
+
+Analyzer::Analyzer(void) {
+	int bits = 0;
+	while ((1 << bits) < ANALYZER_FFT_SIZE)
+		bits++;
+	for (int i = 0; i < ANALYZER_FFT_SIZE; i++) {
+		int reversed = 0;
+		for (int b = 0; b < bits; b++)
+			if (i & (1 << b))
+				reversed |= 1 << (bits - 1 - b);
+		bitReverse[i] = reversed;
+	}
+
+	double windowSum = 0;
+	for (int i = 0; i < ANALYZER_FFT_SIZE; i++) {
+		window[i] = (float)(0.5 - 0.5 * cos(2 * ANALYZER_PI * i / ANALYZER_FFT_SIZE));
+		windowSum += window[i];
+	}
+	// A full-scale sine lands in one positive-frequency bin with amplitude windowSum / 2.
+	magnitudeScale = (float)(2.0 / windowSum);
+
+	for (int m = 1; m < ANALYZER_FFT_SIZE; m *= 2) {
+		for (int k = 0; k < m; k++) {
+			twiddleRe[m - 1 + k] = (float)cos(-ANALYZER_PI * k / m);
+			twiddleIm[m - 1 + k] = (float)sin(-ANALYZER_PI * k / m);
+		}
+	}
+
+	Reset(44100, 576);
+}
+
+void Analyzer::Reset(double sampleRate, int hopSamples) {
+	double binHz = sampleRate / ANALYZER_FFT_SIZE;
+	hopSeconds = hopSamples / sampleRate;
+	bassEnd = (int)(BASS_MAX_HZ / binHz) + 1;
+	midEnd = (int)(MID_MAX_HZ / binHz) + 1;
+	if (midEnd > ANALYZER_BINS)
+		midEnd = ANALYZER_BINS;
+
+	memset(previous, 0, sizeof(previous));
+	memset(fluxHistory, 0, sizeof(fluxHistory));
+	memset(onsetStrength, 0, sizeof(onsetStrength));
+	bassAverage = 0;
+	midAverage = 0;
+	trebleAverage = 0;
+	hops = 0;
+	lastOnset = 0;
+	tempo = 0;
+	tempoConfidence = 0;
+}
+
+void Analyzer::Fft(void) {
+	for (int i = 0; i < ANALYZER_FFT_SIZE; i++) {
+		int j = bitReverse[i];
+		if (j > i) {
+			float t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+
+	for (int m = 1; m < ANALYZER_FFT_SIZE; m *= 2) {
+		const float *wr = twiddleRe + m - 1;
+		const float *wi = twiddleIm + m - 1;
+		for (int j = 0; j < ANALYZER_FFT_SIZE; j += 2 * m) {
+			float *ar = re + j;
+			float *ai = im + j;
+			float *br = re + j + m;
+			float *bi = im + j + m;
+			if (m >= 4) {
+				for (int k = 0; k < m; k += 4) {
+					__m128 xr = _mm_load_ps(br + k);
+					__m128 xi = _mm_load_ps(bi + k);
+					__m128 cr = _mm_loadu_ps(wr + k);
+					__m128 ci = _mm_loadu_ps(wi + k);
+					__m128 tr = _mm_sub_ps(_mm_mul_ps(xr, cr), _mm_mul_ps(xi, ci));
+					__m128 ti = _mm_add_ps(_mm_mul_ps(xr, ci), _mm_mul_ps(xi, cr));
+					__m128 yr = _mm_load_ps(ar + k);
+					__m128 yi = _mm_load_ps(ai + k);
+					_mm_store_ps(br + k, _mm_sub_ps(yr, tr));
+					_mm_store_ps(bi + k, _mm_sub_ps(yi, ti));
+					_mm_store_ps(ar + k, _mm_add_ps(yr, tr));
+					_mm_store_ps(ai + k, _mm_add_ps(yi, ti));
+				}
+			} else {
+				for (int k = 0; k < m; k++) {
+					float tr = br[k] * wr[k] - bi[k] * wi[k];
+					float ti = br[k] * wi[k] + bi[k] * wr[k];
+					br[k] = ar[k] - tr;
+					bi[k] = ai[k] - ti;
+					ar[k] += tr;
+					ai[k] += ti;
+				}
+			}
+		}
+	}
+}
+
+void Analyzer::Analyze(const float *left, const float *right, int samples, AnalysisResult *result) {
+	const float *l = left + samples - ANALYZER_FFT_SIZE;
+	const float *r = right + samples - ANALYZER_FFT_SIZE;
+	for (int i = 0; i < ANALYZER_FFT_SIZE; i += 4) {
+		__m128 w = _mm_load_ps(window + i);
+		_mm_store_ps(re + i, _mm_mul_ps(_mm_loadu_ps(l + i), w));
+		_mm_store_ps(im + i, _mm_mul_ps(_mm_loadu_ps(r + i), w));
+	}
+	Fft();
+
+	// Z = L + iR, so L[k] = (Z[k] + conj(Z[N-k])) / 2 and R[k] = (Z[k] - conj(Z[N-k])) / 2i.
+	float *spectrumLeft = result->spectrum[0];
+	float *spectrumRight = result->spectrum[1];
+	for (int k = 0; k < ANALYZER_BINS; k++) {
+		int n = (ANALYZER_FFT_SIZE - k) & (ANALYZER_FFT_SIZE - 1);
+		float sumRe = re[k] + re[n];
+		float sumIm = im[k] - im[n];
+		float diffRe = re[k] - re[n];
+		float diffIm = im[k] + im[n];
+		spectrumLeft[k] = sumRe * sumRe + sumIm * sumIm;
+		spectrumRight[k] = diffIm * diffIm + diffRe * diffRe;
+	}
+
+	// The factor 1/2 from the separation folds into the scale.
+	__m128 scale = _mm_set1_ps(magnitudeScale * 0.5f);
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 zero = _mm_setzero_ps();
+	__m128 fluxSum = _mm_setzero_ps();
+	for (int k = 0; k < ANALYZER_BINS; k += 4) {
+		__m128 magnitudeLeft = _mm_mul_ps(_mm_sqrt_ps(_mm_loadu_ps(spectrumLeft + k)), scale);
+		__m128 magnitudeRight = _mm_mul_ps(_mm_sqrt_ps(_mm_loadu_ps(spectrumRight + k)), scale);
+		_mm_storeu_ps(spectrumLeft + k, magnitudeLeft);
+		_mm_storeu_ps(spectrumRight + k, magnitudeRight);
+
+		__m128 m = _mm_mul_ps(_mm_add_ps(magnitudeLeft, magnitudeRight), half);
+		fluxSum = _mm_add_ps(fluxSum, _mm_max_ps(_mm_sub_ps(m, _mm_load_ps(previous + k)), zero));
+		_mm_store_ps(previous + k, m);
+	}
+	float flux = HorizontalSum(fluxSum);
+
+	result->bass = BandEnergy(spectrumLeft, spectrumRight, 1, bassEnd);
+	result->mid = BandEnergy(spectrumLeft, spectrumRight, bassEnd, midEnd);
+	result->treble = BandEnergy(spectrumLeft, spectrumRight, midEnd, ANALYZER_BINS);
+
+	float alpha = (float)(hopSeconds / ATT_SECONDS);
+	bassAverage += (result->bass - bassAverage) * alpha;
+	midAverage += (result->mid - midAverage) * alpha;
+	trebleAverage += (result->treble - trebleAverage) * alpha;
+	result->bassAtt = bassAverage > 0 ? result->bass / bassAverage : 1.0f;
+	result->midAtt = midAverage > 0 ? result->mid / midAverage : 1.0f;
+	result->trebleAtt = trebleAverage > 0 ? result->treble / trebleAverage : 1.0f;
+
+	float mean = 0;
+	for (int i = 0; i < ANALYZER_FLUX_HISTORY; i++)
+		mean += fluxHistory[i];
+	mean /= ANALYZER_FLUX_HISTORY;
+	float variance = 0;
+	for (int i = 0; i < ANALYZER_FLUX_HISTORY; i++)
+		variance += (fluxHistory[i] - mean) * (fluxHistory[i] - mean);
+	float deviation = sqrtf(variance / ANALYZER_FLUX_HISTORY);
+
+	result->flux = flux;
+	result->onset = hops >= ANALYZER_FLUX_HISTORY &&
+		flux > mean + ONSET_DEVIATIONS * deviation + ONSET_FLOOR && flux > mean * (1 + ONSET_MIN_RISE) &&
+		(hops - lastOnset) * hopSeconds >= ONSET_MIN_SECONDS;
+	if (result->onset)
+		lastOnset = hops;
+
+	fluxHistory[hops % ANALYZER_FLUX_HISTORY] = flux;
+	onsetStrength[hops % ANALYZER_TEMPO_HISTORY] = flux > mean ? flux - mean : 0;
+	hops++;
+
+	if (hops >= ANALYZER_TEMPO_HISTORY / 2 && hops % TEMPO_EVERY_HOPS == 0)
+		EstimateTempo();
+	result->tempo = tempo;
+	result->tempoConfidence = tempoConfidence;
+}
+
+void Analyzer::EstimateTempo(void) {
+	// Unroll the ring oldest first and remove its mean.
+	int count = hops < ANALYZER_TEMPO_HISTORY ? (int)hops : ANALYZER_TEMPO_HISTORY;
+	float mean = 0;
+	for (int i = 0; i < count; i++) {
+		tempoWork[i] = onsetStrength[(hops - count + i) % ANALYZER_TEMPO_HISTORY];
+		mean += tempoWork[i];
+	}
+	mean /= count;
+	for (int i = 0; i < count; i++)
+		tempoWork[i] -= mean;
+
+	float energy = 0;
+	for (int i = 0; i < count; i++)
+		energy += tempoWork[i] * tempoWork[i];
+	if (energy <= 0)
+		return;
+
+	int minLag = (int)(60.0 / (TEMPO_MAX_BPM * hopSeconds));
+	int maxLag = (int)(60.0 / (TEMPO_MIN_BPM * hopSeconds)) + 1;
+	if (maxLag >= count / 2)
+		maxLag = count / 2 - 1;
+	if (minLag < 1 || minLag + 2 > maxLag)
+		return;
+
+	float correlation[ANALYZER_TEMPO_HISTORY / 2];
+	for (int lag = minLag - 1; lag <= maxLag + 1; lag++) {
+		__m128 sum = _mm_setzero_ps();
+		int i = lag;
+		for (; i + 4 <= count; i += 4)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(tempoWork + i), _mm_loadu_ps(tempoWork + i - lag)));
+		float total = HorizontalSum(sum);
+		for (; i < count; i++)
+			total += tempoWork[i] * tempoWork[i - lag];
+		// Unbiased: longer lags overlap fewer samples.
+		correlation[lag] = total * count / (count - lag);
+	}
+
+	int best = 0;
+	double bestScore = 0;
+	for (int lag = minLag; lag <= maxLag; lag++) {
+		if (correlation[lag] <= 0 || correlation[lag] < correlation[lag - 1] || correlation[lag] < correlation[lag + 1])
+			continue;
+		double bpm = 60.0 / (lag * hopSeconds);
+		double octaves = log(bpm / TEMPO_PREFERRED_BPM) / log(2.0);
+		double score = correlation[lag] * exp(-0.5 * octaves * octaves);
+		if (score > bestScore) {
+			bestScore = score;
+			best = lag;
+		}
+	}
+	if (!best)
+		return;
+
+	// Parabolic interpolation between neighbouring lags for sub-hop resolution.
+	double a = correlation[best - 1], b = correlation[best], c = correlation[best + 1];
+	double denominator = a - 2 * b + c;
+	double lag = best + (denominator != 0 ? 0.5 * (a - c) / denominator : 0);
+	float bpm = (float)(60.0 / (lag * hopSeconds));
+
+	tempoConfidence = correlation[best] / energy;
+	if (tempoConfidence > 1)
+		tempoConfidence = 1;
+	if (tempo == 0 || fabsf(bpm - tempo) > tempo * 0.1f)
+		tempo = tempo == 0 || tempoConfidence > 0.3f ? bpm : tempo;
+	else
+		tempo += (bpm - tempo) * TEMPO_SMOOTHING;
+}
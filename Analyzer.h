@@ -0,0 +1,79 @@
+#pragma once
+
+#include <windows.h>
+
+#define ANALYZER_FFT_SIZE 512
+#define ANALYZER_BINS (ANALYZER_FFT_SIZE / 2)
+// Onset strength history used for the tempo estimate, in hops (about 6.7 s at 576-sample hops).
+#define ANALYZER_TEMPO_HISTORY 512
+#define ANALYZER_FLUX_HISTORY 32
+
+/// What the analyzer knows about one window.
+struct AnalysisResult {
+	/// Band energies of this window: below 250 Hz, 250 Hz to 4 kHz, and above.
+	float bass;
+	float mid;
+	float treble;
+	/// Band energies relative to their running average, 1 being average; MilkDrop's bass_att and friends.
+	float bassAtt;
+	float midAtt;
+	float trebleAtt;
+	/// Spectral flux: total rise of magnitude over the previous window.
+	float flux;
+	/// True if this window starts an onset.
+	bool onset;
+	/// Running tempo in beats per minute, 0 until there is enough history.
+	float tempo;
+	/// Normalized autocorrelation at the chosen tempo, 0 to 1.
+	float tempoConfidence;
+	/// Magnitude spectrum per channel, scaled so a full-scale sine peaks near 1.
+	float spectrum[2][ANALYZER_BINS];
+};
+
+/// Beat, onset and band-energy analysis run once per hop on the capture side,
+/// so every consumer of a window gets the same numbers instead of working
+/// them out on its own render thread.
+///
+/// Both channels go through a single complex FFT: left in the real part and
+/// right in the imaginary part, separated afterwards by conjugate symmetry.
+/// Windowing, magnitudes, band sums and flux use SSE.
+class Analyzer {
+public:
+	Analyzer(void);
+
+	/// @param sampleRate rate of the windows passed to Analyze()
+	/// @param hopSamples samples between successive Analyze() calls
+	void Reset(double sampleRate, int hopSamples);
+
+	/// Analyzes the newest window. samples must be at least ANALYZER_FFT_SIZE;
+	/// the last ANALYZER_FFT_SIZE samples are used.
+	void Analyze(const float *left, const float *right, int samples, AnalysisResult *result);
+
+private:
+	void Fft(void);
+	void EstimateTempo(void);
+
+	__declspec(align(16)) float window[ANALYZER_FFT_SIZE];
+	// Per-stage twiddles: the stage with half-size m uses entries m - 1 to 2m - 2.
+	__declspec(align(16)) float twiddleRe[ANALYZER_FFT_SIZE];
+	__declspec(align(16)) float twiddleIm[ANALYZER_FFT_SIZE];
+	__declspec(align(16)) float re[ANALYZER_FFT_SIZE];
+	__declspec(align(16)) float im[ANALYZER_FFT_SIZE];
+	__declspec(align(16)) float previous[ANALYZER_BINS];
+	__declspec(align(16)) float tempoWork[ANALYZER_TEMPO_HISTORY];
+	int bitReverse[ANALYZER_FFT_SIZE];
+	float magnitudeScale;
+
+	double hopSeconds;
+	int bassEnd;
+	int midEnd;
+	float bassAverage;
+	float midAverage;
+	float trebleAverage;
+	float fluxHistory[ANALYZER_FLUX_HISTORY];
+	float onsetStrength[ANALYZER_TEMPO_HISTORY];
+	UINT64 hops;
+	UINT64 lastOnset;
+	float tempo;
+	float tempoConfidence;
+};
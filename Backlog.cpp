@@ -0,0 +1,88 @@
+#include "Backlog.h"
+
+#include <string.h>
+#include <new>
+
+Backlog::Backlog(void) : samples(NULL), capacity(0), mask(0), head(0), count(0), consumed(0), markHead(0), markCount(0) {
+}
+
+Backlog::~Backlog(void) {
+	delete[] samples;
+}
+
+HRESULT Backlog::Reset(size_t capacity) {
+	size_t size = 1;
+	while (size < capacity)
+		size *= 2;
+	if (size > this->capacity) {
+		float *grown = new (std::nothrow) float[size * 2];
+		if (!grown)
+			return E_OUTOFMEMORY;
+		delete[] samples;
+		samples = grown;
+		this->capacity = size;
+		mask = size - 1;
+	}
+	Clear();
+	return S_OK;
+}
+
+void Backlog::Consume(size_t n) {
+	if (n > count)
+		n = count;
+	head = (head + n) & mask;
+	count -= n;
+	consumed += n;
+	// Keep the newest mark at or before the oldest sample; older ones are no longer needed.
+	while (markCount > 1 && marks[(markHead + 1) % BACKLOG_MARKS].sample <= consumed) {
+		markHead = (markHead + 1) % BACKLOG_MARKS;
+		markCount--;
+	}
+}
+
+void Backlog::Mark(LONGLONG qpc) {
+	UINT64 sample = consumed + count;
+	if (markCount > 0) {
+		TimeMark &newest = marks[(markHead + markCount - 1) % BACKLOG_MARKS];
+		if (newest.sample == sample) {
+			newest.qpc = qpc;
+			return;
+		}
+	}
+	if (markCount == BACKLOG_MARKS) {
+		// Many tiny packets; the samples of the dropped mark extrapolate from the next one.
+		markHead = (markHead + 1) % BACKLOG_MARKS;
+		markCount--;
+	}
+	TimeMark &mark = marks[(markHead + markCount) % BACKLOG_MARKS];
+	mark.sample = sample;
+	mark.qpc = qpc;
+	markCount++;
+}
+
+bool Backlog::CaptureTime(size_t i, double ticksPerSample, LONGLONG *qpc_return) const {
+	if (markCount == 0)
+		return false;
+	UINT64 sample = consumed + i;
+	int m = markCount - 1;
+	while (m > 0 && marks[(markHead + m) % BACKLOG_MARKS].sample > sample)
+		m--;
+	const TimeMark &mark = marks[(markHead + m) % BACKLOG_MARKS];
+	*qpc_return = mark.qpc + (LONGLONG)(((double)sample - (double)mark.sample) * ticksPerSample);
+	return true;
+}
+
+void Backlog::Grow(void) {
+	size_t size = capacity ? capacity * 2 : 1024;
+	float *grown = new float[size * 2];
+	// Unwrap the ring into the front of the new one.
+	for (size_t i = 0; i < count; i++) {
+		grown[i * 2] = Left(i);
+		grown[i * 2 + 1] = Right(i);
+	}
+	delete[] samples;
+	samples = grown;
+	capacity = size;
+	mask = size - 1;
+	head = 0;
+}
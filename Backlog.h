@@ -0,0 +1,86 @@
+#pragma once
+
+#include <windows.h>
+
+#define BACKLOG_MARKS 64
+
+/// Stereo float samples waiting between capture and the window taker.
+///
+/// A ring allocated once per stream in Reset(), so capture appending and the
+/// drift compensator consuming never touch the heap in steady state. Should a
+/// burst ever outrun the capacity, Push() grows the ring rather than lose
+/// audio; the allocation then shows up in the allocation profile.
+///
+/// Capture times travel with the samples: each packet marks the position of
+/// its first sample with the time the endpoint captured it, and the time of
+/// any sample is extrapolated from the nearest mark before it.
+class Backlog {
+public:
+	Backlog(void);
+	~Backlog(void);
+
+	/// Empties the backlog and makes room for at least capacity samples per channel.
+	HRESULT Reset(size_t capacity);
+
+	size_t Size(void) const {
+		return count;
+	}
+
+	/// Appends one sample per channel.
+	void Push(float left, float right) {
+		if (count == capacity)
+			Grow();
+		float *frame = samples + ((head + count) & mask) * 2;
+		frame[0] = left;
+		frame[1] = right;
+		count++;
+	}
+
+	/// Sample i, counting from the oldest.
+	float Left(size_t i) const {
+		return samples[((head + i) & mask) * 2];
+	}
+	float Right(size_t i) const {
+		return samples[((head + i) & mask) * 2 + 1];
+	}
+
+	/// Removes the n oldest samples.
+	void Consume(size_t n);
+
+	/// Records that the next sample pushed was captured at QueryPerformanceCounter time qpc.
+	void Mark(LONGLONG qpc);
+
+	/// Capture time of sample i, counting from the oldest.
+	/// @param ticksPerSample QueryPerformanceCounter ticks per sample at the backlog rate
+	/// @return false if no pushed sample carried a mark since the last Clear()
+	bool CaptureTime(size_t i, double ticksPerSample, LONGLONG *qpc_return) const;
+
+	void Clear(void) {
+		head = 0;
+		count = 0;
+		consumed = 0;
+		markHead = 0;
+		markCount = 0;
+	}
+
+private:
+	struct TimeMark {
+		// Position counted from the first sample pushed since Clear().
+		UINT64 sample;
+		LONGLONG qpc;
+	};
+
+	void Grow(void);
+
+	float *samples;
+	// Capacity is a power of two, so indices wrap with mask.
+	size_t capacity;
+	size_t mask;
+	size_t head;
+	size_t count;
+	// Samples consumed since Clear(), i.e. the position of the oldest sample held.
+	UINT64 consumed;
+	TimeMark marks[BACKLOG_MARKS];
+	int markHead;
+	int markCount;
+};
@@ -0,0 +1,430 @@
+#include "BatchAnalyzer.h"
+
+#include <algorithm>
+#include <new>
+#include <vector>
+#include <string.h>
+#include <wchar.h>
+#include <mfapi.h>
+#include <mfidl.h>
+#include <mfreadwrite.h>
+
+#include "Analyzer.h"
+#include "FeatureFile.h"
+#include "Log.h"
+#include "WorkPool.h"
+#include "WWMFResampler.h"
+#include "WWUtil.h"
+
+#pragma comment(lib, "mfreadwrite")
+
+// Offline there is no CPU budget to keep, so resample at the best quality.
+#define BATCH_RESAMPLE_QUALITY 60
+
+// LOG and ERR, with the line also going to the console /analyze was started from, or wherever
+// its output is redirected; milkbottle is a windowed program, so nothing else shows it there.
+#define BATCH_LOG(format, ...) \
+{ \
+	ALLOC_TAG("Log"); \
+	wchar_t line[2048]; \
+	swprintf_s(line, _countof(line), format L"\n", __VA_ARGS__); \
+	OutputDebugStringW(line); \
+	BatchWrite(line); \
+}
+#define BATCH_ERR(format, ...) BATCH_LOG(L"Error: " format, __VA_ARGS__)
+
+struct BatchFile {
+	wchar_t path[MAX_PATH];
+	LONGLONG bytes;
+	HRESULT hr;
+	double audioSeconds;
+	double wallSeconds;
+};
+
+// Everything between resampled audio and the feature file, for one file.
+struct BatchOutput {
+	float left[SHARED_WAVEFORM_SAMPLES];
+	float right[SHARED_WAVEFORM_SAMPLES];
+	int filled;
+	Analyzer analyzer;
+	AnalysisResult analysis;
+	FeatureFileWriter writer;
+	HRESULT hr;
+};
+
+static HANDLE batchOutput = NULL;
+static bool batchOutputOpened = false;
+
+// Redirected output is inherited as is; otherwise the parent's console, if any, is attached.
+static void BatchOutputOpen(void) {
+	batchOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	if (batchOutput && batchOutput != INVALID_HANDLE_VALUE)
+		return;
+	batchOutput = NULL;
+	if (!AttachConsole(ATTACH_PARENT_PROCESS))
+		return;
+	batchOutput = CreateFileW(L"CONOUT$", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (batchOutput == INVALID_HANDLE_VALUE)
+		batchOutput = NULL;
+	batchOutputOpened = batchOutput != NULL;
+}
+
+static void BatchOutputClose(void) {
+	if (batchOutputOpened)
+		CloseHandle(batchOutput);
+	batchOutput = NULL;
+	batchOutputOpened = false;
+}
+
+// Workers finish files concurrently; each line goes out in one write so lines do not interleave.
+static void BatchWrite(const wchar_t *line) {
+	if (!batchOutput)
+		return;
+	DWORD written;
+	DWORD length = (DWORD)wcslen(line);
+	if (GetFileType(batchOutput) == FILE_TYPE_CHAR && WriteConsoleW(batchOutput, line, length, &written, NULL))
+		return;
+	char utf8[3 * 2048];
+	int bytes = WideCharToMultiByte(CP_UTF8, 0, line, (int)length, utf8, sizeof(utf8), NULL, NULL);
+	if (bytes > 0)
+		WriteFile(batchOutput, utf8, bytes, &written, NULL);
+}
+
+static bool IsAudioFile(const wchar_t *name) {
+	static const wchar_t *extensions[] = { L".wav", L".mp3", L".wma", L".m4a", L".aac", L".mp4", L".flac", L".aiff", L".aif" };
+	const wchar_t *extension = wcsrchr(name, L'.');
+	if (!extension)
+		return false;
+	for (int i = 0; i < _countof(extensions); i++)
+		if (!_wcsicmp(extension, extensions[i]))
+			return true;
+	return false;
+}
+
+static void AddFile(std::vector<BatchFile*> &files, const wchar_t *path, LONGLONG bytes) {
+	BatchFile *file = new BatchFile;
+	if (wcscpy_s(file->path, path)) {
+		BATCH_ERR(L"skipping %s: path too long", path);
+		delete file;
+		return;
+	}
+	file->bytes = bytes;
+	file->hr = E_PENDING;
+	file->audioSeconds = 0;
+	file->wallSeconds = 0;
+	files.push_back(file);
+}
+
+static void FindFiles(std::vector<BatchFile*> &files, const wchar_t *directory) {
+	wchar_t pattern[MAX_PATH];
+	if (swprintf_s(pattern, L"%s\\*", directory) < 0)
+		return;
+	WIN32_FIND_DATAW data;
+	HANDLE find = FindFirstFileW(pattern, &data);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+	do {
+		wchar_t path[MAX_PATH];
+		if (!wcscmp(data.cFileName, L".") || !wcscmp(data.cFileName, L".."))
+			continue;
+		if (swprintf_s(path, L"%s\\%s", directory, data.cFileName) < 0)
+			continue;
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			FindFiles(files, path);
+		else if (IsAudioFile(data.cFileName))
+			AddFile(files, path, ((LONGLONG)data.nFileSizeHigh << 32) | data.nFileSizeLow);
+	} while (FindNextFileW(find, &data));
+	FindClose(find);
+}
+
+static bool LargerFirst(const BatchFile *a, const BatchFile *b) {
+	return a->bytes > b->bytes;
+}
+
+static void WriteWindow(BatchOutput &output, DWORD *flags_return) {
+	output.analyzer.Analyze(output.left, output.right, SHARED_WAVEFORM_SAMPLES, &output.analysis);
+	SharedWaveformAnalysis shared;
+	shared.bass = output.analysis.bass;
+	shared.mid = output.analysis.mid;
+	shared.treble = output.analysis.treble;
+	shared.bassAtt = output.analysis.bassAtt;
+	shared.midAtt = output.analysis.midAtt;
+	shared.trebleAtt = output.analysis.trebleAtt;
+	shared.flux = output.analysis.flux;
+	shared.tempo = output.analysis.tempo;
+	shared.tempoConfidence = output.analysis.tempoConfidence;
+	shared.reserved = 0;
+	*flags_return = output.analysis.onset ? SHARED_WAVEFORM_ONSET : 0;
+	output.hr = output.writer.Write(output.left, output.right, output.analysis.spectrum[0], shared, *flags_return);
+	output.filled = 0;
+}
+
+// Cuts interleaved float stereo into windows.
+static void Feed(BatchOutput &output, const float *samples, DWORD frames) {
+	DWORD flags;
+	for (DWORD i = 0; i < frames && SUCCEEDED(output.hr); i++) {
+		output.left[output.filled] = samples[2 * i];
+		output.right[output.filled] = samples[2 * i + 1];
+		if (++output.filled == SHARED_WAVEFORM_SAMPLES)
+			WriteWindow(output, &flags);
+	}
+}
+
+// Reads the decoder's current output type and sets the resampler up to bring it to
+// 44.1 kHz stereo, or leaves it finalized if the type already is that.
+static HRESULT ConfigureResampler(IMFSourceReader *reader, WWMFResampler &resampler, bool *resample_return,
+	UINT32 *channels_return, UINT32 *sampleRate_return) {
+	IMFMediaType *actual = NULL;
+	GUID subtype = GUID_NULL;
+	resampler.Finalize();
+	*resample_return = false;
+	HRESULT hr = reader->GetCurrentMediaType((DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, &actual);
+	if (SUCCEEDED(hr))
+		hr = actual->GetGUID(MF_MT_SUBTYPE, &subtype);
+	if (FAILED(hr)) {
+		SafeRelease(&actual);
+		return hr;
+	}
+	UINT32 channels = MFGetAttributeUINT32(actual, MF_MT_AUDIO_NUM_CHANNELS, 0);
+	UINT32 sampleRate = MFGetAttributeUINT32(actual, MF_MT_AUDIO_SAMPLES_PER_SECOND, 0);
+	if (subtype != MFAudioFormat_Float || channels == 0 || sampleRate == 0) {
+		SafeRelease(&actual);
+		return MF_E_INVALIDMEDIATYPE;
+	}
+	*channels_return = channels;
+	*sampleRate_return = sampleRate;
+
+	if (channels != 2 || sampleRate != 44100) {
+		WWMFPcmFormat inputFormat(WWMFBitFormatFloat, (WORD)channels, 32, sampleRate,
+			MFGetAttributeUINT32(actual, MF_MT_AUDIO_CHANNEL_MASK, 0), 32);
+		WWMFPcmFormat outputFormat(WWMFBitFormatFloat, 2, 32, 44100, 3, 32);
+		*resample_return = true;
+		hr = resampler.Initialize(inputFormat, outputFormat, BATCH_RESAMPLE_QUALITY);
+	}
+	SafeRelease(&actual);
+	return hr;
+}
+
+// Feeds whatever the resampler still holds to the analyzer.
+static HRESULT DrainResampler(BatchOutput &output, WWMFResampler &resampler, DWORD lastBytes) {
+	WWMFSampleData resampled;
+	HRESULT hr = resampler.Drain(lastBytes, &resampled);
+	if (SUCCEEDED(hr))
+		Feed(output, (const float*)resampled.data, resampled.bytes / (2 * sizeof(float)));
+	resampled.Release();
+	return SUCCEEDED(hr) ? output.hr : hr;
+}
+
+static HRESULT AnalyzeFile(BatchFile *file) {
+	HRESULT hr = S_OK;
+	IMFSourceReader *reader = NULL;
+	IMFMediaType *requested = NULL;
+	WWMFResampler resampler;
+	bool resample = false;
+	UINT32 channels = 0;
+	UINT32 sampleRate = 0;
+	DWORD lastBytes = 0;
+	double audioSeconds = 0;
+	wchar_t outputPath[MAX_PATH];
+	// The analyzer needs 16-byte alignment, which new does not promise on x86.
+	BatchOutput *output = (BatchOutput*)_aligned_malloc(sizeof(BatchOutput), 16);
+	if (!output)
+		return E_OUTOFMEMORY;
+	new (output) BatchOutput;
+	output->filled = 0;
+	output->hr = S_OK;
+	output->analyzer.Reset(44100, SHARED_WAVEFORM_SAMPLES);
+
+	if (swprintf_s(outputPath, L"%s%s", file->path, FEATURE_FILE_EXTENSION) < 0) {
+		hr = HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+		goto cleanup;
+	}
+
+	hr = MFCreateSourceReaderFromURL(file->path, NULL, &reader);
+	if (FAILED(hr))
+		goto cleanup;
+	reader->SetStreamSelection((DWORD)MF_SOURCE_READER_ALL_STREAMS, FALSE);
+	hr = reader->SetStreamSelection((DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, TRUE);
+	if (FAILED(hr))
+		goto cleanup;
+
+	// Let the decoder produce float at the file's own rate and channel count.
+	hr = MFCreateMediaType(&requested);
+	if (SUCCEEDED(hr))
+		hr = requested->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Audio);
+	if (SUCCEEDED(hr))
+		hr = requested->SetGUID(MF_MT_SUBTYPE, MFAudioFormat_Float);
+	if (SUCCEEDED(hr))
+		hr = reader->SetCurrentMediaType((DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, NULL, requested);
+	if (SUCCEEDED(hr))
+		hr = ConfigureResampler(reader, resampler, &resample, &channels, &sampleRate);
+	if (FAILED(hr))
+		goto cleanup;
+
+	hr = output->writer.Open(outputPath);
+	if (FAILED(hr))
+		goto cleanup;
+
+	for (;;) {
+		DWORD flags = 0;
+		IMFSample *sample = NULL;
+		IMFMediaBuffer *buffer = NULL;
+		BYTE *data = NULL;
+		DWORD bytes = 0;
+		hr = reader->ReadSample((DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, 0, NULL, &flags, NULL, &sample);
+		if (FAILED(hr) || (flags & MF_SOURCE_READERF_ENDOFSTREAM)) {
+			SafeRelease(&sample);
+			break;
+		}
+		if (flags & MF_SOURCE_READERF_CURRENTMEDIATYPECHANGED) {
+			// The rate or channel count changed midway, as it can in concatenated MP3s and
+			// some broadcast captures. Finish the audio of the old format, then set up for the new one.
+			if (resample && lastBytes)
+				hr = DrainResampler(*output, resampler, lastBytes);
+			lastBytes = 0;
+			if (SUCCEEDED(hr))
+				hr = ConfigureResampler(reader, resampler, &resample, &channels, &sampleRate);
+			if (FAILED(hr)) {
+				SafeRelease(&sample);
+				break;
+			}
+		}
+		if (!sample)
+			continue;
+		hr = sample->ConvertToContiguousBuffer(&buffer);
+		if (SUCCEEDED(hr))
+			hr = buffer->Lock(&data, NULL, &bytes);
+		if (SUCCEEDED(hr)) {
+			audioSeconds += (double)(bytes / (channels * sizeof(float))) / sampleRate;
+			if (resample) {
+				WWMFSampleData resampled;
+				hr = resampler.Resample(data, bytes, &resampled);
+				if (SUCCEEDED(hr))
+					Feed(*output, (const float*)resampled.data, resampled.bytes / (2 * sizeof(float)));
+				resampled.Release();
+				lastBytes = bytes;
+			} else {
+				Feed(*output, (const float*)data, bytes / (2 * sizeof(float)));
+			}
+			buffer->Unlock();
+		}
+		SafeRelease(&buffer);
+		SafeRelease(&sample);
+		if (SUCCEEDED(hr))
+			hr = output->hr;
+		if (FAILED(hr))
+			break;
+	}
+
+	if (SUCCEEDED(hr) && resample && lastBytes)
+		hr = DrainResampler(*output, resampler, lastBytes);
+	if (SUCCEEDED(hr) && output->filled) {
+		// Pad the last partial window with silence so the end of the track is covered.
+		DWORD flags;
+		memset(output->left + output->filled, 0, (SHARED_WAVEFORM_SAMPLES - output->filled) * sizeof(float));
+		memset(output->right + output->filled, 0, (SHARED_WAVEFORM_SAMPLES - output->filled) * sizeof(float));
+		WriteWindow(*output, &flags);
+		hr = output->hr;
+	}
+	if (SUCCEEDED(hr))
+		hr = output->writer.Close();
+	file->audioSeconds = audioSeconds;
+
+cleanup:
+	output->writer.Abandon();
+	output->~BatchOutput();
+	_aligned_free(output);
+	resampler.Finalize();
+	SafeRelease(&requested);
+	SafeRelease(&reader);
+	return hr;
+}
+
+static void AnalyzeItem(void *item, int worker, void *context) {
+	BatchFile *file = (BatchFile*)item;
+	LARGE_INTEGER start, end, frequency;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	if (SUCCEEDED(hr)) {
+		file->hr = AnalyzeFile(file);
+		CoUninitialize();
+	} else {
+		file->hr = hr;
+	}
+	QueryPerformanceCounter(&end);
+	file->wallSeconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+	if (SUCCEEDED(file->hr)) {
+		BATCH_LOG(L"Analyzed %s: %.1f s of audio in %.2f s on worker %d", file->path, file->audioSeconds, file->wallSeconds, worker);
+	} else {
+		BATCH_ERR(L"analyzing %s failed: hr = 0x%08x", file->path, file->hr);
+	}
+}
+
+int BatchAnalyze(const wchar_t *path, int threads) {
+	std::vector<BatchFile*> files;
+	BatchOutputOpen();
+	DWORD attributes = GetFileAttributesW(path);
+	if (attributes == INVALID_FILE_ATTRIBUTES) {
+		BATCH_ERR(L"%s not found", path);
+		BatchOutputClose();
+		return 1;
+	}
+	if (attributes & FILE_ATTRIBUTE_DIRECTORY) {
+		FindFiles(files, path);
+	} else {
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		LONGLONG bytes = 0;
+		if (GetFileAttributesExW(path, GetFileExInfoStandard, &data))
+			bytes = ((LONGLONG)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		AddFile(files, path, bytes);
+	}
+	std::sort(files.begin(), files.end(), LargerFirst);
+
+	HRESULT hr = MFStartup(MF_VERSION, MFSTARTUP_NOSOCKET);
+	if (FAILED(hr)) {
+		BATCH_ERR(L"MFStartup failed: hr = 0x%08x", hr);
+		for (size_t i = 0; i < files.size(); i++)
+			delete files[i];
+		BatchOutputClose();
+		return (int)files.size();
+	}
+
+	WorkPool pool;
+	pool.Reset(threads);
+	for (size_t i = 0; i < files.size(); i++)
+		pool.Add(files[i]);
+
+	LARGE_INTEGER start, end, frequency;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	hr = pool.Run(AnalyzeItem, NULL);
+	QueryPerformanceCounter(&end);
+	if (FAILED(hr))
+		BATCH_ERR(L"starting every worker failed: hr = 0x%08x", hr);
+	MFShutdown();
+
+	int failed = 0;
+	double audioSeconds = 0;
+	double busySeconds = 0;
+	for (size_t i = 0; i < files.size(); i++) {
+		if (FAILED(files[i]->hr))
+			failed++;
+		audioSeconds += files[i]->audioSeconds;
+		busySeconds += files[i]->wallSeconds;
+		delete files[i];
+	}
+	int stolen = 0;
+	for (int i = 0; i < pool.Threads(); i++)
+		stolen += pool.Stolen(i);
+
+	// Utilization is the share of worker time spent on files; with it near 100%, the realtime
+	// factor per thread stays flat as threads are added unless the workers contend.
+	double wallSeconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+	BATCH_LOG(L"Batch analysis: %u files, %d failed, %.1f s of audio in %.2f s on %d threads: %.0fx realtime, %.0fx per thread, %.0f%% utilization, %d stolen",
+		(UINT)files.size(), failed, audioSeconds, wallSeconds, pool.Threads(),
+		wallSeconds > 0 ? audioSeconds / wallSeconds : 0, wallSeconds > 0 ? audioSeconds / wallSeconds / pool.Threads() : 0,
+		wallSeconds > 0 ? 100 * busySeconds / (wallSeconds * pool.Threads()) : 0, stolen);
+	BatchOutputClose();
+	return failed;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <windows.h>
+
+/// Offline analysis of an audio library into feature files (see FeatureFile.h),
+/// so pre-produced shows can play back precomputed windows instead of
+/// capturing live.
+///
+/// Each file is decoded to float by the Media Foundation source reader,
+/// brought to stereo 44.1 kHz by the same resampler the live path uses,
+/// cut into 576-sample windows and run through the Analyzer. Files are
+/// spread over a WorkPool with one thread per logical processor by default;
+/// one file is the unit of work, so a library of many tracks scales across
+/// cores while a single file runs on one.
+///
+/// Each input gets a feature file next to it, e.g. track.mp3.mbf. Every
+/// file is logged, followed by a summary with the realtime factor and
+/// thread utilization; the same lines go to stdout, or to the console the
+/// run was started from.
+
+/// Analyzes path, a single file or a directory searched recursively.
+/// @param threads worker threads, or 0 for one per logical processor
+/// @return the number of files that failed
+int BatchAnalyze(const wchar_t *path, int threads);
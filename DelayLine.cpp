@@ -0,0 +1,65 @@
+#include "DelayLine.h"
+
+#include <math.h>
+#include <new>
+
+// Slots are sized for windows arriving this often, i.e. up to 250 frames per second.
+#define DELAY_MIN_WINDOW_MS 4.0
+
+DelayLine::DelayLine(void) : slots(NULL), capacity(0), head(0), count(0), delayMs(0), delayTicks(0) {
+}
+
+DelayLine::~DelayLine(void) {
+	delete[] slots;
+}
+
+HRESULT DelayLine::SetDelay(double delayMs) {
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	if (delayMs < 0)
+		delayMs = 0;
+
+	// One slot for the window being shown and one for the window arriving.
+	int needed = (int)ceil(delayMs / DELAY_MIN_WINDOW_MS) + 2;
+	if (needed > capacity) {
+		Slot *grown = new (std::nothrow) Slot[needed];
+		if (!grown)
+			return E_OUTOFMEMORY;
+		delete[] slots;
+		slots = grown;
+		capacity = needed;
+		Clear();
+	}
+	this->delayMs = delayMs;
+	delayTicks = (LONGLONG)(delayMs * frequency.QuadPart / 1000.0);
+	return S_OK;
+}
+
+void DelayLine::Push(const float *left, const float *right, LONGLONG qpc) {
+	if (!capacity)
+		return;
+	if (count == capacity) {
+		head = (head + 1) % capacity;
+		count--;
+	}
+	Slot &slot = slots[(head + count) % capacity];
+	slot.due = qpc + delayTicks;
+	memcpy(slot.left, left, sizeof(slot.left));
+	memcpy(slot.right, right, sizeof(slot.right));
+	count++;
+}
+
+bool DelayLine::Pop(LONGLONG now, float *left, float *right) {
+	if (count == 0 || slots[head].due > now)
+		return false;
+	memcpy(left, slots[head].left, sizeof(slots[head].left));
+	memcpy(right, slots[head].right, sizeof(slots[head].right));
+	head = (head + 1) % capacity;
+	count--;
+	return true;
+}
+
+void DelayLine::Clear(void) {
+	head = 0;
+	count = 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <windows.h>
+
+#include "Visualizer.h"
+
+/// Holds windows until they are due, so the visualizer draws a sound when it
+/// is heard rather than when loopback captured it.
+///
+/// Each window is stamped with its QueryPerformanceCounter capture time and
+/// becomes due delayMs later. The ring is allocated in SetDelay() with just
+/// enough slots for the delay at the highest frame rate expected, and pushing
+/// and popping never allocate.
+class DelayLine {
+public:
+	DelayLine(void);
+	~DelayLine(void);
+
+	/// Sets the delay. Windows already held keep their due times unless the ring
+	/// has to grow, in which case they are dropped.
+	HRESULT SetDelay(double delayMs);
+
+	double GetDelay(void) const {
+		return delayMs;
+	}
+
+	/// Adds a window captured at qpc. If the ring is full the oldest window is dropped.
+	void Push(const float *left, const float *right, LONGLONG qpc);
+
+	/// Copies out the oldest window that is due at now and removes it. Call until it
+	/// returns false to hand every due window over in order.
+	/// @return false if no window is due yet
+	bool Pop(LONGLONG now, float *left, float *right);
+
+	void Clear(void);
+
+private:
+	struct Slot {
+		LONGLONG due;
+		float left[VISUALIZER_SAMPLES];
+		float right[VISUALIZER_SAMPLES];
+	};
+
+	Slot *slots;
+	int capacity;
+	int head;
+	int count;
+	double delayMs;
+	LONGLONG delayTicks;
+};
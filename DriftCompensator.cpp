@@ -0,0 +1,94 @@
+#include "DriftCompensator.h"
+
+// Proportional gain, in read-step units per unit of relative fill error.
+#define DRIFT_KP 3e-3
+// Integral gain, per second of accumulated relative fill error. With DRIFT_KP and a
+// two-window target the loop is close to critically damped, and a constant 500 ppm
+// offset is absorbed within about half a minute.
+#define DRIFT_KI 1e-4
+// Fill level smoothing per update; packet arrival makes the raw fill very jumpy.
+#define DRIFT_SMOOTHING 0.02
+// A schedule left further behind than this, by a stall on either side, skips ahead
+// instead of taking every missed window at once.
+#define DRIFT_MAX_LATE_WINDOWS 4
+
+DriftCompensator::DriftCompensator(void) {
+	Reset(0, 0, 44100);
+}
+
+void DriftCompensator::Reset(double targetFill, double maxPpm, double sampleRate) {
+	this->targetFill = targetFill;
+	this->sampleRate = sampleRate;
+	maxStep = maxPpm * 1e-6;
+	ratio = 1.0;
+	integral = 0;
+	phase = 0;
+	smoothedFill = targetFill;
+	scheduled = false;
+	nextWindow = 0;
+	lastUpdate = 0;
+	takeTime = 0;
+}
+
+bool DriftCompensator::Due(double now, double fill, int n) {
+	double period = n / sampleRate;
+	if (!scheduled) {
+		if (targetFill <= 0 || fill < targetFill + n)
+			return false;
+		scheduled = true;
+		nextWindow = now;
+		lastUpdate = now;
+	}
+	if (now - nextWindow > DRIFT_MAX_LATE_WINDOWS * period)
+		nextWindow = now - DRIFT_MAX_LATE_WINDOWS * period;
+	if (now < nextWindow || fill < Needed(n))
+		return false;
+	nextWindow += period;
+	takeTime = now;
+	return true;
+}
+
+void DriftCompensator::Update(double fill, double seconds) {
+	smoothedFill += (fill - smoothedFill) * DRIFT_SMOOTHING;
+	double error = (smoothedFill - targetFill) / targetFill;
+	double step = DRIFT_KP * error + DRIFT_KI * (integral + error * seconds);
+
+	// Only integrate while the output is not saturated so the integral does not wind up.
+	if (step > maxStep)
+		step = maxStep;
+	else if (step < -maxStep)
+		step = -maxStep;
+	else
+		integral += error * seconds;
+
+	ratio = 1.0 + step;
+}
+
+size_t DriftCompensator::Needed(int n) const {
+	// Last interpolated sample reads index floor(phase + (n - 1) * ratio) + 1.
+	return (size_t)(phase + (n - 1) * ratio) + 2;
+}
+
+bool DriftCompensator::Take(Backlog &backlog, float *outLeft, float *outRight, int n) {
+	if (backlog.Size() < Needed(n))
+		return false;
+
+	for (int i = 0; i < n; ++i) {
+		double pos = phase + i * ratio;
+		size_t index = (size_t)pos;
+		float frac = (float)(pos - index);
+		float left = backlog.Left(index);
+		float right = backlog.Right(index);
+		outLeft[i] = left + (backlog.Left(index + 1) - left) * frac;
+		outRight[i] = right + (backlog.Right(index + 1) - right) * frac;
+	}
+
+	double end = phase + n * ratio;
+	size_t consumed = (size_t)end;
+	phase = end - consumed;
+	backlog.Consume(consumed);
+
+	Update((double)backlog.Size(), takeTime - lastUpdate);
+	lastUpdate = takeTime;
+	return true;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <windows.h>
+
+#include "Backlog.h"
+
+/// Holds the capture backlog at a target fill level by reading it back at a
+/// slightly variable rate. The capture clock and the render loop never run at
+/// exactly the same speed, so instead of letting the backlog ride at its cap
+/// or underrun, a PI controller steers the fractional read step within
+/// +-maxPpm and windows are produced by interpolating between samples.
+/// Nothing is dropped or duplicated; the drift is absorbed as a tiny pitch
+/// shift that is far below audibility.
+///
+/// Windows fall due by the render clock at the nominal sample rate, however
+/// fast or slow the render loop runs, so the backlog only moves with the
+/// drift between the two clocks.
+class DriftCompensator {
+public:
+	DriftCompensator(void);
+
+	/// @param targetFill backlog, in output samples, the controller steers towards
+	/// @param maxPpm largest correction applied to the read step, in parts per million
+	/// @param sampleRate nominal rate of the backlog, which sets when windows fall due
+	void Reset(double targetFill, double maxPpm, double sampleRate);
+
+	/// Decides whether the next window of n samples should be taken now; call
+	/// Take() after every true return. The schedule starts once the backlog
+	/// holds the target plus a window; the ramp-up after a stream start is not
+	/// drift.
+	/// @param now render clock, in seconds
+	/// @param fill samples waiting in the backlog
+	bool Due(double now, double fill, int n);
+
+	/// Number of backlog samples that must be present before Take() can produce n samples.
+	size_t Needed(int n) const;
+
+	/// Interpolates one window of n samples per channel out of the backlog at the
+	/// current read step and removes the consumed samples. The backlog left
+	/// behind and the time since the previous window then go to the controller,
+	/// so the fill it steers does not depend on how many windows a frame takes.
+	/// @return false when the backlog is too short, in which case nothing is consumed
+	bool Take(Backlog &backlog, float *outLeft, float *outRight, int n);
+
+	double GetRatio(void) const {
+		return ratio;
+	}
+
+	double GetPpm(void) const {
+		return (ratio - 1.0) * 1e6;
+	}
+
+	double GetSmoothedFill(void) const {
+		return smoothedFill;
+	}
+
+private:
+	void Update(double fill, double seconds);
+
+	double targetFill;
+	double maxStep;
+	double sampleRate;
+	double ratio;
+	double integral;
+	double phase;
+	double smoothedFill;
+	bool scheduled;
+	/// Render clock when the next window falls due, when the window being taken
+	/// was due, and when the controller last ran.
+	double nextWindow;
+	double takeTime;
+	double lastUpdate;
+};
@@ -0,0 +1,231 @@
+#include "FeatureFile.h"
+
+#include <math.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "Visualizer.h"
+
+// Records collected before each WriteFile, about 440 KB.
+#define FEATURE_WRITE_RECORDS 256
+
+FeatureFileWriter::FeatureFileWriter(void) : file(INVALID_HANDLE_VALUE), buffer(NULL), buffered(0), recordCount(0),
+	onsets(NULL), onsetCount(0), onsetCapacity(0) {
+	path[0] = L'\0';
+	partialPath[0] = L'\0';
+}
+
+FeatureFileWriter::~FeatureFileWriter(void) {
+	Abandon();
+}
+
+HRESULT FeatureFileWriter::Open(const wchar_t *finalPath) {
+	Abandon();
+	if (wcscpy_s(path, finalPath) || swprintf_s(partialPath, L"%s.partial", finalPath) < 0)
+		return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+
+	buffer = new FeatureRecord[FEATURE_WRITE_RECORDS];
+	file = CreateFileW(partialPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	// Room for the header; Close() fills it in.
+	FeatureFileHeader header;
+	memset(&header, 0, sizeof(header));
+	DWORD written;
+	if (!WriteFile(file, &header, sizeof(header), &written, NULL))
+		return HRESULT_FROM_WIN32(GetLastError());
+	return S_OK;
+}
+
+HRESULT FeatureFileWriter::Write(const float *left, const float *right, const float *spectrum, const SharedWaveformAnalysis &analysis, DWORD flags) {
+	if (file == INVALID_HANDLE_VALUE)
+		return E_UNEXPECTED;
+
+	FeatureRecord &record = buffer[buffered];
+	record.flags = flags;
+	record.analysis = analysis;
+	QuantizeWaveform(left, right, SHARED_WAVEFORM_SAMPLES, (BYTE*)record.waveform);
+	for (int i = 0; i < 2 * SHARED_WAVEFORM_BINS; i++) {
+		// Anything that would round below code 1 is stored as silence.
+		float code = spectrum[i] > 0 ? (20.0f * log10f(spectrum[i]) - FEATURE_SPECTRUM_FLOOR_DB) / FEATURE_SPECTRUM_STEP_DB + 0.5f : 0;
+		(&record.spectrum[0][0])[i] = (BYTE)(code < 1.0f ? 0 : code > 255.0f ? 255 : code);
+	}
+
+	if (flags & SHARED_WAVEFORM_ONSET) {
+		if (onsetCount == onsetCapacity) {
+			LONGLONG capacity = onsetCapacity ? onsetCapacity * 2 : 1024;
+			LONGLONG *grown = new LONGLONG[(size_t)capacity];
+			if (onsetCount)
+				memcpy(grown, onsets, (size_t)onsetCount * sizeof(LONGLONG));
+			delete[] onsets;
+			onsets = grown;
+			onsetCapacity = capacity;
+		}
+		onsets[onsetCount++] = recordCount;
+	}
+	recordCount++;
+	if (++buffered == FEATURE_WRITE_RECORDS)
+		return Flush();
+	return S_OK;
+}
+
+HRESULT FeatureFileWriter::Flush(void) {
+	DWORD bytes = buffered * sizeof(FeatureRecord);
+	DWORD written;
+	buffered = 0;
+	if (bytes && !WriteFile(file, buffer, bytes, &written, NULL))
+		return HRESULT_FROM_WIN32(GetLastError());
+	return S_OK;
+}
+
+HRESULT FeatureFileWriter::Close(void) {
+	if (file == INVALID_HANDLE_VALUE)
+		return E_UNEXPECTED;
+
+	HRESULT hr = Flush();
+	DWORD written;
+	if (SUCCEEDED(hr) && onsetCount && !WriteFile(file, onsets, (DWORD)(onsetCount * sizeof(LONGLONG)), &written, NULL))
+		hr = HRESULT_FROM_WIN32(GetLastError());
+
+	FeatureFileHeader header;
+	header.magic = FEATURE_FILE_MAGIC;
+	header.version = FEATURE_FILE_VERSION;
+	header.sampleRate = 44100;
+	header.samples = SHARED_WAVEFORM_SAMPLES;
+	header.bins = SHARED_WAVEFORM_BINS;
+	header.recordBytes = sizeof(FeatureRecord);
+	header.recordCount = recordCount;
+	header.recordOffset = sizeof(FeatureFileHeader);
+	header.onsetOffset = header.recordOffset + recordCount * sizeof(FeatureRecord);
+	header.onsetCount = onsetCount;
+	if (SUCCEEDED(hr) && (SetFilePointer(file, 0, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER ||
+		!WriteFile(file, &header, sizeof(header), &written, NULL)))
+		hr = HRESULT_FROM_WIN32(GetLastError());
+
+	CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+	if (SUCCEEDED(hr) && !MoveFileExW(partialPath, path, MOVEFILE_REPLACE_EXISTING))
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	Abandon();
+	return hr;
+}
+
+void FeatureFileWriter::Abandon(void) {
+	if (file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+	}
+	if (partialPath[0])
+		DeleteFileW(partialPath);
+	partialPath[0] = L'\0';
+	delete[] buffer;
+	buffer = NULL;
+	buffered = 0;
+	delete[] onsets;
+	onsets = NULL;
+	onsetCount = 0;
+	onsetCapacity = 0;
+	recordCount = 0;
+}
+
+FeatureFileReader::FeatureFileReader(void) : file(INVALID_HANDLE_VALUE), mapping(NULL), view(NULL), header(NULL) {
+}
+
+FeatureFileReader::~FeatureFileReader(void) {
+	Close();
+}
+
+HRESULT FeatureFileReader::Open(const wchar_t *path) {
+	Close();
+
+	file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		Close();
+		return hr;
+	}
+	if (size.QuadPart < (LONGLONG)sizeof(FeatureFileHeader)) {
+		Close();
+		return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+	}
+
+	mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping)
+		view = (const BYTE*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		Close();
+		return hr;
+	}
+
+	// Counts are checked by division against the bytes after their offset, so no header value,
+	// however large, can overflow its way past the end of the file.
+	header = (const FeatureFileHeader*)view;
+	if (header->magic != FEATURE_FILE_MAGIC || header->version != FEATURE_FILE_VERSION ||
+		header->sampleRate == 0 || header->samples != SHARED_WAVEFORM_SAMPLES ||
+		header->bins != SHARED_WAVEFORM_BINS || header->recordBytes != sizeof(FeatureRecord) ||
+		header->recordOffset < (LONGLONG)sizeof(FeatureFileHeader) || header->recordOffset > size.QuadPart ||
+		header->recordCount < 0 || header->recordCount > (size.QuadPart - header->recordOffset) / (LONGLONG)sizeof(FeatureRecord) ||
+		header->onsetOffset < (LONGLONG)sizeof(FeatureFileHeader) || header->onsetOffset > size.QuadPart ||
+		header->onsetCount < 0 || header->onsetCount > (size.QuadPart - header->onsetOffset) / (LONGLONG)sizeof(LONGLONG)) {
+		Close();
+		return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+	}
+	return S_OK;
+}
+
+void FeatureFileReader::Close(void) {
+	if (view) {
+		UnmapViewOfFile(view);
+		view = NULL;
+	}
+	header = NULL;
+	if (mapping) {
+		CloseHandle(mapping);
+		mapping = NULL;
+	}
+	if (file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+	}
+}
+
+LONGLONG FeatureFileReader::IndexAt(double seconds) const {
+	if (seconds < 0)
+		return -1;
+	return (LONGLONG)(seconds * header->sampleRate / header->samples);
+}
+
+const FeatureRecord *FeatureFileReader::Record(LONGLONG index) const {
+	if (!view || index < 0 || index >= header->recordCount)
+		return NULL;
+	return (const FeatureRecord*)(view + header->recordOffset) + index;
+}
+
+const LONGLONG *FeatureFileReader::Onsets(LONGLONG *count_return) const {
+	*count_return = view ? header->onsetCount : 0;
+	return view ? (const LONGLONG*)(view + header->onsetOffset) : NULL;
+}
+
+void FeatureFileReader::Waveform(const FeatureRecord &record, float *left, float *right) {
+	for (int i = 0; i < SHARED_WAVEFORM_SAMPLES; i++) {
+		left[i] = record.waveform[0][i] * (1.0f / 128.0f);
+		right[i] = record.waveform[1][i] * (1.0f / 128.0f);
+	}
+}
+
+void FeatureFileReader::Spectrum(const FeatureRecord &record, float *spectrum) {
+	static float magnitudes[256];
+	if (magnitudes[255] == 0) {
+		// Code 0 stays silence. Only the playback thread expands spectra, so this needs no lock.
+		for (int code = 1; code < 256; code++)
+			magnitudes[code] = powf(10.0f, (FEATURE_SPECTRUM_FLOOR_DB + code * FEATURE_SPECTRUM_STEP_DB) / 20.0f);
+	}
+	for (int i = 0; i < 2 * SHARED_WAVEFORM_BINS; i++)
+		spectrum[i] = magnitudes[(&record.spectrum[0][0])[i]];
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <windows.h>
+
+#include "SharedWaveform.h"
+
+/// Precomputed analysis of a whole audio file, written by the batch analyzer
+/// and streamed by the host in place of live capture.
+///
+/// The file is a header, one fixed-size record per 576-sample window at
+/// 44.1 kHz, and an index of the windows that start an onset. Records sit at a
+/// fixed stride, so the window for any playback position is one multiply
+/// away; the reader maps the whole file and hands out pointers into it.
+/// Waveforms are signed 8-bit, the resolution visualizers are handed anyway,
+/// and spectra 8-bit log magnitude, about 130 KB per second of audio.
+
+#define FEATURE_FILE_MAGIC 0x4546424D // "MBFE"
+#define FEATURE_FILE_VERSION 2
+#define FEATURE_FILE_EXTENSION L".mbf"
+/// Spectrum magnitudes are stored in decibels: 0 is silence and code c stands for
+/// FEATURE_SPECTRUM_FLOOR_DB + c * FEATURE_SPECTRUM_STEP_DB, so 1..255 cover -89.6 to +12 dB
+/// in steps of 0.4 dB.
+#define FEATURE_SPECTRUM_FLOOR_DB -90.0f
+#define FEATURE_SPECTRUM_STEP_DB 0.4f
+
+struct FeatureFileHeader {
+	DWORD magic;
+	DWORD version;
+	DWORD sampleRate;
+	DWORD samples;
+	DWORD bins;
+	DWORD recordBytes;
+	LONGLONG recordCount;
+	/// Byte offset of the first record.
+	LONGLONG recordOffset;
+	/// Byte offset of onsetCount window numbers (LONGLONG), ascending.
+	LONGLONG onsetOffset;
+	LONGLONG onsetCount;
+};
+
+struct FeatureRecord {
+	/// SHARED_WAVEFORM_ONSET or 0.
+	DWORD flags;
+	SharedWaveformAnalysis analysis;
+	/// Laid out like winampVisModule::waveformData.
+	signed char waveform[2][SHARED_WAVEFORM_SAMPLES];
+	BYTE spectrum[2][SHARED_WAVEFORM_BINS];
+};
+
+/// Writes a feature file sequentially. The file appears under its final name
+/// only once Close() succeeds, so an interrupted run never leaves a truncated
+/// file for the host to play.
+class FeatureFileWriter {
+public:
+	FeatureFileWriter(void);
+	~FeatureFileWriter(void);
+
+	HRESULT Open(const wchar_t *path);
+
+	/// Appends one window.
+	/// @param spectrum 2*SHARED_WAVEFORM_BINS magnitudes, left then right
+	HRESULT Write(const float *left, const float *right, const float *spectrum, const SharedWaveformAnalysis &analysis, DWORD flags);
+
+	/// Writes the onset index and header and moves the file into place.
+	HRESULT Close(void);
+
+	/// Deletes the partial file.
+	void Abandon(void);
+
+	LONGLONG RecordCount(void) const {
+		return recordCount;
+	}
+
+private:
+	HRESULT Flush(void);
+
+	HANDLE file;
+	wchar_t path[MAX_PATH];
+	wchar_t partialPath[MAX_PATH];
+	FeatureRecord *buffer;
+	int buffered;
+	LONGLONG recordCount;
+	LONGLONG *onsets;
+	LONGLONG onsetCount;
+	LONGLONG onsetCapacity;
+};
+
+/// Maps a feature file read-only.
+class FeatureFileReader {
+public:
+	FeatureFileReader(void);
+	~FeatureFileReader(void);
+
+	/// @return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT) if the file is not a feature file of this version
+	HRESULT Open(const wchar_t *path);
+	void Close(void);
+
+	bool IsOpen(void) const {
+		return view != NULL;
+	}
+
+	LONGLONG RecordCount(void) const {
+		return header->recordCount;
+	}
+
+	/// Seconds of audio covered.
+	double Duration(void) const {
+		return (double)header->recordCount * header->samples / header->sampleRate;
+	}
+
+	/// Number of the window covering the given time, or -1 before the start.
+	LONGLONG IndexAt(double seconds) const;
+
+	const FeatureRecord *Record(LONGLONG index) const;
+
+	/// Window numbers of every onset, ascending.
+	const LONGLONG *Onsets(LONGLONG *count_return) const;
+
+	/// Expands a record's waveform to float, for Visualizer::AddWindow().
+	static void Waveform(const FeatureRecord &record, float *left, float *right);
+
+	/// Expands a record's spectrum to float, left then right.
+	static void Spectrum(const FeatureRecord &record, float *spectrum);
+
+private:
+	HANDLE file;
+	HANDLE mapping;
+	const BYTE *view;
+	const FeatureFileHeader *header;
+};
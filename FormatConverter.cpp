@@ -0,0 +1,100 @@
+#include "FormatConverter.h"
+
+#include <mmreg.h>
+#include <ks.h>
+#include <ksmedia.h>
+
+static bool SampleTypeOf(const WAVEFORMATEX *format, bool *isFloat) {
+	if (format->wFormatTag == WAVE_FORMAT_IEEE_FLOAT) {
+		*isFloat = true;
+		return true;
+	}
+	if (format->wFormatTag == WAVE_FORMAT_PCM) {
+		*isFloat = false;
+		return true;
+	}
+	if (format->wFormatTag == WAVE_FORMAT_EXTENSIBLE) {
+		const WAVEFORMATEXTENSIBLE *extensible = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(format);
+		if (IsEqualGUID(KSDATAFORMAT_SUBTYPE_IEEE_FLOAT, extensible->SubFormat)) {
+			*isFloat = true;
+			return true;
+		}
+		if (IsEqualGUID(KSDATAFORMAT_SUBTYPE_PCM, extensible->SubFormat)) {
+			*isFloat = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+FormatConverter::FormatConverter(void) : type(SAMPLE_FLOAT32), channels(2), sampleBytes(4), frameBytes(8), step(1.0),
+	phase(0), lastLeft(0), lastRight(0), primed(false) {
+}
+
+bool FormatConverter::Supports(const WAVEFORMATEX *format) {
+	bool isFloat;
+	if (!SampleTypeOf(format, &isFloat) || format->nChannels < 1 || !format->nSamplesPerSec)
+		return false;
+	if (isFloat)
+		return format->wBitsPerSample == 32;
+	return format->wBitsPerSample == 16 || format->wBitsPerSample == 24 || format->wBitsPerSample == 32;
+}
+
+HRESULT FormatConverter::Reset(const WAVEFORMATEX *format, DWORD outputRate) {
+	bool isFloat;
+	if (!Supports(format) || !SampleTypeOf(format, &isFloat) || !outputRate)
+		return E_INVALIDARG;
+	if (isFloat)
+		type = SAMPLE_FLOAT32;
+	else if (format->wBitsPerSample == 16)
+		type = SAMPLE_INT16;
+	else if (format->wBitsPerSample == 24)
+		type = SAMPLE_INT24;
+	else
+		type = SAMPLE_INT32;
+	channels = format->nChannels;
+	sampleBytes = format->wBitsPerSample / 8;
+	frameBytes = format->nBlockAlign;
+	step = (double)format->nSamplesPerSec / outputRate;
+	phase = 0;
+	lastLeft = 0;
+	lastRight = 0;
+	primed = false;
+	return S_OK;
+}
+
+float FormatConverter::Read(const BYTE *frame, int channel) const {
+	const BYTE *sample = frame + channel * sampleBytes;
+	switch (type) {
+	case SAMPLE_FLOAT32:
+		return *(const float*)sample;
+	case SAMPLE_INT16:
+		return *(const short*)sample * (1.0f / 32768.0f);
+	case SAMPLE_INT24:
+		return (int)((sample[0] << 8) | (sample[1] << 16) | (sample[2] << 24)) * (1.0f / 2147483648.0f);
+	default:
+		return *(const int*)sample * (1.0f / 2147483648.0f);
+	}
+}
+
+void FormatConverter::Convert(const BYTE *data, DWORD frames, Backlog &backlog) {
+	for (DWORD i = 0; i < frames; i++) {
+		const BYTE *frame = data + i * frameBytes;
+		float l = Read(frame, 0);
+		float r = channels > 1 ? Read(frame, 1) : l;
+		if (!primed) {
+			lastLeft = l;
+			lastRight = r;
+			primed = true;
+			continue;
+		}
+		while (phase <= 1.0) {
+			float t = (float)phase;
+			backlog.Push(lastLeft + (l - lastLeft) * t, lastRight + (r - lastRight) * t);
+			phase += step;
+		}
+		phase -= 1.0;
+		lastLeft = l;
+		lastRight = r;
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <windows.h>
+
+#include "Backlog.h"
+
+/// In-process conversion of a shared-mode mix format to float stereo at the
+/// pipeline rate: reads float or integer PCM, keeps the front left and right
+/// channels (mono is duplicated) and resamples by linear interpolation.
+///
+/// Much cheaper than the Media Foundation resampler and, with no filtering,
+/// lower quality; a visualizer does not hear the aliasing. The interpolation
+/// phase carries over between calls, so packets of any size join seamlessly.
+class FormatConverter {
+public:
+	FormatConverter(void);
+
+	/// True if Reset() accepts format.
+	static bool Supports(const WAVEFORMATEX *format);
+
+	/// @return E_INVALIDARG if the sample format is not supported
+	HRESULT Reset(const WAVEFORMATEX *format, DWORD outputRate);
+
+	/// Converts frames of input and appends the result to the backlog.
+	void Convert(const BYTE *data, DWORD frames, Backlog &backlog);
+
+private:
+	enum SampleType {
+		SAMPLE_FLOAT32,
+		SAMPLE_INT16,
+		SAMPLE_INT24,
+		SAMPLE_INT32
+	};
+
+	float Read(const BYTE *frame, int channel) const;
+
+	SampleType type;
+	int channels;
+	int sampleBytes;
+	int frameBytes;
+	// Input frames per output sample.
+	double step;
+	// Position of the next output sample between the previous input frame (0) and the next one (1).
+	double phase;
+	float lastLeft;
+	float lastRight;
+	bool primed;
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "AllocProfile.h"
+
+/// Writes one line to the debugger output. format must be a wide string
+/// literal, and the line must fit in 2048 characters. Both expand to a block,
+/// so brace them under an if that has an else.
+#define LOG(format, ...) \
+{ \
+	ALLOC_TAG("Log"); \
+	wchar_t buffer[2048]; \
+	swprintf_s(buffer, _countof(buffer), format L"\n", __VA_ARGS__); \
+	OutputDebugStringW(buffer); \
+}
+#define ERR(format, ...) LOG(L"Error: " format, __VA_ARGS__)
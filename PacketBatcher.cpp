@@ -0,0 +1,57 @@
+#include "PacketBatcher.h"
+
+#include <string.h>
+
+// Room for a full batch plus the largest packet the shared-mode engine normally
+// hands out (a 100 ms default buffer), so a batch can always be topped up once.
+#define PACKET_BATCHER_SLACK_MS 100
+
+PacketBatcher::PacketBatcher(void) :
+	buffer(NULL), frameBytes(0), frames(0), batchFrames(0), capacityFrames(0), deadlineTicks(0), oldest(0), captured(0) {
+}
+
+PacketBatcher::~PacketBatcher(void) {
+	delete[] buffer;
+}
+
+HRESULT PacketBatcher::Reset(DWORD frameBytes, DWORD sampleRate, DWORD batchFrames, double deadlineMs) {
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	DWORD capacity = batchFrames + sampleRate * PACKET_BATCHER_SLACK_MS / 1000;
+	if (!buffer || capacity * frameBytes > capacityFrames * this->frameBytes) {
+		delete[] buffer;
+		buffer = new BYTE[capacity * frameBytes];
+		if (!buffer) {
+			capacityFrames = 0;
+			return E_OUTOFMEMORY;
+		}
+	}
+
+	this->frameBytes = frameBytes;
+	this->batchFrames = batchFrames;
+	capacityFrames = capacity;
+	deadlineTicks = (LONGLONG)(deadlineMs * frequency.QuadPart / 1000.0);
+	frames = 0;
+	oldest = 0;
+	captured = 0;
+	return S_OK;
+}
+
+bool PacketBatcher::Append(const BYTE *data, DWORD frames, LONGLONG qpc, LONGLONG captured) {
+	if (this->frames + frames > capacityFrames)
+		return false;
+	if (this->frames == 0) {
+		oldest = qpc;
+		this->captured = captured;
+	}
+	memcpy(buffer + this->frames * frameBytes, data, frames * frameBytes);
+	this->frames += frames;
+	return true;
+}
+
+bool PacketBatcher::Due(LONGLONG qpc) const {
+	if (frames == 0)
+		return false;
+	return frames >= batchFrames || qpc - oldest >= deadlineTicks;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <windows.h>
+
+/// Accumulates capture packets in front of the resampler so that
+/// WWMFResampler::Resample runs once per batch instead of once per packet.
+/// Shared-mode packets are often 10 ms or less, and each Resample call pays
+/// for GetInputStatus, ProcessInput and a ProcessOutput loop regardless of
+/// its size.
+///
+/// A batch is due once it holds batchFrames frames or its oldest frame has
+/// waited deadlineMs; callers also flush early whenever the visualizer would
+/// otherwise go without a window. The buffer is allocated once per stream.
+class PacketBatcher {
+public:
+	PacketBatcher(void);
+	~PacketBatcher(void);
+
+	/// @param frameBytes input frame size
+	/// @param sampleRate input sample rate, used for the deadline
+	/// @param batchFrames batch size at which Due() reports true; 0 disables batching
+	/// @param deadlineMs longest time a frame may wait in the batch
+	HRESULT Reset(DWORD frameBytes, DWORD sampleRate, DWORD batchFrames, double deadlineMs);
+
+	/// Copies a packet into the batch.
+	/// @param qpc time the packet was read, for the deadline
+	/// @param captured time the endpoint captured the packet's first frame, or 0 if unknown
+	/// @return false if it does not fit; flush and retry, or bypass the batch when Capacity() is too small
+	bool Append(const BYTE *data, DWORD frames, LONGLONG qpc, LONGLONG captured);
+
+	bool Due(LONGLONG qpc) const;
+
+	bool Empty(void) const {
+		return frames == 0;
+	}
+
+	const BYTE *Data(void) const {
+		return buffer;
+	}
+
+	DWORD Bytes(void) const {
+		return frames * frameBytes;
+	}
+
+	DWORD Frames(void) const {
+		return frames;
+	}
+
+	DWORD Capacity(void) const {
+		return capacityFrames;
+	}
+
+	DWORD BatchFrames(void) const {
+		return batchFrames;
+	}
+
+	/// Capture time of the batch's first frame, or 0 if unknown.
+	LONGLONG Captured(void) const {
+		return captured;
+	}
+
+	void Clear(void) {
+		frames = 0;
+	}
+
+private:
+	BYTE *buffer;
+	DWORD frameBytes;
+	DWORD frames;
+	DWORD batchFrames;
+	DWORD capacityFrames;
+	LONGLONG deadlineTicks;
+	LONGLONG oldest;
+	LONGLONG captured;
+};
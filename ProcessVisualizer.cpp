@@ -0,0 +1,198 @@
+#include "ProcessVisualizer.h"
+
+#include <string.h>
+#include <wchar.h>
+
+#include "Log.h"
+
+static LONGLONG Now(void) {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+ProcessVisualizer::ProcessVisualizer(const wchar_t *backendArguments, int hangMs) : running(false), started(0), failed(0), restarts(0),
+	since(0), publishTicks(0), publishes(0), waits(0), timeouts(0), pickupTicks(0), pickups(0) {
+	wcsncpy_s(arguments, backendArguments, _TRUNCATE);
+	swprintf_s(channelName, L"Local\\milkbottle.vis.%u", GetCurrentProcessId());
+	memset(&child, 0, sizeof(child));
+	LARGE_INTEGER qpcFrequency;
+	QueryPerformanceFrequency(&qpcFrequency);
+	frequency = qpcFrequency.QuadPart;
+	hangTicks = (LONGLONG)hangMs * frequency / 1000;
+}
+
+ProcessVisualizer::~ProcessVisualizer(void) {
+	Quit();
+}
+
+// Starts "milkbottle.exe /vischild=<channel> <mode> <arguments>".
+HRESULT ProcessVisualizer::Start(const wchar_t *mode, LONGLONG now) {
+	wchar_t path[MAX_PATH];
+	wchar_t commandLine[MAX_PATH + _countof(arguments) + 128];
+	if (!GetModuleFileNameW(NULL, path, _countof(path)))
+		return HRESULT_FROM_WIN32(GetLastError());
+	if (swprintf_s(commandLine, L"\"%s\" /vischild=%s %s %s", path, channelName, mode, arguments) < 0)
+		return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+
+	channel.Reset();
+	started = now;
+	STARTUPINFOW startup;
+	memset(&startup, 0, sizeof(startup));
+	startup.cb = sizeof(startup);
+	if (!CreateProcessW(NULL, commandLine, NULL, NULL, FALSE, 0, NULL, NULL, &startup, &child)) {
+		memset(&child, 0, sizeof(child));
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	return S_OK;
+}
+
+// Asks the child to quit and terminates it if it does not.
+void ProcessVisualizer::Stop(void) {
+	if (!child.hProcess)
+		return;
+	channel.Post(VISUALIZER_COMMAND_QUIT);
+	if (WaitForSingleObject(child.hProcess, PROCESS_VISUALIZER_QUIT_MS) != WAIT_OBJECT_0) {
+		ERR(L"visualizer child did not quit within %d ms; terminating it", PROCESS_VISUALIZER_QUIT_MS);
+		TerminateProcess(child.hProcess, 1);
+		WaitForSingleObject(child.hProcess, PROCESS_VISUALIZER_QUIT_MS);
+	}
+	CloseHandle(child.hThread);
+	CloseHandle(child.hProcess);
+	memset(&child, 0, sizeof(child));
+}
+
+void ProcessVisualizer::Restart(LONGLONG now) {
+	CloseHandle(child.hThread);
+	CloseHandle(child.hProcess);
+	memset(&child, 0, sizeof(child));
+	restarts++;
+	if (!failed)
+		failed = now;
+	// Otherwise Watch() starts the next child once the spacing has passed.
+	if (now - started >= PROCESS_VISUALIZER_RESTART_MS * frequency / 1000) {
+		HRESULT hr = Start(L"", now);
+		if (FAILED(hr))
+			ERR(L"restarting the visualizer child failed: hr = 0x%08x", hr);
+	}
+}
+
+void ProcessVisualizer::Watch(LONGLONG now) {
+	const VisualizerChannelView *view = channel.View();
+	if (!child.hProcess) {
+		if (now - started >= PROCESS_VISUALIZER_RESTART_MS * frequency / 1000) {
+			HRESULT hr = Start(L"", now);
+			if (FAILED(hr))
+				ERR(L"restarting the visualizer child failed: hr = 0x%08x", hr);
+		}
+		return;
+	}
+
+	DWORD exitCode = 0;
+	if (WaitForSingleObject(child.hProcess, 0) == WAIT_OBJECT_0) {
+		GetExitCodeProcess(child.hProcess, &exitCode);
+		ERR(L"visualizer child exited with code 0x%08x; restarting", exitCode);
+		Restart(now);
+		return;
+	}
+	LONGLONG heartbeat = AtomicRead64(&view->heartbeat);
+	if (heartbeat < started)
+		heartbeat = started;
+	if (now - heartbeat > hangTicks) {
+		ERR(L"visualizer child finished no frame for %.1f s; restarting", (double)(now - heartbeat) / frequency);
+		TerminateProcess(child.hProcess, 1);
+		WaitForSingleObject(child.hProcess, PROCESS_VISUALIZER_QUIT_MS);
+		Restart(now);
+		return;
+	}
+	if (failed && AtomicRead64(&view->frames) > 0) {
+		LOG(L"Visualizer child restarted: first frame %.0f ms after the failure was detected, %d restarts so far",
+			(now - failed) * 1000.0 / frequency, restarts);
+		failed = 0;
+	}
+}
+
+void ProcessVisualizer::Report(LONGLONG now) {
+	if (!since)
+		since = now;
+	if (now - since < PROCESS_VISUALIZER_STATS_SECONDS * frequency)
+		return;
+	const VisualizerChannelView *view = channel.View();
+	// The child's totals start over with every child.
+	LONGLONG newPickupTicks = AtomicRead64(&view->pickupTicks);
+	LONGLONG newPickups = AtomicRead64(&view->pickups);
+	LONGLONG ticks = newPickups >= pickups ? newPickupTicks - pickupTicks : newPickupTicks;
+	LONGLONG count = newPickups >= pickups ? newPickups - pickups : newPickups;
+	LOG(L"Visualizer child: publish %.2f us per window, picked up %.2f ms after publishing, %u of %u frame waits timed out, %d restarts",
+		publishes ? publishTicks * 1000000.0 / frequency / publishes : 0.0, count ? ticks * 1000.0 / frequency / count : 0.0,
+		timeouts, waits, restarts);
+	pickupTicks = newPickupTicks;
+	pickups = newPickups;
+	publishTicks = 0;
+	publishes = 0;
+	waits = 0;
+	timeouts = 0;
+	since = now;
+}
+
+HRESULT ProcessVisualizer::Init(void) {
+	HRESULT hr = channel.Create(channelName);
+	if (FAILED(hr))
+		return hr;
+	LONGLONG now = Now();
+	hr = Start(L"", now);
+	if (FAILED(hr))
+		return hr;
+	running = true;
+	failed = 0;
+	since = now;
+	pickupTicks = 0;
+	pickups = 0;
+	return S_OK;
+}
+
+void ProcessVisualizer::SetWindow(const float *left, const float *right, int samples) {
+	LONGLONG start = Now();
+	channel.Publish(left, right, samples, start);
+	publishTicks += Now() - start;
+	publishes++;
+}
+
+void ProcessVisualizer::Clear(void) {
+	channel.Post(VISUALIZER_COMMAND_CLEAR);
+}
+
+void ProcessVisualizer::Render(void) {
+	if (!running)
+		return;
+	Watch(Now());
+	if (child.hProcess) {
+		HANDLE handles[2] = { channel.FrameEvent(), child.hProcess };
+		waits++;
+		if (WaitForMultipleObjects(2, handles, FALSE, PROCESS_VISUALIZER_FRAME_WAIT_MS) == WAIT_TIMEOUT)
+			timeouts++;
+	} else {
+		// Between children: keep the capture loop at a frame-like pace.
+		Sleep(PROCESS_VISUALIZER_FRAME_WAIT_MS);
+	}
+	Report(Now());
+}
+
+void ProcessVisualizer::Quit(void) {
+	running = false;
+	Stop();
+	channel.Close();
+}
+
+void ProcessVisualizer::Config(void) {
+	// The configuration dialog is modal, as it is in-process; wait for the child to close it.
+	HRESULT hr = Start(L"/visconfig", Now());
+	if (SUCCEEDED(hr)) {
+		WaitForSingleObject(child.hProcess, INFINITE);
+		CloseHandle(child.hThread);
+		CloseHandle(child.hProcess);
+		memset(&child, 0, sizeof(child));
+	} else {
+		ERR(L"starting the visualizer child for configuration failed: hr = 0x%08x", hr);
+	}
+}
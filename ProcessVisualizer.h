@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Visualizer.h"
+#include "VisualizerChannel.h"
+
+/// Runs the real visualizer in a child copy of milkbottle (/vishost), so a
+/// long shader compile or preset load cannot stall capture and a plug-in
+/// crash cannot take the capture process down with it.
+///
+/// Windows go to the child through a VisualizerChannel; Clear() and Quit()
+/// travel as commands. Render() only waits for the child's next frame, and
+/// never longer than PROCESS_VISUALIZER_FRAME_WAIT_MS, which keeps the
+/// capture loop paced by the child without being held up by it. A child that
+/// exits, or finishes no frame for hangMs, is terminated and started again,
+/// no sooner than PROCESS_VISUALIZER_RESTART_MS after its predecessor so a
+/// plug-in that crashes on load does not spin. Publish cost, the age of
+/// windows when the child picks them up, frame waits and restarts are logged
+/// every PROCESS_VISUALIZER_STATS_SECONDS.
+
+#define PROCESS_VISUALIZER_FRAME_WAIT_MS 20
+#define PROCESS_VISUALIZER_RESTART_MS 500
+#define PROCESS_VISUALIZER_QUIT_MS 3000
+#define PROCESS_VISUALIZER_STATS_SECONDS 10
+
+class ProcessVisualizer : public Visualizer {
+public:
+	/// @param arguments backend options passed on to the child, such as /projectm
+	/// @param hangMs time without a finished frame after which the child is restarted
+	ProcessVisualizer(const wchar_t *arguments, int hangMs);
+	~ProcessVisualizer(void);
+
+	const wchar_t *Name(void) const {
+		return L"child process";
+	}
+
+	HRESULT Init(void);
+	void SetWindow(const float *left, const float *right, int samples);
+	void Clear(void);
+	void Render(void);
+	void Quit(void);
+	void Config(void);
+
+private:
+	HRESULT Start(const wchar_t *mode, LONGLONG now);
+	void Stop(void);
+	void Restart(LONGLONG now);
+	void Watch(LONGLONG now);
+	void Report(LONGLONG now);
+
+	wchar_t arguments[2048];
+	wchar_t channelName[64];
+	VisualizerChannel channel;
+	PROCESS_INFORMATION child;
+	LONGLONG frequency;
+	LONGLONG hangTicks;
+	bool running;
+	LONGLONG started;
+	/// When the failure behind the current restart was detected, 0 if none is in progress.
+	LONGLONG failed;
+	int restarts;
+
+	LONGLONG since;
+	LONGLONG publishTicks;
+	UINT publishes;
+	UINT waits;
+	UINT timeouts;
+	LONGLONG pickupTicks;
+	LONGLONG pickups;
+};
@@ -0,0 +1,154 @@
+#include "ProjectMVisualizer.h"
+
+#ifdef MILKBOTTLE_PROJECTM
+
+#include <projectM-4/projectM.h>
+
+#include "Log.h"
+
+#pragma comment(lib, "projectM-4")
+#pragma comment(lib, "opengl32")
+
+#define PROJECTM_CLASS_NAME "milkbottle projectM"
+#define PROJECTM_WIDTH 1280
+#define PROJECTM_HEIGHT 720
+
+ProjectMVisualizer::ProjectMVisualizer(const wchar_t *presetPath, bool headless) :
+	headless(headless), window(NULL), dc(NULL), context(NULL), projectM(NULL) {
+	this->presetPath[0] = '\0';
+	if (presetPath)
+		WideCharToMultiByte(CP_UTF8, 0, presetPath, -1, this->presetPath, sizeof(this->presetPath), NULL, NULL);
+	memset(interleaved, 0, sizeof(interleaved));
+}
+
+ProjectMVisualizer::~ProjectMVisualizer(void) {
+	Quit();
+}
+
+LRESULT WINAPI ProjectMVisualizer::WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+	ProjectMVisualizer *self = reinterpret_cast<ProjectMVisualizer*>(GetWindowLongPtr(hWnd, GWLP_USERDATA));
+	switch (msg) {
+	case WM_SIZE:
+		if (self && self->projectM)
+			projectm_set_window_size((projectm_handle)self->projectM, LOWORD(lParam), HIWORD(lParam));
+		return 0;
+	case WM_CLOSE:
+		// Closing the output window hides it; the tray menu decides when to stop.
+		ShowWindow(hWnd, SW_HIDE);
+		return 0;
+	}
+	return DefWindowProc(hWnd, msg, wParam, lParam);
+}
+
+HRESULT ProjectMVisualizer::Init(void) {
+	HINSTANCE instance = GetModuleHandle(NULL);
+	WNDCLASS windowClass;
+	memset(&windowClass, 0, sizeof(windowClass));
+	windowClass.style = CS_OWNDC;
+	windowClass.lpfnWndProc = WndProc;
+	windowClass.hInstance = instance;
+	windowClass.lpszClassName = PROJECTM_CLASS_NAME;
+	RegisterClass(&windowClass);
+
+	window = CreateWindow(PROJECTM_CLASS_NAME, "projectM", WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT,
+		PROJECTM_WIDTH, PROJECTM_HEIGHT, NULL, NULL, instance, NULL);
+	if (!window)
+		return HRESULT_FROM_WIN32(GetLastError());
+	SetWindowLongPtr(window, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(this));
+
+	dc = GetDC(window);
+	PIXELFORMATDESCRIPTOR pfd;
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.nSize = sizeof(pfd);
+	pfd.nVersion = 1;
+	pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+	pfd.iPixelType = PFD_TYPE_RGBA;
+	pfd.cColorBits = 32;
+	pfd.cDepthBits = 24;
+	pfd.iLayerType = PFD_MAIN_PLANE;
+	int format = ChoosePixelFormat(dc, &pfd);
+	if (!format || !SetPixelFormat(dc, format, &pfd)) {
+		HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		Quit();
+		return hr;
+	}
+
+	context = wglCreateContext(dc);
+	if (!context || !wglMakeCurrent(dc, context)) {
+		HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		Quit();
+		return hr;
+	}
+
+	projectm_handle handle = projectm_create();
+	if (!handle) {
+		Quit();
+		return E_FAIL;
+	}
+	projectM = handle;
+
+	RECT client;
+	GetClientRect(window, &client);
+	projectm_set_window_size(handle, client.right - client.left, client.bottom - client.top);
+	if (presetPath[0])
+		projectm_load_preset_file(handle, presetPath, false);
+
+	if (!headless)
+		ShowWindow(window, SW_SHOW);
+	return S_OK;
+}
+
+// projectM has no notion of a current window; its input is one continuous stream.
+void ProjectMVisualizer::SetWindow(const float *left, const float *right, int samples) {
+	AddWindow(left, right, samples);
+}
+
+void ProjectMVisualizer::AddWindow(const float *left, const float *right, int samples) {
+	if (samples > VISUALIZER_SAMPLES)
+		samples = VISUALIZER_SAMPLES;
+	for (int i = 0; i < samples; i++) {
+		interleaved[2*i] = left[i];
+		interleaved[2*i + 1] = right[i];
+	}
+	if (projectM)
+		projectm_pcm_add_float((projectm_handle)projectM, interleaved, samples, PROJECTM_STEREO);
+}
+
+void ProjectMVisualizer::Clear(void) {
+	memset(interleaved, 0, sizeof(interleaved));
+	if (projectM)
+		projectm_pcm_add_float((projectm_handle)projectM, interleaved, VISUALIZER_SAMPLES, PROJECTM_STEREO);
+}
+
+void ProjectMVisualizer::Render(void) {
+	if (!projectM)
+		return;
+	projectm_opengl_render_frame((projectm_handle)projectM);
+	SwapBuffers(dc);
+}
+
+void ProjectMVisualizer::Quit(void) {
+	if (projectM) {
+		projectm_destroy((projectm_handle)projectM);
+		projectM = NULL;
+	}
+	if (context) {
+		wglMakeCurrent(NULL, NULL);
+		wglDeleteContext(context);
+		context = NULL;
+	}
+	if (dc) {
+		ReleaseDC(window, dc);
+		dc = NULL;
+	}
+	if (window) {
+		DestroyWindow(window);
+		window = NULL;
+	}
+}
+
+void ProjectMVisualizer::Config(void) {
+	LOG(L"projectM has no configuration dialog; pass /preset=<file.milk> to choose a preset");
+}
+
+#endif
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Visualizer.h"
+
+#ifdef MILKBOTTLE_PROJECTM
+
+/// Renders through libprojectM 4 in a native OpenGL window.
+///
+/// projectM takes float PCM directly, so windows reach it without the 8-bit
+/// quantization of the Winamp ABI, and it needs neither D3D9 nor, under Wine,
+/// the D3D-to-GL translation layer. Its beat detection and FFT run on its own
+/// PCM buffer, so it takes every window through AddWindow() rather than the
+/// newest one per frame. Built only when MILKBOTTLE_PROJECTM is defined and
+/// libprojectM 4 is on the include and library paths.
+///
+/// Headless mode keeps the window hidden; with Mesa's software opengl32.dll
+/// next to the executable the backend then renders without any GPU, which
+/// is what automated frame-time runs use.
+class ProjectMVisualizer : public Visualizer {
+public:
+	/// @param presetPath .milk preset to load, or NULL for projectM's idle preset
+	ProjectMVisualizer(const wchar_t *presetPath, bool headless);
+	~ProjectMVisualizer(void);
+
+	const wchar_t *Name(void) const {
+		return L"projectM";
+	}
+
+	HRESULT Init(void);
+	void SetWindow(const float *left, const float *right, int samples);
+	void AddWindow(const float *left, const float *right, int samples);
+	void Clear(void);
+	void Render(void);
+	void Quit(void);
+	void Config(void);
+
+private:
+	static LRESULT WINAPI WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
+
+	char presetPath[MAX_PATH * 3];
+	bool headless;
+	HWND window;
+	HDC dc;
+	HGLRC context;
+	void *projectM;
+	float interleaved[2 * VISUALIZER_SAMPLES];
+};
+
+#endif
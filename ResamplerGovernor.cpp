@@ -0,0 +1,79 @@
+#include "ResamplerGovernor.h"
+
+// WWMFResampler accepts half filter lengths from 1 to 60; these are the steps we move between.
+static const int tiers[] = { 1, 5, 15, 30, 60 };
+#define TIER_COUNT (sizeof(tiers) / sizeof(tiers[0]))
+
+// Measurement period; at least this much audio must be seen before a decision.
+#define GOVERNOR_PERIOD_SECONDS 2.0
+
+ResamplerGovernor::ResamplerGovernor(void) {
+	Reset(0, 5);
+}
+
+void ResamplerGovernor::Reset(double budgetMs, int initialHalfFilterLength) {
+	LARGE_INTEGER f, now;
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&now);
+	frequency = f.QuadPart;
+
+	this->budgetMs = budgetMs;
+	enabled = budgetMs > 0;
+	ticks = 0;
+	audioSeconds = 0;
+	periodStart = now.QuadPart;
+	lastCostMs = 0;
+	tier = 0;
+	Applied(initialHalfFilterLength);
+	changed = false;
+	measuredAfterChange = false;
+	previousHalfFilterLength = GetHalfFilterLength();
+	previousCostMs = 0;
+}
+
+void ResamplerGovernor::Record(LONGLONG ticks, double audioSeconds) {
+	this->ticks += ticks;
+	this->audioSeconds += audioSeconds;
+}
+
+int ResamplerGovernor::Evaluate(LONGLONG qpc) {
+	measuredAfterChange = false;
+	if (qpc - periodStart < GOVERNOR_PERIOD_SECONDS * frequency || audioSeconds < GOVERNOR_PERIOD_SECONDS / 2)
+		return 0;
+
+	lastCostMs = ticks * 1000.0 / frequency / audioSeconds;
+	ticks = 0;
+	audioSeconds = 0;
+	periodStart = qpc;
+	measuredAfterChange = changed;
+	changed = false;
+
+	if (!enabled)
+		return 0;
+
+	if (lastCostMs > budgetMs && tier > 0)
+		return tiers[tier - 1];
+
+	// Filter cost grows roughly linearly with its length.
+	if (tier + 1 < (int)TIER_COUNT && lastCostMs * tiers[tier + 1] / tiers[tier] < budgetMs / 2)
+		return tiers[tier + 1];
+
+	return 0;
+}
+
+void ResamplerGovernor::Applied(int halfFilterLength) {
+	previousHalfFilterLength = GetHalfFilterLength();
+	previousCostMs = lastCostMs;
+	changed = true;
+	tier = 0;
+	for (int i = 0; i < (int)TIER_COUNT; i++)
+		if (tiers[i] <= halfFilterLength)
+			tier = i;
+	// Discard whatever was measured at the old quality.
+	ticks = 0;
+	audioSeconds = 0;
+}
+
+int ResamplerGovernor::GetHalfFilterLength(void) const {
+	return tiers[tier];
+}
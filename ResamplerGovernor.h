@@ -0,0 +1,74 @@
+#pragma once
+
+#include <windows.h>
+
+/// Picks the resampler filter quality that fits a CPU budget.
+///
+/// The host reports the time spent in every Resample call together with the
+/// amount of audio it covered. Every evaluation period the governor compares
+/// the measured cost, in milliseconds of CPU per second of audio, with the
+/// budget: it steps one tier down when over budget, and one tier up when the
+/// next tier's projected cost still leaves half the budget spare. A change is
+/// followed by a settling period so each tier is measured before the next move;
+/// the first measurement at a new tier is flagged so the host can log whether
+/// the change had the effect it was made for.
+class ResamplerGovernor {
+public:
+	ResamplerGovernor(void);
+
+	/// @param budgetMs CPU milliseconds per second of audio the resampler may use
+	/// @param initialHalfFilterLength quality the stream was created with
+	void Reset(double budgetMs, int initialHalfFilterLength);
+
+	void Record(LONGLONG ticks, double audioSeconds);
+
+	/// Call once per render pass.
+	/// @return the half filter length to switch to, or 0 to keep the current one
+	int Evaluate(LONGLONG qpc);
+
+	/// The resampler refused a new quality; stop trying to change it.
+	void Disable(void) {
+		enabled = false;
+	}
+
+	void Applied(int halfFilterLength);
+
+	int GetHalfFilterLength(void) const;
+
+	int GetTier(void) const {
+		return tier;
+	}
+
+	/// Cost measured over the last complete evaluation period.
+	double GetCostMs(void) const {
+		return lastCostMs;
+	}
+
+	/// True right after the evaluation period that first measured a quality set by
+	/// Applied(), until the next Evaluate().
+	bool MeasuredAfterChange(void) const {
+		return measuredAfterChange;
+	}
+
+	/// Quality and cost in effect before the last change.
+	int GetPreviousHalfFilterLength(void) const {
+		return previousHalfFilterLength;
+	}
+	double GetPreviousCostMs(void) const {
+		return previousCostMs;
+	}
+
+private:
+	double budgetMs;
+	int tier;
+	bool enabled;
+	LONGLONG ticks;
+	double audioSeconds;
+	LONGLONG periodStart;
+	LONGLONG frequency;
+	double lastCostMs;
+	bool changed;
+	bool measuredAfterChange;
+	int previousHalfFilterLength;
+	double previousCostMs;
+};
@@ -0,0 +1,73 @@
+#include "SessionNotification.h"
+
+SessionNotification::SessionNotification(IAudioSessionEvents *events) : rc(1), events(events), closed(false) {
+	InitializeCriticalSection(&lock);
+	events->AddRef();
+}
+
+SessionNotification::~SessionNotification(void) {
+	UntrackAll();
+	events->Release();
+	DeleteCriticalSection(&lock);
+}
+
+void SessionNotification::Track(IAudioSessionControl *control) {
+	EnterCriticalSection(&lock);
+	if (!closed && SUCCEEDED(control->RegisterAudioSessionNotification(events))) {
+		control->AddRef();
+		tracked.push_back(control);
+	}
+	LeaveCriticalSection(&lock);
+}
+
+void SessionNotification::UntrackAll(void) {
+	EnterCriticalSection(&lock);
+	closed = true;
+	for (size_t i = 0; i < tracked.size(); i++) {
+		tracked[i]->UnregisterAudioSessionNotification(events);
+		tracked[i]->Release();
+	}
+	tracked.clear();
+	LeaveCriticalSection(&lock);
+}
+
+size_t SessionNotification::TrackedCount(void) {
+	EnterCriticalSection(&lock);
+	size_t count = tracked.size();
+	LeaveCriticalSection(&lock);
+	return count;
+}
+
+ULONG STDMETHODCALLTYPE SessionNotification::AddRef(void) {
+	return InterlockedIncrement(&rc);
+}
+
+ULONG STDMETHODCALLTYPE SessionNotification::Release(void) {
+	ULONG rc = InterlockedDecrement(&this->rc);
+	if (rc == 0)
+		delete this;
+	return rc;
+}
+
+HRESULT STDMETHODCALLTYPE SessionNotification::QueryInterface(REFIID riid, void **ppv) {
+	if (IID_IUnknown == riid) {
+		AddRef();
+		*ppv = static_cast<IUnknown*>(this);
+		return S_OK;
+	}
+	else if (__uuidof(IAudioSessionNotification) == riid) {
+		AddRef();
+		*ppv = static_cast<IAudioSessionNotification*>(this);
+		return S_OK;
+	}
+	else {
+		*ppv = nullptr;
+		return E_NOINTERFACE;
+	}
+}
+
+HRESULT STDMETHODCALLTYPE SessionNotification::OnSessionCreated(IAudioSessionControl *newSession) {
+	if (newSession)
+		Track(newSession);
+	return S_OK;
+}
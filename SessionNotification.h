@@ -0,0 +1,38 @@
+#pragma once
+
+#include <deque>
+#include <windows.h>
+#include <audiopolicy.h>
+
+/// Owns every session control that an IAudioSessionEvents sink is registered
+/// with, so that a stream teardown can unregister and release all of them,
+/// including the ones announced through OnSessionCreated on the audio
+/// service's thread.
+class SessionNotification : public IAudioSessionNotification {
+public:
+	/// @param events sink registered with every tracked session; held until the last Release()
+	SessionNotification(IAudioSessionEvents *events);
+
+	/// Registers the sink with control and keeps a reference to it.
+	void Track(IAudioSessionControl *control);
+
+	/// Unregisters the sink from every tracked session and drops the references.
+	/// Sessions announced after this are ignored.
+	void UntrackAll(void);
+
+	size_t TrackedCount(void);
+
+	ULONG STDMETHODCALLTYPE AddRef(void);
+	ULONG STDMETHODCALLTYPE Release(void);
+	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv);
+	HRESULT STDMETHODCALLTYPE OnSessionCreated(IAudioSessionControl *newSession);
+
+private:
+	~SessionNotification(void);
+
+	LONG rc;
+	CRITICAL_SECTION lock;
+	IAudioSessionEvents *events;
+	std::deque<IAudioSessionControl*> tracked;
+	bool closed;
+};
@@ -0,0 +1,204 @@
+#include "SharedWaveform.h"
+
+#include <string.h>
+
+static LONGLONG AtomicRead64(volatile LONGLONG *value) {
+	return InterlockedCompareExchange64(value, 0, 0);
+}
+
+static bool ProcessAlive(DWORD processId) {
+	HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, processId);
+	if (!process)
+		return false;
+	bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+	CloseHandle(process);
+	return alive;
+}
+
+HRESULT SharedWaveformWriter::Open(const wchar_t *name) {
+	Close();
+
+	mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(SharedWaveformView), name);
+	if (!mapping)
+		return HRESULT_FROM_WIN32(GetLastError());
+	bool existed = GetLastError() == ERROR_ALREADY_EXISTS;
+
+	view = (SharedWaveformView*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SharedWaveformView));
+	if (!view) {
+		HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		Close();
+		return hr;
+	}
+
+	if (existed && view->header.magic == SHARED_WAVEFORM_MAGIC && view->header.writerProcessId != GetCurrentProcessId() &&
+		ProcessAlive(view->header.writerProcessId)) {
+		// Leave the mapping to the writer that has it; Close() would clear its magic.
+		UnmapViewOfFile(view);
+		view = NULL;
+		CloseHandle(mapping);
+		mapping = NULL;
+		return HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+	}
+
+	// Readers may still hold a ring a previous writer left behind. Numbering carries on
+	// from it and the generation tells them to resynchronise; a ring of another layout
+	// starts from scratch.
+	if (!existed || view->header.version != SHARED_WAVEFORM_VERSION || view->header.slotCount != SHARED_WAVEFORM_SLOTS ||
+		view->header.slotBytes != sizeof(SharedWaveformSlot))
+		memset(view, 0, sizeof(SharedWaveformView));
+	InterlockedIncrement(&view->header.generation);
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	view->header.version = SHARED_WAVEFORM_VERSION;
+	view->header.slotCount = SHARED_WAVEFORM_SLOTS;
+	view->header.slotBytes = sizeof(SharedWaveformSlot);
+	view->header.samples = SHARED_WAVEFORM_SAMPLES;
+	view->header.bins = SHARED_WAVEFORM_BINS;
+	view->header.writerProcessId = GetCurrentProcessId();
+	view->header.qpcFrequency = frequency.QuadPart;
+	MemoryBarrier();
+	view->header.magic = SHARED_WAVEFORM_MAGIC;
+	return S_OK;
+}
+
+void SharedWaveformWriter::Close(void) {
+	if (view) {
+		view->header.magic = 0;
+		UnmapViewOfFile(view);
+		view = NULL;
+	}
+	if (mapping) {
+		CloseHandle(mapping);
+		mapping = NULL;
+	}
+}
+
+void SharedWaveformWriter::Publish(const BYTE *waveform, const float *spectrum, const SharedWaveformAnalysis *analysis, DWORD flags, LONGLONG qpc) {
+	if (!view)
+		return;
+
+	LONGLONG index = view->header.writeIndex;
+	SharedWaveformSlot &slot = view->slots[index % SHARED_WAVEFORM_SLOTS];
+
+	InterlockedIncrement(&slot.sequence);
+	slot.index = index;
+	slot.qpc = qpc;
+	memcpy(slot.waveform, waveform, sizeof(slot.waveform));
+	if (spectrum) {
+		memcpy(slot.spectrum, spectrum, sizeof(slot.spectrum));
+		flags |= SHARED_WAVEFORM_HAS_SPECTRUM;
+	}
+	if (analysis) {
+		slot.analysis = *analysis;
+		flags |= SHARED_WAVEFORM_HAS_ANALYSIS;
+	}
+	slot.flags = flags;
+	InterlockedIncrement(&slot.sequence);
+
+	InterlockedExchange64(&view->header.writeIndex, index + 1);
+}
+
+HRESULT SharedWaveformReader::Open(const wchar_t *name) {
+	Close();
+
+	mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, name);
+	if (!mapping)
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	view = (SharedWaveformView*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(SharedWaveformView));
+	if (!view) {
+		HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		Close();
+		return hr;
+	}
+
+	if (view->header.magic != SHARED_WAVEFORM_MAGIC ||
+		view->header.version != SHARED_WAVEFORM_VERSION ||
+		view->header.slotBytes != sizeof(SharedWaveformSlot)) {
+		Close();
+		return E_FAIL;
+	}
+
+	generation = view->header.generation;
+	MemoryBarrier();
+	next = AtomicRead64(&view->header.writeIndex);
+	return S_OK;
+}
+
+void SharedWaveformReader::Close(void) {
+	if (view) {
+		UnmapViewOfFile(view);
+		view = NULL;
+	}
+	if (mapping) {
+		CloseHandle(mapping);
+		mapping = NULL;
+	}
+}
+
+HRESULT SharedWaveformReader::Read(SharedWaveformSlot *slot, LONGLONG *dropped_return) {
+	if (dropped_return)
+		*dropped_return = 0;
+	if (!view)
+		return E_FAIL;
+
+	for (;;) {
+		LONG currentGeneration = view->header.generation;
+		MemoryBarrier();
+		LONGLONG written = AtomicRead64(&view->header.writeIndex);
+		if (currentGeneration != generation || next > written) {
+			// A new writer took over; its numbering need not follow ours.
+			generation = currentGeneration;
+			next = written;
+			resyncs++;
+		}
+		if (next >= written)
+			return S_FALSE;
+
+		// Leave one slot of headroom: the writer may already be inside the oldest one.
+		if (written - next > SHARED_WAVEFORM_SLOTS - 1) {
+			LONGLONG oldest = written - (SHARED_WAVEFORM_SLOTS - 1);
+			if (dropped_return)
+				*dropped_return += oldest - next;
+			next = oldest;
+		}
+
+		const SharedWaveformSlot &source = view->slots[next % SHARED_WAVEFORM_SLOTS];
+		LONG sequence = source.sequence;
+		MemoryBarrier();
+		if (!(sequence & 1)) {
+			memcpy(slot, (const void*)&source, sizeof(SharedWaveformSlot));
+			MemoryBarrier();
+			if (source.sequence == sequence && slot->index == next) {
+				next++;
+				return S_OK;
+			}
+		}
+
+		// Torn or already overwritten; a slow reader was lapped, resynchronise.
+		YieldProcessor();
+	}
+}
+
+const SharedWaveformSlot *SharedWaveformReader::Latest(LONG *sequence_return) const {
+	if (!view)
+		return NULL;
+	LONGLONG written = AtomicRead64(&view->header.writeIndex);
+	if (written == 0)
+		return NULL;
+	const SharedWaveformSlot *slot = &view->slots[(written - 1) % SHARED_WAVEFORM_SLOTS];
+	*sequence_return = slot->sequence;
+	MemoryBarrier();
+	return slot;
+}
+
+bool SharedWaveformReader::Validate(const SharedWaveformSlot *slot, LONG sequence) const {
+	MemoryBarrier();
+	return !(sequence & 1) && slot->sequence == sequence;
+}
+
+double SharedWaveformReader::LatencyMs(const SharedWaveformSlot &slot) const {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (now.QuadPart - slot.qpc) * 1000.0 / view->header.qpcFrequency;
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <windows.h>
+
+/// Shared-memory ring of the windows milkbottle hands to the visualizer, for
+/// external consumers such as LED walls and lighting controllers.
+///
+/// The writer owns a named file mapping holding a header and a ring of slots.
+/// Each slot is guarded by a sequence lock: the sequence is odd while the
+/// writer is inside the slot and is bumped to the next even value when the
+/// window is complete. Readers never block the writer; they map the same
+/// memory, read in place, and retry if the sequence moved underneath them.
+/// Any number of readers may attach.
+///
+/// The mapping outlives a writer as long as readers hold it. A new writer
+/// takes it over only if the previous one has exited, continues its window
+/// numbering and bumps the generation, so attached readers pick up the new
+/// writer's newest window instead of waiting for the count to catch up.
+
+#define SHARED_WAVEFORM_NAME L"Local\\milkbottle.waveform"
+#define SHARED_WAVEFORM_MAGIC 0x4657424D // "MBWF"
+#define SHARED_WAVEFORM_VERSION 2
+#define SHARED_WAVEFORM_SLOTS 64
+#define SHARED_WAVEFORM_SAMPLES 576
+#define SHARED_WAVEFORM_BINS 256
+
+/// Slot flag: spectrum holds valid magnitudes for this window.
+#define SHARED_WAVEFORM_HAS_SPECTRUM 0x1
+/// Slot flag: analysis is valid for this window.
+#define SHARED_WAVEFORM_HAS_ANALYSIS 0x2
+/// Slot flag: the analyzer detected an onset in this window.
+#define SHARED_WAVEFORM_ONSET 0x4
+
+/// Per-window analysis computed on the capture side; see Analyzer.
+struct SharedWaveformAnalysis {
+	float bass;
+	float mid;
+	float treble;
+	float bassAtt;
+	float midAtt;
+	float trebleAtt;
+	float flux;
+	/// Beats per minute, 0 while unknown.
+	float tempo;
+	float tempoConfidence;
+	DWORD reserved;
+};
+
+struct SharedWaveformSlot {
+	volatile LONG sequence;
+	DWORD flags;
+	/// Window number, counting from 0 since the mapping was created; a writer
+	/// that takes the mapping over carries on from its predecessor.
+	LONGLONG index;
+	/// QueryPerformanceCounter value when the endpoint captured the window's first sample.
+	LONGLONG qpc;
+	/// Signed 8-bit samples, left then right, exactly as given to the visualizer.
+	signed char waveform[2][SHARED_WAVEFORM_SAMPLES];
+	float spectrum[2][SHARED_WAVEFORM_BINS];
+	SharedWaveformAnalysis analysis;
+};
+
+struct SharedWaveformHeader {
+	DWORD magic;
+	DWORD version;
+	DWORD slotCount;
+	DWORD slotBytes;
+	DWORD samples;
+	DWORD bins;
+	DWORD writerProcessId;
+	/// Incremented each time a writer takes the mapping over.
+	volatile LONG generation;
+	LONGLONG qpcFrequency;
+	/// Number of windows published; the newest is in slot (writeIndex - 1) % slotCount.
+	volatile LONGLONG writeIndex;
+};
+
+struct SharedWaveformView {
+	SharedWaveformHeader header;
+	SharedWaveformSlot slots[SHARED_WAVEFORM_SLOTS];
+};
+
+class SharedWaveformWriter {
+public:
+	SharedWaveformWriter(void) : mapping(NULL), view(NULL) { }
+	~SharedWaveformWriter(void) {
+		Close();
+	}
+
+	/// Creates the mapping, or takes it over from a writer that has exited.
+	/// @return HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS) if another live process is writing to it
+	HRESULT Open(const wchar_t *name);
+	void Close(void);
+
+	bool IsOpen(void) const {
+		return view != NULL;
+	}
+
+	/// Publishes one window.
+	/// @param waveform 2*SHARED_WAVEFORM_SAMPLES signed 8-bit samples, left then right
+	/// @param spectrum 2*SHARED_WAVEFORM_BINS magnitudes, or NULL when none were computed
+	/// @param analysis band energies and tempo, or NULL when none were computed
+	/// @param flags extra slot flags such as SHARED_WAVEFORM_ONSET
+	void Publish(const BYTE *waveform, const float *spectrum, const SharedWaveformAnalysis *analysis, DWORD flags, LONGLONG qpc);
+
+private:
+	HANDLE mapping;
+	SharedWaveformView *view;
+};
+
+class SharedWaveformReader {
+public:
+	SharedWaveformReader(void) : mapping(NULL), view(NULL), next(0), generation(0), resyncs(0) { }
+	~SharedWaveformReader(void) {
+		Close();
+	}
+
+	/// Attaches to a running writer. Reading starts at the newest window.
+	HRESULT Open(const wchar_t *name);
+	void Close(void);
+
+	/// Copies the next unread window into slot.
+	/// @return S_OK on success, S_FALSE when no new window is available yet.
+	/// If the reader fell more than a ring behind, it skips ahead to the oldest
+	/// window still intact and reports the number skipped in dropped_return.
+	/// When another writer has taken the mapping over, reading restarts at its
+	/// newest window.
+	HRESULT Read(SharedWaveformSlot *slot, LONGLONG *dropped_return);
+
+	/// Times reading restarted because the writer changed.
+	int Resyncs(void) const {
+		return resyncs;
+	}
+
+	/// Zero-copy access: returns the newest window and its sequence. The caller reads
+	/// in place and then calls Validate(); if it fails, whatever was read is torn.
+	const SharedWaveformSlot *Latest(LONG *sequence_return) const;
+	bool Validate(const SharedWaveformSlot *slot, LONG sequence) const;
+
+	/// Milliseconds between capture of slot and now.
+	double LatencyMs(const SharedWaveformSlot &slot) const;
+
+private:
+	HANDLE mapping;
+	SharedWaveformView *view;
+	LONGLONG next;
+	LONG generation;
+	int resyncs;
+};
@@ -0,0 +1,106 @@
+#include "StateMachine.h"
+
+#include "Log.h"
+
+static const wchar_t *StateName(int state) {
+	switch (state) {
+	case STATE_RUNNING: return L"running";
+	case STATE_STOPPED: return L"stopped";
+	case STATE_CONFIG: return L"config";
+	case STATE_EXIT: return L"exit";
+	case STATE_PAUSED: return L"paused";
+	default: return L"unknown";
+	}
+}
+
+StateMachine::StateMachine(int initial) :
+	state(initial), previousState(initial), transitionPosted(0), transitionApplied(0), transitionFrom(initial) {
+	InitializeCriticalSection(&lock);
+	event = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+StateMachine::~StateMachine(void) {
+	CloseHandle(event);
+	DeleteCriticalSection(&lock);
+}
+
+void StateMachine::Post(int command) {
+	Command c;
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	c.command = command;
+	c.posted = now.QuadPart;
+
+	EnterCriticalSection(&lock);
+	queue.push_back(c);
+	SetEvent(event);
+	LeaveCriticalSection(&lock);
+}
+
+int StateMachine::Next(int command) const {
+	switch (command) {
+	case COMMAND_START:
+		return state == STATE_STOPPED ? STATE_RUNNING : state;
+	case COMMAND_STOP:
+		return state == STATE_RUNNING || state == STATE_PAUSED ? STATE_STOPPED : state;
+	case COMMAND_PAUSE:
+		return state == STATE_RUNNING ? STATE_PAUSED : state;
+	case COMMAND_RESUME:
+		return state == STATE_PAUSED ? STATE_RUNNING : state;
+	case COMMAND_TOGGLE:
+		if (state == STATE_STOPPED || state == STATE_PAUSED)
+			return STATE_RUNNING;
+		return state == STATE_RUNNING ? STATE_PAUSED : state;
+	case COMMAND_CONFIG:
+		return state == STATE_EXIT ? state : STATE_CONFIG;
+	case COMMAND_CONFIG_DONE:
+		return state == STATE_CONFIG ? previousState : state;
+	case COMMAND_EXIT:
+		return STATE_EXIT;
+	default:
+		return state;
+	}
+}
+
+bool StateMachine::Pump(void) {
+	bool changed = false;
+
+	EnterCriticalSection(&lock);
+	while (!queue.empty()) {
+		Command c = queue.front();
+		queue.pop_front();
+
+		int next = Next(c.command);
+		if (next == state)
+			continue;
+		if (next == STATE_CONFIG)
+			previousState = state;
+
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		if (!transitionPosted)
+			transitionFrom = state;
+		transitionPosted = c.posted;
+		transitionApplied = now.QuadPart;
+		InterlockedExchange(&state, next);
+		changed = true;
+	}
+	ResetEvent(event);
+	LeaveCriticalSection(&lock);
+
+	return changed;
+}
+
+void StateMachine::Settled(void) {
+	if (!transitionPosted)
+		return;
+
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	LOG(L"State %s -> %s: applied after %.2f ms, settled after %.2f ms",
+		StateName(transitionFrom), StateName(state),
+		(transitionApplied - transitionPosted) * 1000.0 / frequency.QuadPart,
+		(now.QuadPart - transitionPosted) * 1000.0 / frequency.QuadPart);
+	transitionPosted = 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <deque>
+#include <windows.h>
+
+#define STATE_RUNNING 10001
+#define STATE_STOPPED 10002
+#define STATE_CONFIG 10003
+#define STATE_EXIT 10004
+// Rendering is suspended but the capture stream stays open and is drained, so resuming is instant.
+#define STATE_PAUSED 10005
+
+#define COMMAND_START 1
+#define COMMAND_STOP 2
+#define COMMAND_PAUSE 3
+#define COMMAND_RESUME 4
+// Tray left click: start when stopped, otherwise flip between running and paused.
+#define COMMAND_TOGGLE 5
+#define COMMAND_CONFIG 6
+// Posted by the render thread once the configuration dialog has closed.
+#define COMMAND_CONFIG_DONE 7
+#define COMMAND_EXIT 8
+
+/// Host run state driven by a command queue.
+///
+/// Any thread may Post() a command; only the render thread calls Pump(), which
+/// applies queued commands in order. The current state can be read from any
+/// thread without locking. Each transition is timed from the moment its command
+/// was posted to the moment the render thread reports it Settled(), so
+/// pause/resume and start/stop latency show up in the debug log.
+class StateMachine {
+public:
+	StateMachine(int initial);
+	~StateMachine(void);
+
+	int Get(void) const {
+		return state;
+	}
+
+	/// True while the host should keep a capture stream open.
+	bool IsActive(void) const {
+		return state == STATE_RUNNING || state == STATE_PAUSED;
+	}
+
+	void Post(int command);
+
+	/// Applies every queued command. Render thread only.
+	/// @return true if the state changed
+	bool Pump(void);
+
+	/// Signalled while commands are queued, for waits that must wake on a command.
+	HANDLE GetEvent(void) const {
+		return event;
+	}
+
+	/// Called by the render thread once the current state has taken effect,
+	/// e.g. the first frame after resuming. Logs the transition latency once.
+	void Settled(void);
+
+private:
+	struct Command {
+		int command;
+		LONGLONG posted;
+	};
+
+	volatile LONG state;
+	int previousState;
+	CRITICAL_SECTION lock;
+	std::deque<Command> queue;
+	HANDLE event;
+	LONGLONG transitionPosted;
+	LONGLONG transitionApplied;
+	int transitionFrom;
+
+	int Next(int command) const;
+};
@@ -0,0 +1,200 @@
+#include "Trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TRACE_MAX_THREADS 16
+#define TRACE_EVENTS_PER_THREAD 16384
+#define TRACE_DUMP_COOLDOWN_SECONDS 10
+
+// A power of two divides 2^32, so count % TRACE_EVENTS_PER_THREAD keeps naming the
+// next slot when the span count wraps around.
+static_assert((TRACE_EVENTS_PER_THREAD & (TRACE_EVENTS_PER_THREAD - 1)) == 0, "TRACE_EVENTS_PER_THREAD must be a power of two");
+
+struct TraceEvent {
+	const char *name;
+	LONGLONG start;
+	LONGLONG end;
+};
+
+struct TraceRing {
+	DWORD threadId;
+	const char *threadName;
+	/// Spans recorded, modulo 2^32.
+	volatile ULONG count;
+	/// Set once every slot holds a span.
+	volatile LONG full;
+	/// Set while a thread records into the ring; cleared by TraceThreadExit().
+	volatile LONG inUse;
+	TraceEvent *events;
+};
+
+volatile LONG traceEnabled = 0;
+static volatile LONG traceDumping = 0;
+static volatile LONG traceThreads = 0;
+static TraceRing traceRings[TRACE_MAX_THREADS];
+static __declspec(thread) TraceRing *traceRing = NULL;
+static __declspec(thread) const char *traceThreadName = NULL;
+static LONGLONG traceLastDump = 0;
+// Signaled by TraceFrame() for the dumper thread, so writing the file never costs a frame.
+static HANDLE traceDumpEvent = NULL;
+
+static DWORD WINAPI TraceDumper(LPVOID parameter) {
+	TraceSetThreadName("trace");
+	while (WaitForSingleObject(traceDumpEvent, INFINITE) == WAIT_OBJECT_0)
+		TraceDumpToTemp(L"overbudget");
+	return 0;
+}
+
+void TraceEnable(bool enable) {
+	if (enable) {
+		for (int i = 0; i < TRACE_MAX_THREADS; i++)
+			if (!traceRings[i].events)
+				traceRings[i].events = new TraceEvent[TRACE_EVENTS_PER_THREAD];
+		if (!traceDumpEvent) {
+			traceDumpEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+			HANDLE thread = traceDumpEvent ? CreateThread(NULL, 0, TraceDumper, NULL, 0, NULL) : NULL;
+			if (thread) {
+				CloseHandle(thread);
+			} else if (traceDumpEvent) {
+				CloseHandle(traceDumpEvent);
+				traceDumpEvent = NULL;
+			}
+		}
+	}
+	InterlockedExchange(&traceEnabled, enable ? 1 : 0);
+}
+
+// Claims a released ring, one left by a thread of the same name if sameName is set.
+static TraceRing *TraceReuseRing(bool sameName) {
+	LONG threads = traceThreads < TRACE_MAX_THREADS ? traceThreads : TRACE_MAX_THREADS;
+	for (LONG i = 0; i < threads; i++) {
+		TraceRing &ring = traceRings[i];
+		if (ring.inUse || (sameName && (!ring.threadName || !traceThreadName || strcmp(ring.threadName, traceThreadName))))
+			continue;
+		if (InterlockedCompareExchange(&ring.inUse, 1, 0) == 0)
+			return &ring;
+	}
+	return NULL;
+}
+
+// A reused ring keeps its thread ID, so its spans stay on one track in the dump.
+static TraceRing *TraceThreadRing(void) {
+	if (!traceRing) {
+		TraceRing *ring = TraceReuseRing(true);
+		if (!ring && traceThreads < TRACE_MAX_THREADS) {
+			LONG index = InterlockedIncrement(&traceThreads) - 1;
+			// Another thread looking for any released ring may get to a fresh one first.
+			if (index < TRACE_MAX_THREADS && InterlockedCompareExchange(&traceRings[index].inUse, 1, 0) == 0)
+				ring = &traceRings[index];
+		}
+		if (!ring)
+			ring = TraceReuseRing(false);
+		if (!ring)
+			return NULL;
+		if (!ring->threadId)
+			ring->threadId = GetCurrentThreadId();
+		ring->threadName = traceThreadName;
+		traceRing = ring;
+	}
+	return traceRing;
+}
+
+void TraceThreadExit(void) {
+	if (traceRing) {
+		InterlockedExchange(&traceRing->inUse, 0);
+		traceRing = NULL;
+	}
+}
+
+void TraceSetThreadName(const char *name) {
+	AllocProfileSetThreadName(name);
+	traceThreadName = name;
+	if (traceRing)
+		traceRing->threadName = name;
+}
+
+void TraceRecord(const char *name, LONGLONG start, LONGLONG end) {
+	if (!traceEnabled || traceDumping)
+		return;
+	TraceRing *ring = TraceThreadRing();
+	if (!ring || !ring->events)
+		return;
+	ULONG count = ring->count;
+	TraceEvent &e = ring->events[count % TRACE_EVENTS_PER_THREAD];
+	e.name = name;
+	e.start = start;
+	e.end = end;
+	if (!ring->full && count + 1 >= TRACE_EVENTS_PER_THREAD)
+		InterlockedExchange(&ring->full, 1);
+	InterlockedExchange((volatile LONG*)&ring->count, (LONG)(count + 1));
+}
+
+bool TraceDump(const wchar_t *path) {
+	if (InterlockedExchange(&traceDumping, 1))
+		return false;
+
+	FILE *file = NULL;
+	if (_wfopen_s(&file, path, L"w") != 0 || !file) {
+		InterlockedExchange(&traceDumping, 0);
+		return false;
+	}
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	double usPerTick = 1e6 / frequency.QuadPart;
+	DWORD pid = GetCurrentProcessId();
+	bool first = true;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	LONG threads = traceThreads < TRACE_MAX_THREADS ? traceThreads : TRACE_MAX_THREADS;
+	for (LONG t = 0; t < threads; t++) {
+		TraceRing &ring = traceRings[t];
+		if (ring.threadName) {
+			fprintf(file, "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",", pid, ring.threadId, ring.threadName);
+			first = false;
+		}
+		ULONG count = ring.count;
+		ULONG recorded = ring.full ? TRACE_EVENTS_PER_THREAD : count;
+		for (ULONG i = count - recorded; i != count; i++) {
+			const TraceEvent &e = ring.events[i % TRACE_EVENTS_PER_THREAD];
+			fprintf(file, "%s\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+				first ? "" : ",", e.name, pid, ring.threadId, e.start * usPerTick, (e.end - e.start) * usPerTick);
+			first = false;
+		}
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+
+	InterlockedExchange(&traceDumping, 0);
+	return true;
+}
+
+bool TraceDumpToTemp(const wchar_t *reason) {
+	wchar_t directory[MAX_PATH];
+	wchar_t path[MAX_PATH];
+	SYSTEMTIME time;
+	if (!GetTempPathW(_countof(directory), directory))
+		return false;
+	GetLocalTime(&time);
+	swprintf_s(path, _countof(path), L"%smilkbottle-trace-%04u%02u%02u-%02u%02u%02u-%s.json", directory,
+		time.wYear, time.wMonth, time.wDay, time.wHour, time.wMinute, time.wSecond, reason);
+	return TraceDump(path);
+}
+
+void TraceFrame(LONGLONG start, LONGLONG end, double budgetMs) {
+	if (!traceEnabled)
+		return;
+	TraceRecord("Frame", start, end);
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	if ((end - start) * 1000.0 / frequency.QuadPart <= budgetMs)
+		return;
+	if (traceLastDump && end - traceLastDump < TRACE_DUMP_COOLDOWN_SECONDS * frequency.QuadPart)
+		return;
+	traceLastDump = end;
+	if (traceDumpEvent)
+		SetEvent(traceDumpEvent);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <windows.h>
+
+#include "AllocProfile.h"
+
+/// Scoped span tracing for the capture and render paths.
+///
+/// Each thread records completed spans into its own preallocated ring, so
+/// recording neither locks nor allocates. TraceDump() writes every ring as
+/// Chrome trace_event JSON, which chrome://tracing and Perfetto load directly.
+/// When tracing is disabled a span costs one load and a branch; defining
+/// MILKBOTTLE_NO_TRACE removes the spans altogether.
+
+extern volatile LONG traceEnabled;
+
+/// Allocates the per-thread rings on first use and starts recording.
+void TraceEnable(bool enable);
+
+/// Names the calling thread in dumps.
+void TraceSetThreadName(const char *name);
+
+/// Releases the calling thread's ring; call before a short-lived thread returns.
+/// The ring and its spans are kept and go to the next thread of the same name,
+/// so repeated workers share one track instead of each using up a ring.
+void TraceThreadExit(void);
+
+/// Records a completed span. name must be a string literal or otherwise outlive the trace.
+void TraceRecord(const char *name, LONGLONG start, LONGLONG end);
+
+/// Writes all recorded spans to path. Recording is suspended while the dump runs.
+bool TraceDump(const wchar_t *path);
+
+/// Writes all recorded spans to a fresh file in %TEMP%.
+bool TraceDumpToTemp(const wchar_t *reason);
+
+/// Ring trigger: call once per rendered frame. If the frame exceeded budgetMs a
+/// background thread dumps the rings to %TEMP%, at most once per cooldown so a
+/// bad patch does not turn into a stream of multi-megabyte files.
+void TraceFrame(LONGLONG start, LONGLONG end, double budgetMs);
+
+class TraceSpan {
+public:
+	TraceSpan(const char *name) : name(name) {
+		if (traceEnabled)
+			QueryPerformanceCounter(&start);
+		else
+			start.QuadPart = 0;
+	}
+
+	~TraceSpan() {
+		if (start.QuadPart) {
+			LARGE_INTEGER end;
+			QueryPerformanceCounter(&end);
+			TraceRecord(name, start.QuadPart, end.QuadPart);
+		}
+	}
+
+private:
+	const char *name;
+	LARGE_INTEGER start;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+
+// Spans double as allocation tags in MILKBOTTLE_ALLOC_PROFILE builds.
+#ifdef MILKBOTTLE_NO_TRACE
+#  define TRACE_SPAN(name) ALLOC_TAG(name)
+#else
+#  define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name); ALLOC_TAG(name)
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <windows.h>
+
+#define VISUALIZER_SAMPLES 576
+
+/// A visualizer backend driven by the host's render loop.
+///
+/// The host hands over every window of full-precision PCM once and in order,
+/// as they fall due, however many that makes per frame; samples are float in
+/// [-1, 1] at 44.1 kHz. Backends that need a narrower format convert it
+/// themselves, so the capture pipeline never quantizes on their behalf.
+class Visualizer {
+public:
+	virtual ~Visualizer(void) { }
+
+	virtual const wchar_t *Name(void) const = 0;
+
+	/// Creates the output window and rendering resources.
+	virtual HRESULT Init(void) = 0;
+
+	/// Replaces the current window of audio.
+	virtual void SetWindow(const float *left, const float *right, int samples) = 0;
+
+	/// Hands over the next window of the stream. Backends that analyze audio as
+	/// a continuous stream consume every one; the default keeps only the newest,
+	/// the snapshot the Winamp ABI draws from.
+	virtual void AddWindow(const float *left, const float *right, int samples) {
+		SetWindow(left, right, samples);
+	}
+
+	/// Replaces the current window with silence.
+	virtual void Clear(void) = 0;
+
+	virtual void Render(void) = 0;
+
+	/// Releases everything Init() created. Init() may be called again afterwards.
+	virtual void Quit(void) = 0;
+
+	/// Shows the backend's configuration UI, if any. Called between Quit() and Init().
+	virtual void Config(void) = 0;
+};
+
+/// Converts a float window to the signed 8-bit layout of winampVisModule::waveformData:
+/// samples left samples, then samples right samples.
+inline void QuantizeWaveform(const float *left, const float *right, int samples, BYTE *waveform) {
+	for (int i = 0; i < samples; i++) {
+		float l = left[i] * 128.0f;
+		float r = right[i] * 128.0f;
+		l = l < -128.0f ? -128.0f : l > 127.0f ? 127.0f : l;
+		r = r < -128.0f ? -128.0f : r > 127.0f ? 127.0f : r;
+		waveform[i] = (BYTE)(signed char)(l < 0 ? l - 0.5f : l + 0.5f);
+		waveform[samples + i] = (BYTE)(signed char)(r < 0 ? r - 0.5f : r + 0.5f);
+	}
+}
@@ -0,0 +1,188 @@
+#include "VisualizerChannel.h"
+
+#include <string.h>
+#include <wchar.h>
+
+VisualizerChannel::VisualizerChannel(void) : mapping(NULL), frameEvent(NULL), view(NULL), taken(0) {
+}
+
+VisualizerChannel::~VisualizerChannel(void) {
+	Close();
+}
+
+static HANDLE CreateFrameEvent(const wchar_t *name) {
+	wchar_t eventName[MAX_PATH];
+	if (swprintf_s(eventName, L"%s.frame", name) < 0)
+		return NULL;
+	return CreateEventW(NULL, FALSE, FALSE, eventName);
+}
+
+HRESULT VisualizerChannel::Create(const wchar_t *name) {
+	Close();
+
+	mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(VisualizerChannelView), name);
+	if (mapping)
+		view = (VisualizerChannelView*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(VisualizerChannelView));
+	if (view)
+		frameEvent = CreateFrameEvent(name);
+	if (!frameEvent) {
+		HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		Close();
+		return hr;
+	}
+
+	memset(view, 0, sizeof(VisualizerChannelView));
+	view->parentProcessId = GetCurrentProcessId();
+	MemoryBarrier();
+	view->magic = VISUALIZER_CHANNEL_MAGIC;
+	return S_OK;
+}
+
+HRESULT VisualizerChannel::Open(const wchar_t *name) {
+	Close();
+
+	mapping = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, name);
+	if (mapping)
+		view = (VisualizerChannelView*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(VisualizerChannelView));
+	if (view)
+		frameEvent = CreateFrameEvent(name);
+	if (!frameEvent) {
+		HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		Close();
+		return hr;
+	}
+	if (view->magic != VISUALIZER_CHANNEL_MAGIC) {
+		Close();
+		return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+	}
+	taken = AtomicRead64(&view->writeIndex);
+	return S_OK;
+}
+
+void VisualizerChannel::Close(void) {
+	if (view) {
+		UnmapViewOfFile(view);
+		view = NULL;
+	}
+	if (mapping) {
+		CloseHandle(mapping);
+		mapping = NULL;
+	}
+	if (frameEvent) {
+		CloseHandle(frameEvent);
+		frameEvent = NULL;
+	}
+}
+
+void VisualizerChannel::Publish(const float *left, const float *right, int samples, LONGLONG qpc) {
+	if (!view)
+		return;
+	if (samples > VISUALIZER_SAMPLES)
+		samples = VISUALIZER_SAMPLES;
+
+	LONGLONG index = view->writeIndex;
+	VisualizerChannelSlot &slot = view->slots[index % VISUALIZER_CHANNEL_SLOTS];
+
+	InterlockedIncrement(&slot.sequence);
+	slot.index = index;
+	slot.qpc = qpc;
+	memcpy(slot.left, left, samples * sizeof(float));
+	memcpy(slot.right, right, samples * sizeof(float));
+	if (samples < VISUALIZER_SAMPLES) {
+		memset(slot.left + samples, 0, (VISUALIZER_SAMPLES - samples) * sizeof(float));
+		memset(slot.right + samples, 0, (VISUALIZER_SAMPLES - samples) * sizeof(float));
+	}
+	InterlockedIncrement(&slot.sequence);
+
+	InterlockedExchange64(&view->writeIndex, index + 1);
+}
+
+bool VisualizerChannel::Post(LONG command) {
+	if (!view)
+		return false;
+	LONG write = view->commandWrite;
+	if (write - view->commandRead >= VISUALIZER_CHANNEL_COMMANDS)
+		return false;
+	view->commands[write % VISUALIZER_CHANNEL_COMMANDS] = command;
+	InterlockedExchange(&view->commandWrite, write + 1);
+	return true;
+}
+
+void VisualizerChannel::Reset(void) {
+	if (!view)
+		return;
+	view->commandRead = view->commandWrite;
+	view->ready = 0;
+	view->frames = 0;
+	view->heartbeat = 0;
+	view->pickupTicks = 0;
+	view->pickups = 0;
+	ResetEvent(frameEvent);
+}
+
+// Copies window index out of its slot. Fails if the parent is rewriting the slot, or
+// already has, with a later window.
+bool VisualizerChannel::Copy(LONGLONG index, float *left, float *right, LONGLONG *qpc_return) {
+	const VisualizerChannelSlot &slot = view->slots[index % VISUALIZER_CHANNEL_SLOTS];
+	LONG sequence = slot.sequence;
+	MemoryBarrier();
+	if (sequence & 1)
+		return false;
+	LONGLONG slotIndex = slot.index;
+	LONGLONG qpc = slot.qpc;
+	memcpy(left, slot.left, sizeof(slot.left));
+	memcpy(right, slot.right, sizeof(slot.right));
+	MemoryBarrier();
+	if (slot.sequence != sequence || slotIndex != index)
+		return false;
+	*qpc_return = qpc;
+	return true;
+}
+
+bool VisualizerChannel::TakeNext(float *left, float *right, LONGLONG *qpc_return) {
+	if (!view)
+		return false;
+	// A slot rewritten under us means the parent lapped the child; move up and try again.
+	for (int attempt = 0; attempt < 4; attempt++) {
+		LONGLONG written = AtomicRead64(&view->writeIndex);
+		if (written == taken)
+			return false;
+		// Leave the slot the parent writes next alone.
+		if (written - taken > VISUALIZER_CHANNEL_SLOTS - 1)
+			taken = written - (VISUALIZER_CHANNEL_SLOTS - 1);
+		if (!Copy(taken, left, right, qpc_return))
+			continue;
+		taken++;
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		InterlockedExchangeAdd64(&view->pickupTicks, now.QuadPart - *qpc_return);
+		InterlockedIncrement64(&view->pickups);
+		return true;
+	}
+	return false;
+}
+
+LONG VisualizerChannel::TakeCommand(void) {
+	if (!view)
+		return 0;
+	LONG read = view->commandRead;
+	if (read == view->commandWrite)
+		return 0;
+	MemoryBarrier();
+	LONG command = view->commands[read % VISUALIZER_CHANNEL_COMMANDS];
+	InterlockedExchange(&view->commandRead, read + 1);
+	return command;
+}
+
+void VisualizerChannel::Ready(void) {
+	if (view)
+		InterlockedExchange(&view->ready, 1);
+}
+
+void VisualizerChannel::FrameDone(LONGLONG qpc) {
+	if (!view)
+		return;
+	InterlockedExchange64(&view->heartbeat, qpc);
+	InterlockedIncrement64(&view->frames);
+	SetEvent(frameEvent);
+}
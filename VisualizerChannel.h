@@ -0,0 +1,116 @@
+#pragma once
+
+#include <windows.h>
+
+#include "Visualizer.h"
+
+/// Shared memory between milkbottle and a visualizer child process (see
+/// ProcessVisualizer).
+///
+/// The parent publishes float windows into a small ring guarded by sequence
+/// locks, as SharedWaveform does, and queues commands for the child. The
+/// child takes every window published since its last frame, in order, reports
+/// each finished frame through a heartbeat and a named event, and keeps
+/// running totals of how old windows were when it picked them up, so the cost
+/// of the extra hop can be logged by the parent.
+
+#define VISUALIZER_CHANNEL_MAGIC 0x4356424D // "MBVC"
+// About 400 ms of windows, so a child frame that runs long loses none.
+#define VISUALIZER_CHANNEL_SLOTS 32
+#define VISUALIZER_CHANNEL_COMMANDS 16
+
+/// Replace the current window with silence.
+#define VISUALIZER_COMMAND_CLEAR 1
+/// Quit the visualizer and exit.
+#define VISUALIZER_COMMAND_QUIT 2
+
+/// Reads a 64-bit counter in the mapping in one piece; a plain read can tear in
+/// a 32-bit build while the other process updates it.
+inline LONGLONG AtomicRead64(const volatile LONGLONG *value) {
+	return InterlockedCompareExchange64((volatile LONGLONG*)value, 0, 0);
+}
+
+struct VisualizerChannelSlot {
+	volatile LONG sequence;
+	LONGLONG index;
+	/// QueryPerformanceCounter value when the parent published the window.
+	LONGLONG qpc;
+	float left[VISUALIZER_SAMPLES];
+	float right[VISUALIZER_SAMPLES];
+};
+
+struct VisualizerChannelView {
+	DWORD magic;
+	DWORD parentProcessId;
+	/// Number of windows published; the newest is in slot (writeIndex - 1) % VISUALIZER_CHANNEL_SLOTS.
+	volatile LONGLONG writeIndex;
+	volatile LONG commandWrite;
+	volatile LONG commandRead;
+	LONG commands[VISUALIZER_CHANNEL_COMMANDS];
+	/// Written by the child: nonzero once its visualizer is initialized.
+	volatile LONG ready;
+	volatile LONGLONG frames;
+	/// QueryPerformanceCounter value at the end of the child's last frame.
+	volatile LONGLONG heartbeat;
+	/// Total age of the windows the child took, and how many it took.
+	volatile LONGLONG pickupTicks;
+	volatile LONGLONG pickups;
+	VisualizerChannelSlot slots[VISUALIZER_CHANNEL_SLOTS];
+};
+
+class VisualizerChannel {
+public:
+	VisualizerChannel(void);
+	~VisualizerChannel(void);
+
+	/// Parent side: creates the mapping and the frame event, both named after name.
+	HRESULT Create(const wchar_t *name);
+
+	/// Child side: attaches to a channel the parent created.
+	HRESULT Open(const wchar_t *name);
+
+	void Close(void);
+
+	bool IsOpen(void) const {
+		return view != NULL;
+	}
+
+	/// Signaled by the child after every frame.
+	HANDLE FrameEvent(void) const {
+		return frameEvent;
+	}
+
+	const VisualizerChannelView *View(void) const {
+		return view;
+	}
+
+	/// Parent: publishes one window.
+	void Publish(const float *left, const float *right, int samples, LONGLONG qpc);
+
+	/// Parent: queues a command. Returns false if the queue is full.
+	bool Post(LONG command);
+
+	/// Parent: forgets everything the previous child left behind, before starting another.
+	void Reset(void);
+
+	/// Child: copies the oldest window not taken yet, adding its age to the pickup
+	/// totals. Windows the parent has already overwritten are skipped.
+	bool TakeNext(float *left, float *right, LONGLONG *qpc_return);
+
+	/// Child: returns the next queued command, or 0.
+	LONG TakeCommand(void);
+
+	/// Child: marks the visualizer as initialized.
+	void Ready(void);
+
+	/// Child: records a finished frame and wakes the parent.
+	void FrameDone(LONGLONG qpc);
+
+private:
+	bool Copy(LONGLONG index, float *left, float *right, LONGLONG *qpc_return);
+
+	HANDLE mapping;
+	HANDLE frameEvent;
+	VisualizerChannelView *view;
+	LONGLONG taken;
+};
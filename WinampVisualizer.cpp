@@ -0,0 +1,59 @@
+#include "WinampVisualizer.h"
+
+#include "vis.h"
+
+WinampVisualizer::WinampVisualizer(void) : library(NULL), module(NULL) {
+}
+
+WinampVisualizer::~WinampVisualizer(void) {
+	if (library)
+		FreeLibrary(library);
+}
+
+HRESULT WinampVisualizer::Load(const char *path, HWND winampWindow) {
+	library = LoadLibrary(path);
+	if (!library)
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	winampVisGetHeaderType header_getter = reinterpret_cast<winampVisGetHeaderType>(GetProcAddress(library, "winampVisGetHeader"));
+	if (!header_getter)
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	winampVisHeader *header = header_getter(winampWindow);
+	if (!header)
+		return E_FAIL;
+
+	module = header->getModule(0);
+	if (!module)
+		return E_FAIL;
+
+	module->hDllInstance = library;
+	module->hwndParent = winampWindow;
+	return S_OK;
+}
+
+HRESULT WinampVisualizer::Init(void) {
+	return module->Init(module) == 0 ? S_OK : E_FAIL;
+}
+
+void WinampVisualizer::SetWindow(const float *left, const float *right, int samples) {
+	if (samples > VISUALIZER_SAMPLES)
+		samples = VISUALIZER_SAMPLES;
+	QuantizeWaveform(left, right, samples, (BYTE*)module->waveformData);
+}
+
+void WinampVisualizer::Clear(void) {
+	memset(module->waveformData, 0, 2*576);
+}
+
+void WinampVisualizer::Render(void) {
+	module->Render(module);
+}
+
+void WinampVisualizer::Quit(void) {
+	module->Quit(module);
+}
+
+void WinampVisualizer::Config(void) {
+	module->Config(module);
+}
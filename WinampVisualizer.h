@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Visualizer.h"
+
+struct winampVisModule;
+
+/// Hosts a Winamp visualization plug-in such as vis_milk2.dll through the
+/// winampVisModule ABI. The plug-in sees 576 signed 8-bit samples per channel.
+class WinampVisualizer : public Visualizer {
+public:
+	WinampVisualizer(void);
+	~WinampVisualizer(void);
+
+	/// Loads the plug-in and binds it to the hidden "Winamp" IPC window.
+	HRESULT Load(const char *path, HWND winampWindow);
+
+	const wchar_t *Name(void) const {
+		return L"Winamp";
+	}
+
+	HRESULT Init(void);
+	void SetWindow(const float *left, const float *right, int samples);
+	void Clear(void);
+	void Render(void);
+	void Quit(void);
+	void Config(void);
+
+private:
+	HMODULE library;
+	winampVisModule *module;
+};
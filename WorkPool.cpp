@@ -0,0 +1,121 @@
+#include "WorkPool.h"
+
+#include <string.h>
+
+WorkPool::WorkPool(void) : threads(0), next(0), function(NULL), context(NULL) {
+	for (int i = 0; i < WORK_POOL_MAX_THREADS; i++) {
+		InitializeCriticalSection(&workers[i].lock);
+		workers[i].items = NULL;
+		workers[i].capacity = 0;
+		workers[i].head = 0;
+		workers[i].tail = 0;
+		workers[i].ran = 0;
+		workers[i].stolen = 0;
+		workers[i].pool = this;
+		workers[i].index = i;
+	}
+}
+
+WorkPool::~WorkPool(void) {
+	for (int i = 0; i < WORK_POOL_MAX_THREADS; i++) {
+		delete[] workers[i].items;
+		DeleteCriticalSection(&workers[i].lock);
+	}
+}
+
+HRESULT WorkPool::Reset(int threadCount) {
+	if (threadCount <= 0) {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		threadCount = (int)info.dwNumberOfProcessors;
+	}
+	if (threadCount > WORK_POOL_MAX_THREADS)
+		threadCount = WORK_POOL_MAX_THREADS;
+	threads = threadCount;
+	next = 0;
+	for (int i = 0; i < WORK_POOL_MAX_THREADS; i++) {
+		workers[i].head = 0;
+		workers[i].tail = 0;
+		workers[i].ran = 0;
+		workers[i].stolen = 0;
+	}
+	return S_OK;
+}
+
+void WorkPool::Add(void *item) {
+	Worker &worker = workers[next];
+	next = (next + 1) % threads;
+	if (worker.tail == worker.capacity) {
+		int capacity = worker.capacity ? worker.capacity * 2 : 64;
+		void **grown = new void*[capacity];
+		if (worker.tail)
+			memcpy(grown, worker.items, worker.tail * sizeof(void*));
+		delete[] worker.items;
+		worker.items = grown;
+		worker.capacity = capacity;
+	}
+	worker.items[worker.tail++] = item;
+}
+
+void *WorkPool::Take(int index) {
+	Worker &worker = workers[index];
+	void *item = NULL;
+	EnterCriticalSection(&worker.lock);
+	if (worker.head < worker.tail)
+		item = worker.items[worker.head++];
+	LeaveCriticalSection(&worker.lock);
+	return item;
+}
+
+void *WorkPool::Steal(int thief) {
+	for (int i = 1; i < threads; i++) {
+		Worker &victim = workers[(thief + i) % threads];
+		void *item = NULL;
+		EnterCriticalSection(&victim.lock);
+		if (victim.head < victim.tail)
+			item = victim.items[victim.head++];
+		LeaveCriticalSection(&victim.lock);
+		if (item)
+			return item;
+	}
+	return NULL;
+}
+
+DWORD WINAPI WorkPool::ThreadMain(LPVOID parameter) {
+	Worker *worker = (Worker*)parameter;
+	WorkPool *pool = worker->pool;
+	for (;;) {
+		void *item = pool->Take(worker->index);
+		if (!item) {
+			// Nothing is added during a run, so once every queue is empty the batch is done.
+			item = pool->Steal(worker->index);
+			if (!item)
+				return 0;
+			worker->stolen++;
+		}
+		pool->function(item, worker->index, pool->context);
+		worker->ran++;
+	}
+}
+
+HRESULT WorkPool::Run(Function runFunction, void *runContext) {
+	HANDLE handles[WORK_POOL_MAX_THREADS];
+	HRESULT hr = S_OK;
+	int started = 0;
+	function = runFunction;
+	context = runContext;
+	for (; started < threads; started++) {
+		handles[started] = CreateThread(NULL, 0, ThreadMain, &workers[started], 0, NULL);
+		if (!handles[started]) {
+			// The threads that did start steal whatever the missing ones were dealt.
+			hr = HRESULT_FROM_WIN32(GetLastError());
+			break;
+		}
+	}
+	if (started == 0)
+		return hr;
+	WaitForMultipleObjects(started, handles, TRUE, INFINITE);
+	for (int i = 0; i < started; i++)
+		CloseHandle(handles[i]);
+	return S_OK;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <windows.h>
+
+#define WORK_POOL_MAX_THREADS 64
+
+/// Runs one batch of independent items on a fixed set of threads with work
+/// stealing.
+///
+/// Items are dealt round robin into one queue per worker before Run(). A
+/// worker takes from the front of its own queue and, once that is empty,
+/// steals from the front of the others', so a few long items cannot leave the
+/// rest of the machine idle. Deal the largest items first: owners and thieves
+/// alike then start the largest item left, longest-processing-time-first
+/// order, so the batch ends on small items instead of one long straggler.
+class WorkPool {
+public:
+	/// @param worker index of the calling thread, 0 to Threads() - 1
+	typedef void (*Function)(void *item, int worker, void *context);
+
+	WorkPool(void);
+	~WorkPool(void);
+
+	/// @param threads worker count, or 0 for one per logical processor
+	HRESULT Reset(int threads);
+
+	int Threads(void) const {
+		return threads;
+	}
+
+	void Add(void *item);
+
+	/// Runs every item added since Reset() and returns when all have finished.
+	HRESULT Run(Function function, void *context);
+
+	/// Items a worker ran, and how many of those it stole.
+	int Ran(int worker) const {
+		return workers[worker].ran;
+	}
+	int Stolen(int worker) const {
+		return workers[worker].stolen;
+	}
+
+private:
+	struct Worker {
+		CRITICAL_SECTION lock;
+		void **items;
+		int capacity;
+		// Owned items still queued are items[head] to items[tail - 1].
+		int head;
+		int tail;
+		int ran;
+		int stolen;
+		WorkPool *pool;
+		int index;
+	};
+
+	static DWORD WINAPI ThreadMain(LPVOID parameter);
+	void *Take(int worker);
+	void *Steal(int thief);
+
+	Worker workers[WORK_POOL_MAX_THREADS];
+	int threads;
+	int next;
+	Function function;
+	void *context;
+};
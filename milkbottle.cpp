@@ -1,847 +1,2270 @@
-#include <deque>
-#include <windows.h>
-#include <avrt.h>
-#include <atlbase.h>
-#include <mmdeviceapi.h>
-#include <audioclient.h>
-#include <audiopolicy.h>
-#include <functiondiscoverykeys_devpkey.h>
-
-#include "wa_ipc.h"
-#include "vis.h"
-#include "api.h"
-#include "resource.h"
-
-#include "WWMFResampler.h"
-#include "WWUtil.h"
-
-#define LOG(format, ...) \
-{ \
-	wchar_t buffer[2048]; \
-	swprintf_s(buffer, _countof(buffer), format L"\n", __VA_ARGS__); \
-	OutputDebugStringW(buffer); \
-}
-#define ERR(format, ...) LOG(L"Error: " format, __VA_ARGS__)
-
-#define CBCLASS LanguageService
-class LanguageService : public api_language {
-public:
-	char *GetString(HINSTANCE hinst, HINSTANCE owner, UINT uID, char *str = NULL, size_t maxlen = 0) {
-		if (str) {
-			LoadStringA(owner, uID, str, maxlen);
-			return str;
-		}
-		return "NULL";
-	}
-	wchar_t *GetStringW(HINSTANCE hinst, HINSTANCE owner, UINT uID, wchar_t *str = NULL, size_t maxlen = 0)	{
-		static wchar_t buffer[512];
-		if (!str) {
-			str = buffer;
-			maxlen = 512;
-		}
-		if (str) {
-			LoadStringW(owner, uID, str, maxlen);
-			return str;
-		}
-		return L"NULL";
-	}
-	HMENU LoadLMenu(HINSTANCE localised, HINSTANCE original, UINT id) {
-		return ::LoadMenuA(original, (LPCSTR)id);
-	}
-	INT_PTR LDialogBoxParamW(HINSTANCE localised, HINSTANCE original, UINT id, HWND parent, DLGPROC proc, LPARAM param) {
-		return DialogBoxParamW(original, MAKEINTRESOURCEW(id), parent, proc, param);
-	}
-	HWND CreateLDialogParamW(HINSTANCE localised, HINSTANCE original, UINT id, HWND parent, DLGPROC proc, LPARAM param) {
-		return CreateDialogParamW(original, MAKEINTRESOURCEW(id), parent, proc, param);
-	}
-	START_DISPATCH
-		CB(API_LANGUAGE_GETSTRING, GetString)
-		CB(API_LANGUAGE_GETSTRINGW, GetStringW)
-		CB(API_LANGUAGE_LOADLMENU, LoadLMenu)
-		CB(API_LANGUAGE_LDIALOGBOXPARAMW, LDialogBoxParamW)
-		CB(API_LANGUAGE_CREATELDIALOGPARAMW, CreateLDialogParamW)
-		END_DISPATCH
-};
-static LanguageService languageService;
-#undef CBCLASS
-
-#define CBCLASS ApplicationService
-class ApplicationService : public api_application {
-public:
-	START_DISPATCH
-		END_DISPATCH
-};
-static ApplicationService applicationService;
-#undef CBCLASS
-
-#define CBCLASS SyscbService
-class SyscbService : public api_syscb {
-public:
-	START_DISPATCH
-		END_DISPATCH
-};
-static SyscbService syscbService;
-#undef CBCLASS
-
-#define CBCLASS FallbackService
-class FallbackService : public Dispatchable {
-public:
-	START_DISPATCH
-		END_DISPATCH
-};
-static FallbackService fallbackService;
-#undef CBCLASS
-
-#define CBCLASS ServiceFactory
-class ServiceFactory : public waServiceFactory {
-public:
-	ServiceFactory(void *x) : x(x) {
-	}
-	void *getInterface(int global_lock) {
-		return x;
-	}
-	START_DISPATCH
-		CB(WASERVICEFACTORY_GETINTERFACE, getInterface)
-		END_DISPATCH
-		void *x;
-};
-static ServiceFactory languageServiceFactory(&languageService);
-static ServiceFactory applicationServiceFactory(&applicationService);
-static ServiceFactory syscbServiceFactory(&syscbService);
-static ServiceFactory fallbackServiceFactory(&fallbackService);
-#undef CBCLASS
-
-#define CBCLASS ApiService
-class ApiService : public api_service {
-public:
-	waServiceFactory *service_getServiceByGuid(GUID guid) {
-		if (guid == languageApiGUID)
-			return &languageServiceFactory;
-		if (guid == applicationApiServiceGuid)
-			return &applicationServiceFactory;
-		if (guid == syscbApiServiceGuid)
-			return &syscbServiceFactory;
-		return &fallbackServiceFactory;
-	}
-	START_DISPATCH
-		CB(API_SERVICE_SERVICE_GETSERVICEBYGUID, service_getServiceByGuid)
-		END_DISPATCH
-};
-static ApiService apiService;
-#undef CBCLASS
-
-#define ID_START 10001
-#define ID_STOP 10002
-#define ID_CONFIG 10003
-#define ID_EXIT 10004
-#define STATE_RUNNING 10001
-#define STATE_STOPPED 10002
-#define STATE_CONFIG 10003
-#define STATE_EXIT 10004
-
-winampVisModule *milkdropModule;
-IMMDeviceEnumerator *pMMDeviceEnumerator = NULL;
-LPWSTR noSuitableDev = L"No Suitable Device or Resampler Missing";
-LPWSTR selectedDevMissing = L"Selected Device Missing or Resampler Missing";
-LPWSTR audioDeviceName = noSuitableDev;
-int state = STATE_RUNNING;
-int previousState = STATE_RUNNING;
-bool deviceChanged;
-bool noAudio;
-UINT numDevices = 0;
-std::deque<LPWSTR> deviceList;
-int selectedDevice = 0;
-
-BYTE* chunk = new BYTE[2*576];
-
-// For handling messages expected to go to Winamp.
-LRESULT WINAPI WinampWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam) {
-	switch (msg) {
-	case WM_WA_IPC:
-		switch (lParam) {
-		case IPC_ISPLAYING:
-			return true;
-			break;
-		case IPC_GETLISTPOS:
-			return 0;
-			break;
-		case IPC_GETPLAYLISTTITLEW:
-			return (LRESULT) audioDeviceName;
-			break;
-		case IPC_GET_API_SERVICE:
-			return (LPARAM) &apiService;
-			break;
-		default:
-			LOG(L"Unsupported Winamp IPC: %d", lParam);
-			return 0;
-			break;
-		}
-		break;
-	}
-	return DefWindowProc(hWnd, msg, wParam, lParam);
-}
-
-LRESULT WINAPI MainWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam) {
-	switch (msg) {
-	case WM_USER + 1:
-		if (lParam == WM_LBUTTONUP) {
-			if (state == STATE_STOPPED)
-				state = STATE_RUNNING;
-			else if (state == STATE_RUNNING)
-				state = STATE_STOPPED;
-		}
-		else if (lParam == WM_RBUTTONUP && state != STATE_CONFIG) {
-			POINT pt;
-			GetCursorPos(&pt);
-			HMENU hMenu = CreatePopupMenu();
-			if (state == STATE_STOPPED)
-				InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_START, "Start");
-			else if (state == STATE_RUNNING)
-				InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_STOP, "Stop");
-
-			HMENU hSubmenu = CreatePopupMenu();
-			InsertMenuW(hSubmenu, -1, MF_BYPOSITION | MF_STRING, 0, L"Use the default device");
-			InsertMenuW(hSubmenu, -1, MF_BYPOSITION | MF_SEPARATOR, 0, NULL);
-			IMMDeviceCollection *pCollection = NULL;
-			if (pMMDeviceEnumerator &&
-				SUCCEEDED(pMMDeviceEnumerator->EnumAudioEndpoints(eAll, DEVICE_STATE_ACTIVE | DEVICE_STATE_UNPLUGGED, &pCollection)) &&
-				SUCCEEDED(pCollection->GetCount(&numDevices)) &&
-				numDevices > 0) {
-					IMMDevice *pEndpoint = NULL;
-					LPWSTR pwszID = NULL;
-					IPropertyStore *pProps = NULL;
-					PROPVARIANT varName;
-					PropVariantInit(&varName);
-					for (UINT i = 0; i < deviceList.size(); i++) if (deviceList[i]) CoTaskMemFree(deviceList[i]);
-					deviceList.clear();
-					for (UINT i = 0; i < numDevices; i++) {
-						if (SUCCEEDED(pCollection->Item(i, &pEndpoint)) &&
-							SUCCEEDED(pEndpoint->GetId(&pwszID)) &&
-							SUCCEEDED(pEndpoint->OpenPropertyStore(STGM_READ, &pProps)) &&
-							SUCCEEDED(pProps->GetValue(PKEY_Device_FriendlyName, &varName))) {
-								deviceList.push_back(pwszID);
-								InsertMenuW(hSubmenu, -1, MF_BYPOSITION | MF_STRING, i + 1, varName.pwszVal);
-						} else {
-							deviceList.push_back(L"");
-						}
-						PropVariantClear(&varName);
-						SafeRelease(&pProps);
-						SafeRelease(&pEndpoint);
-					}
-			}
-			SafeRelease(&pCollection);
-			InsertMenu(hMenu, -1, MF_BYPOSITION | MF_POPUP | MF_STRING, (UINT_PTR)hSubmenu, "Select Device");
-
-			InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_CONFIG, "Configure");
-			InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_EXIT, "Quit");
-			SetForegroundWindow(hWnd);
-			TrackPopupMenu(hMenu, TPM_LEFTALIGN | TPM_RIGHTBUTTON | TPM_BOTTOMALIGN, pt.x, pt.y, 0, hWnd, NULL);
-			DestroyMenu(hMenu);
-		}
-		break;
-	case WM_COMMAND:
-		switch (wParam) {
-		case LOWORD(ID_CONFIG):
-			if (state != STATE_CONFIG && state != STATE_EXIT) {
-				previousState = state;
-				state = STATE_CONFIG;
-			}
-			break;
-		case LOWORD(ID_START):
-			if (state == STATE_STOPPED)
-				state = STATE_RUNNING;
-			break;
-		case LOWORD(ID_STOP):
-			if (state == STATE_RUNNING)
-				state = STATE_STOPPED;
-			break;
-		case LOWORD(ID_EXIT):
-			state = STATE_EXIT;
-			break;
-		default:
-			if (wParam >= 0 && wParam <= numDevices) {
-				selectedDevice = wParam;
-				deviceChanged = true;
-			}
-		}
-		break;
-	}
-	return DefWindowProc(hWnd, msg, wParam, lParam);
-}
-
-class MMNotificationClient : public IMMNotificationClient {
-public:
-	ULONG STDMETHODCALLTYPE AddRef() {
-		return 0;
-	}
-	ULONG STDMETHODCALLTYPE Release() {
-		return 0;
-	}
-	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, VOID **ppvInterface) {
-		return S_OK;
-	}
-	HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(EDataFlow flow, ERole role, LPCWSTR pwstrDeviceId) {
-		deviceChanged = true;
-		return S_OK;
-	}
-	HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR pwstrDeviceId) {
-		return S_OK;
-	}
-	HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR pwstrDeviceId) {
-		return S_OK;
-	}
-	HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(LPCWSTR pwstrDeviceId, DWORD dwNewState) {
-		deviceChanged = true;
-		return S_OK;
-	}
-	HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(LPCWSTR pwstrDeviceId, const PROPERTYKEY key) {
-		deviceChanged = true;
-		return S_OK;
-	}
-};
-
-class SessionEvents : public IAudioSessionEvents {
-
-private:
-	LONG rc;
-	~SessionEvents() {}
-
-public:
-	SessionEvents() :
-	  rc(1) {}
-
-	  ULONG STDMETHODCALLTYPE AddRef() {
-		  return InterlockedIncrement(&rc);
-	  }
-
-	  ULONG STDMETHODCALLTYPE Release() {
-		  ULONG rc = InterlockedDecrement(&this->rc);
-		  if (rc == 0) {
-			  delete this;
-		  }
-		  return rc;
-	  }
-
-	  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppv) {
-		  if (IID_IUnknown == riid) {
-			  AddRef();
-			  *ppv = static_cast<IUnknown*>(this);
-			  return S_OK;
-		  }
-		  else if (__uuidof(IAudioSessionEvents) == riid) {
-			  AddRef();
-			  *ppv = static_cast<IAudioSessionEvents*>(this);
-			  return S_OK;
-		  }
-		  else {
-			  *ppv = nullptr;
-			  return E_NOINTERFACE;
-		  }
-	  }
-
-	  HRESULT STDMETHODCALLTYPE OnDisplayNameChanged(LPCWSTR NewDisplayName, LPCGUID EventContext) {
-		  return S_OK;
-	  }
-
-	  HRESULT STDMETHODCALLTYPE OnIconPathChanged(LPCWSTR NewIconPath, LPCGUID EventContext) {
-		  return S_OK;
-	  }
-
-	  HRESULT STDMETHODCALLTYPE OnSimpleVolumeChanged(float NewVolume, BOOL NewMute, LPCGUID EventContext) {
-		  return S_OK;
-	  }
-
-	  HRESULT STDMETHODCALLTYPE OnChannelVolumeChanged(DWORD ChannelCount, float NewChannelVolumeArray[], DWORD ChangedChannel, LPCGUID EventContext) {
-		  return S_OK;
-	  }
-
-	  HRESULT STDMETHODCALLTYPE OnGroupingParamChanged(LPCGUID NewGroupingParam, LPCGUID EventContext) {
-		  return S_OK;
-	  }
-
-	  HRESULT STDMETHODCALLTYPE OnStateChanged(AudioSessionState NewState) {
-		  if (NewState == AudioSessionStateInactive) deviceChanged = true;
-		  return S_OK;
-	  }
-
-	  HRESULT STDMETHODCALLTYPE OnSessionDisconnected(AudioSessionDisconnectReason DisconnectReason) {
-		  return S_OK;
-	  }
-};
-
-SessionEvents *sessionEvents = new SessionEvents();
-
-class SessionNotification : public IAudioSessionNotification {
-
-private:
-	LONG rc;
-	~SessionNotification() {}
-
-public:
-	SessionNotification() : rc(1) {}
-
-	ULONG STDMETHODCALLTYPE AddRef() {
-		return InterlockedIncrement(&rc);
-	}
-
-	ULONG STDMETHODCALLTYPE Release() {
-		ULONG rc = InterlockedDecrement(&this->rc);
-		if (rc == 0)
-			delete this;
-		return rc;
-	}
-
-	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppv) {
-		if (IID_IUnknown == riid) {
-			AddRef();
-			*ppv = static_cast<IUnknown*>(this);
-			return S_OK;
-		}
-		else if (__uuidof(IAudioSessionNotification) == riid) {
-			AddRef();
-			*ppv = static_cast<IAudioSessionNotification*>(this);
-			return S_OK;
-		}
-		else {
-			*ppv = nullptr;
-			return E_NOINTERFACE;
-		}
-	}
-
-	HRESULT STDMETHODCALLTYPE OnSessionCreated(IAudioSessionControl *newSession) {
-		HRESULT hr = S_OK;
-		if (newSession) {
-			newSession->AddRef();
-			newSession->RegisterAudioSessionNotification(sessionEvents);
-		}
-		return hr;
-	}
-};
-
-long audioLoop(IMMDeviceEnumerator *pMMDeviceEnumerator, bool loopback) {
-	HRESULT hr = S_OK;
-	noAudio = false;
-
-	IMMDevice *m_pMMDevice = NULL;
-	CComPtr<IAudioSessionManager2> manager = NULL;
-	CComPtr<IAudioSessionEnumerator> sessions = NULL;
-	CComPtr<IAudioSessionControl> control;
-	SessionNotification* notification = new SessionNotification;
-	IPropertyStore *pPropertyStore = NULL;
-	PROPVARIANT pv;
-	IAudioClient *pAudioClient = NULL;
-	WAVEFORMATEX *pwfx = NULL;
-	IAudioCaptureClient *pAudioCaptureClient = NULL;
-
-	WWMFPcmFormat inputFormat;
-	WWMFPcmFormat outputFormat;
-	WWMFResampler resampler;
-	WWMFSampleData sampleData;
-
-	int sessionCount = 0;
-	MSG msg;
-	msg.message = WM_NULL;
-	UINT32 nPasses = 0;
-	UINT32 pnFrames = 0;
-	UINT32 nNextPacketSize = 0;
-	BYTE *pData = NULL;
-	UINT32 nNumFramesToRead = 0;
-	DWORD dwFlags = 0;
-	std::deque<byte> bufferLeft;
-	std::deque<byte> bufferRight;
-
-	if (selectedDevice > 0) {
-		hr = pMMDeviceEnumerator->GetDevice(deviceList[selectedDevice - 1], &m_pMMDevice);
-	} else {
-		hr = pMMDeviceEnumerator->GetDefaultAudioEndpoint(loopback ? eRender : eCapture, eConsole, &m_pMMDevice);
-	}
-
-	if (FAILED(hr)) {
-		ERR(L"IMMDeviceEnumerator::%s failed: hr = 0x%08x", selectedDevice > 0 ? L"GetDevice" : L"GetDefaultAudioEndpoint", hr);
-		noAudio = true;
-		goto cleanup;
-	}
-
-	if (S_FALSE == hr) {
-		noAudio = true;
-		goto cleanup;
-	}
-
-	m_pMMDevice->Activate(__uuidof(IAudioSessionManager2), CLSCTX_ALL, nullptr, reinterpret_cast<void**>(&manager));
-	manager->RegisterSessionNotification(notification);
-	hr = manager->GetSessionEnumerator(&sessions);
-	if (FAILED(hr)) {
-		ERR(L"IAudioSessionManager2::GetSessionEnumerator failed: hr = 0x%08x", hr);
-	} else {
-		sessions->GetCount(&sessionCount);
-		for(int s = 0; s < sessionCount; s++) {
-			sessions->GetSession(s, &control);
-			control->RegisterAudioSessionNotification(sessionEvents);
-			SafeRelease(&control);
-		}
-	}
-	SafeRelease(&sessions);
-
-	hr = m_pMMDevice->OpenPropertyStore(STGM_READ, &pPropertyStore);
-	if (FAILED(hr)) {
-		ERR(L"IMMDevice::OpenPropertyStore failed: hr = 0x%08x", hr);
-		noAudio = true;
-		goto cleanup;
-	}
-
-	PropVariantInit(&pv);
-	hr = pPropertyStore->GetValue(PKEY_Device_FriendlyName, &pv);
-	if (FAILED(hr)) {
-		ERR(L"IPropertyStore::GetValue failed: hr = 0x%08x", hr);
-		noAudio = true;
-		goto cleanup;
-	}
-
-	if (VT_LPWSTR != pv.vt) {
-		ERR(L"PKEY_Device_FriendlyName variant type is %u - expected VT_LPWSTR", pv.vt);
-		noAudio = true;
-		goto cleanup;
-	}
-
-	audioDeviceName = pv.pwszVal;
-
-	hr = m_pMMDevice->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&pAudioClient);
-	if (FAILED(hr)) {
-		ERR(L"IMMDevice::Activate(IAudioClient) failed: hr = 0x%08x", hr);
-		noAudio = true;
-		goto cleanup;
-	}
-
-	hr = pAudioClient->GetMixFormat(&pwfx);
-	if (FAILED(hr)) {
-		ERR(L"IAudioClient::GetMixFormat failed: hr = 0x%08x", hr);
-		noAudio = true;
-		goto cleanup;
-	}
-
-	inputFormat.sampleFormat = WWMFBitFormatFloat;
-	inputFormat.nChannels = pwfx->nChannels;
-	inputFormat.sampleRate = pwfx->nSamplesPerSec;
-	inputFormat.bits = pwfx->wBitsPerSample;
-
-	outputFormat.sampleFormat = WWMFBitFormatInt;
-	outputFormat.nChannels = 2;
-	outputFormat.sampleRate = 44100;
-	outputFormat.bits = 8;
-	outputFormat.validBitsPerSample = 8;
-	outputFormat.dwChannelMask = 3;
-
-	bool useResampler = true;
-
-	if (pwfx->wFormatTag == WAVE_FORMAT_IEEE_FLOAT && pwfx->nChannels == 2 && pwfx->nSamplesPerSec == 44100) {
-		useResampler = false;
-		pwfx->wFormatTag = WAVE_FORMAT_PCM;
-		pwfx->wBitsPerSample = 8;
-		pwfx->nBlockAlign = pwfx->nChannels * pwfx->wBitsPerSample / 8;
-		pwfx->nAvgBytesPerSec = pwfx->nBlockAlign * pwfx->nSamplesPerSec;
-	} else if (pwfx->wFormatTag == WAVE_FORMAT_EXTENSIBLE) {
-		PWAVEFORMATEXTENSIBLE pEx = reinterpret_cast<PWAVEFORMATEXTENSIBLE>(pwfx);
-		inputFormat.validBitsPerSample = pEx->Samples.wValidBitsPerSample;
-		inputFormat.dwChannelMask = pEx->dwChannelMask;
-		if (IsEqualGUID(KSDATAFORMAT_SUBTYPE_IEEE_FLOAT, pEx->SubFormat) && pwfx->nChannels == 2 && pwfx->nSamplesPerSec == 44100) {
-			useResampler = false;
-			pEx->SubFormat = KSDATAFORMAT_SUBTYPE_PCM;
-			pEx->Samples.wValidBitsPerSample = 8;
-			pwfx->wBitsPerSample = 8;
-			pwfx->nBlockAlign = pwfx->nChannels * pwfx->wBitsPerSample / 8;
-			pwfx->nAvgBytesPerSec = pwfx->nBlockAlign * pwfx->nSamplesPerSec;
-		}
-	}
-
-	if (useResampler) {
-		hr = resampler.Initialize(inputFormat, outputFormat, 5);
-		if (FAILED(hr)) {
-			ERR(L"WWMFResampler::Initialize failed: hr = 0x%08x", hr);
-			noAudio = true;
-			resampler.Finalize();
-			goto cleanup;
-		}
-	}
-
-	hr = pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, loopback ? AUDCLNT_STREAMFLAGS_LOOPBACK : 0, 0, 0, pwfx, 0);
-	if (FAILED(hr)) {
-		ERR(L"IAudioClient::Initialize failed: hr = 0x%08x", hr);
-		noAudio = true;
-		goto cleanup;
-	}
-
-	hr = pAudioClient->GetService(__uuidof(IAudioCaptureClient), (void**)&pAudioCaptureClient);
-	if (FAILED(hr)) {
-		ERR(L"IAudioClient::GetService(IAudioCaptureClient) failed: hr = 0x%08x", hr);
-		noAudio = true;
-		goto cleanup;
-	}
-
-	hr = pAudioClient->Start();
-	if (FAILED(hr)) {
-		ERR(L"IAudioClient::Start failed: hr = 0x%08x", hr);
-		noAudio = true;
-		goto cleanup;
-	}
-
-	while (state == STATE_RUNNING && !deviceChanged) {
-		if (PeekMessage(&msg, NULL, 0U, 0U, PM_REMOVE)) {
-			TranslateMessage(&msg);
-			DispatchMessage(&msg);
-			if (WM_QUIT == msg.message)
-				state = STATE_EXIT;
-		} else {
-			nPasses++;
-			hr = pAudioCaptureClient->GetNextPacketSize(&nNextPacketSize);
-			while (SUCCEEDED(hr) && nNextPacketSize > 0 && bufferLeft.size() < pwfx->nSamplesPerSec * 576 / 44100.0) {
-				hr = pAudioCaptureClient->GetBuffer(&pData, &nNumFramesToRead, &dwFlags, NULL, NULL);
-				if (FAILED(hr)) {
-					ERR(L"IAudioCaptureClient::GetBuffer failed on pass %u after %u frames: hr = 0x%08x", nPasses, pnFrames, hr);
-					pAudioClient->Stop();
-					goto cleanup;
-				}
-
-				pnFrames += nNumFramesToRead;
-
-				if (dwFlags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY) {
-					bufferLeft.clear();
-					bufferRight.clear();
-				}
-
-				if (dwFlags & AUDCLNT_BUFFERFLAGS_SILENT)
-					for (int i = 0; i < 576*2; i+=2) {
-						bufferLeft.push_back(0);
-						bufferRight.push_back(0);
-					}
-				else {
-					if (useResampler) {
-						hr = resampler.Resample(pData, nNumFramesToRead * pwfx->nBlockAlign, &sampleData);
-						if (FAILED(hr)) {
-							ERR(L"WWMFResampler::Resample failed: hr = 0x%08x", hr);
-							sampleData.Release();
-							resampler.Finalize();
-							pAudioClient->Stop();
-							noAudio = true;
-							goto cleanup;
-						}
-					} else {
-						sampleData.bytes = nNumFramesToRead * 2;
-						sampleData.data = pData;
-					}
-
-					for (int i = 0; i < sampleData.bytes; i+=2) {
-						bufferLeft.push_back(sampleData.data[i] - 128);
-						bufferRight.push_back(sampleData.data[i + 1] - 128);
-					}
-
-					if (useResampler)
-						sampleData.Release();
-					else
-						sampleData.Forget();
-				}
-
-				hr = pAudioCaptureClient->ReleaseBuffer(nNumFramesToRead);
-				if (FAILED(hr)) {
-					ERR(L"IAudioCaptureClient::ReleaseBuffer failed on pass %u after %u frames: hr = 0x%08x", nPasses, pnFrames, hr);
-					pAudioClient->Stop();
-					goto cleanup;
-				}
-
-				hr = pAudioCaptureClient->GetNextPacketSize(&nNextPacketSize);
-			}
-
-			if (!SUCCEEDED(hr)) {
-				ERR(L"IAudioCaptureClient::GetNextPacketSize failed on pass %u after %u frames: hr = 0x%08x", nPasses, pnFrames, hr);
-				pAudioClient->Stop();
-				goto cleanup;
-			}
-			if (bufferLeft.size() >= 576) {
-				for (int i = 0; i < 576; ++i) {
-					chunk[i] = bufferLeft.front();
-					bufferLeft.pop_front();
-					chunk[576+i] = bufferRight.front();
-					bufferRight.pop_front();
-				}
-				memcpy(milkdropModule->waveformData, chunk, 2*576);
-			}
-			milkdropModule->Render(milkdropModule);
-		}
-	}
-	pAudioClient->Stop();
-
-cleanup:
-	if (useResampler) resampler.Finalize();
-	SafeRelease(&pAudioCaptureClient);
-	if (pwfx) CoTaskMemFree(pwfx);
-	SafeRelease(&pAudioClient);
-	audioDeviceName = selectedDevice > 0 ? selectedDevMissing : noSuitableDev;
-	if (&pv) PropVariantClear(&pv);
-	SafeRelease(&pPropertyStore);
-	if (manager) {
-		hr = manager->GetSessionEnumerator(&sessions);
-		if (FAILED(hr)) {
-			ERR(L"IAudioSessionManager2::GetSessionEnumerator failed: hr = 0x%08x", hr);
-		} else {
-			sessions->GetCount(&sessionCount);
-			for(int s = 0; s < sessionCount; s++) {
-				sessions->GetSession(s, &control);
-				control->UnregisterAudioSessionNotification(sessionEvents);
-				SafeRelease(&control);
-			}
-		}
-		SafeRelease(&sessions);
-		manager->UnregisterSessionNotification(notification);
-	}
-	SafeRelease(&notification);
-	SafeRelease(&manager);
-	SafeRelease(&m_pMMDevice);
-
-	return hr;
-}
-
-int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PWSTR pCmdLine, int nCmdShow)
-{
-	char winampClassName[] = "Winamp";
-	char winampWindowName[] = "Winamp";
-
-	WNDCLASS winampClass;
-	winampClass.style = 0;
-	winampClass.lpfnWndProc = WinampWndProc;
-	winampClass.cbClsExtra = 0;
-	winampClass.cbWndExtra = 0;
-	winampClass.hInstance = hInstance;
-	winampClass.hIcon = NULL;
-	winampClass.hCursor = NULL;
-	winampClass.hbrBackground = NULL;
-	winampClass.lpszMenuName = NULL;
-	winampClass.lpszClassName = winampClassName;
-
-	if (!RegisterClass(&winampClass)) {
-		ERR(L"RegisterClass failed");
-		MessageBox(NULL, "RegisterClass failed.", "Error", 0);
-		return 1;
-	}
-
-	HWND winampWindow = CreateWindow(winampClassName, winampWindowName, 0, 0, 0, 0, 0, NULL, NULL, hInstance, NULL);
-	if (winampWindow == NULL) {
-		ERR(L"CreateWindow failed");
-		MessageBox(NULL, "CreateWindow failed.", "Error", 0);
-		return 1;
-	}
-
-	char mainClassName[] = "MilkDrop 2";
-	char mainWindowName[] = "MilkDrop 2";
-
-	WNDCLASS mainClass;
-	mainClass.style = 0;
-	mainClass.lpfnWndProc = MainWndProc;
-	mainClass.cbClsExtra = 0;
-	mainClass.cbWndExtra = 0;
-	mainClass.hInstance = hInstance;
-	mainClass.hIcon = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_PLUGIN_ICON));
-	mainClass.hCursor = NULL;
-	mainClass.hbrBackground = NULL;
-	mainClass.lpszMenuName = NULL;
-	mainClass.lpszClassName = mainClassName;
-
-	if (!RegisterClass(&mainClass)) {
-		ERR(L"RegisterClass failed");
-		MessageBox(NULL,"RegisterClass failed.", "Error", 0);
-		return 1;
-	}
-
-	HWND mainWindow = CreateWindow(mainWindowName, NULL, 0, 0, 0, 0, 0, NULL, NULL, hInstance, NULL);
-	if (mainWindow == NULL) {
-		ERR(L"CreateWindow failed");
-		MessageBox(NULL,"CreateWindow failed.", "Error", 0);
-		return 1;
-	}
-
-	NOTIFYICONDATA nid;
-	nid.hWnd = mainWindow;
-	nid.uCallbackMessage = WM_USER + 1;
-	nid.hIcon = mainClass.hIcon;
-	strcpy_s(nid.szTip, mainWindowName);
-	nid.uFlags = NIF_MESSAGE | NIF_ICON | NIF_TIP;
-	Shell_NotifyIcon(NIM_ADD, &nid);
-
-	HMODULE milkdropLibrary = LoadLibrary("vis_milk2.dll");
-	winampVisGetHeaderType header_getter = reinterpret_cast<winampVisGetHeaderType>(GetProcAddress(milkdropLibrary, "winampVisGetHeader"));
-	winampVisHeader *milkdropHeader = header_getter(winampWindow);
-	milkdropModule = milkdropHeader->getModule(0);
-	milkdropModule->hDllInstance = milkdropLibrary;
-	milkdropModule->hwndParent = winampWindow;
-
-	HRESULT hr;
-	hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
-	if (FAILED(hr)) {
-		ERR(L"CoInitialize failed: hr = 0x%08x", hr);
-		return -__LINE__;
-	}
-
-	hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL, __uuidof(IMMDeviceEnumerator), (void**)&pMMDeviceEnumerator);
-	if (FAILED(hr)) {
-		ERR(L"CoCreateInstance(IMMDeviceEnumerator) failed: hr = 0x%08x", hr);
-		pMMDeviceEnumerator = NULL;
-	}
-
-	MSG msg;
-	msg.message = WM_NULL;
-	MMNotificationClient notificationClient;
-	while (state != STATE_EXIT) {
-		if (state == STATE_RUNNING)	{
-			milkdropModule->Init(milkdropModule);
-			while(state == STATE_RUNNING) {
-				if (!pMMDeviceEnumerator) {
-					noAudio = true;
-				} else {
-					noAudio = false;
-					pMMDeviceEnumerator->RegisterEndpointNotificationCallback(&notificationClient);
-					deviceChanged = false;
-					audioLoop(pMMDeviceEnumerator, true);
-					if (noAudio) {
-						noAudio = false;
-						audioLoop(pMMDeviceEnumerator, false);
-					}
-				}
-				if (noAudio) {
-					deviceChanged = false;
-					memset(milkdropModule->waveformData, 0, 2*576);
-					while (state == STATE_RUNNING && !deviceChanged) {
-						if (PeekMessage(&msg, NULL, 0U, 0U, PM_REMOVE)) {
-							TranslateMessage(&msg);
-							DispatchMessage(&msg);
-							if (WM_QUIT == msg.message) {
-								state = STATE_EXIT;
-							}
-						} else {
-							milkdropModule->Render(milkdropModule);
-						}
-					}
-				}
-				if (pMMDeviceEnumerator) {
-					pMMDeviceEnumerator->UnregisterEndpointNotificationCallback(&notificationClient);
-				}
-			}
-			milkdropModule->Quit(milkdropModule);
-			while (PeekMessage(&msg, NULL, 0U, 0U, PM_REMOVE)) {
-				TranslateMessage(&msg);
-				DispatchMessage(&msg);
-			}
-		} else if (state == STATE_STOPPED) {
-			GetMessage(&msg, NULL, 0U, 0U);
-			TranslateMessage(&msg);
-			DispatchMessage(&msg);
-		} else if (state == STATE_CONFIG) {
-			milkdropModule->Config(milkdropModule);
-			state = previousState;
-		}
-	}
-
-	SafeRelease(&pMMDeviceEnumerator);
-	Shell_NotifyIcon(NIM_DELETE, &nid);
-	delete[] chunk;
-	CoUninitialize();
-
-	return 0;
-}
+#include <deque>
+#include <new>
+#include <math.h>
+#include <windows.h>
+#include <avrt.h>
+#include <atlbase.h>
+#include <mmdeviceapi.h>
+#include <audioclient.h>
+#include <audiopolicy.h>
+#include <functiondiscoverykeys_devpkey.h>
+
+#include "wa_ipc.h"
+#include "api.h"
+#include "resource.h"
+
+#include "WWMFResampler.h"
+#include "WWUtil.h"
+#include "DriftCompensator.h"
+#include "Trace.h"
+#include "SharedWaveform.h"
+#include "StateMachine.h"
+#include "PacketBatcher.h"
+#include "ResamplerGovernor.h"
+#include "WinampVisualizer.h"
+#include "ProjectMVisualizer.h"
+#include "ProcessVisualizer.h"
+#include "Analyzer.h"
+#include "AllocProfile.h"
+#include "DelayLine.h"
+#include "FormatConverter.h"
+#include "FeatureFile.h"
+#include "BatchAnalyzer.h"
+#include "SessionNotification.h"
+#include "Backlog.h"
+#include "Log.h"
+
+#define CBCLASS LanguageService
+class LanguageService : public api_language {
+public:
+	char *GetString(HINSTANCE hinst, HINSTANCE owner, UINT uID, char *str = NULL, size_t maxlen = 0) {
+		if (str) {
+			LoadStringA(owner, uID, str, maxlen);
+			return str;
+		}
+		return "NULL";
+	}
+	wchar_t *GetStringW(HINSTANCE hinst, HINSTANCE owner, UINT uID, wchar_t *str = NULL, size_t maxlen = 0)	{
+		static wchar_t buffer[512];
+		if (!str) {
+			str = buffer;
+			maxlen = 512;
+		}
+		if (str) {
+			LoadStringW(owner, uID, str, maxlen);
+			return str;
+		}
+		return L"NULL";
+	}
+	HMENU LoadLMenu(HINSTANCE localised, HINSTANCE original, UINT id) {
+		return ::LoadMenuA(original, (LPCSTR)id);
+	}
+	INT_PTR LDialogBoxParamW(HINSTANCE localised, HINSTANCE original, UINT id, HWND parent, DLGPROC proc, LPARAM param) {
+		return DialogBoxParamW(original, MAKEINTRESOURCEW(id), parent, proc, param);
+	}
+	HWND CreateLDialogParamW(HINSTANCE localised, HINSTANCE original, UINT id, HWND parent, DLGPROC proc, LPARAM param) {
+		return CreateDialogParamW(original, MAKEINTRESOURCEW(id), parent, proc, param);
+	}
+	START_DISPATCH
+		CB(API_LANGUAGE_GETSTRING, GetString)
+		CB(API_LANGUAGE_GETSTRINGW, GetStringW)
+		CB(API_LANGUAGE_LOADLMENU, LoadLMenu)
+		CB(API_LANGUAGE_LDIALOGBOXPARAMW, LDialogBoxParamW)
+		CB(API_LANGUAGE_CREATELDIALOGPARAMW, CreateLDialogParamW)
+		END_DISPATCH
+};
+static LanguageService languageService;
+#undef CBCLASS
+
+#define CBCLASS ApplicationService
+class ApplicationService : public api_application {
+public:
+	START_DISPATCH
+		END_DISPATCH
+};
+static ApplicationService applicationService;
+#undef CBCLASS
+
+#define CBCLASS SyscbService
+class SyscbService : public api_syscb {
+public:
+	START_DISPATCH
+		END_DISPATCH
+};
+static SyscbService syscbService;
+#undef CBCLASS
+
+#define CBCLASS FallbackService
+class FallbackService : public Dispatchable {
+public:
+	START_DISPATCH
+		END_DISPATCH
+};
+static FallbackService fallbackService;
+#undef CBCLASS
+
+#define CBCLASS ServiceFactory
+class ServiceFactory : public waServiceFactory {
+public:
+	ServiceFactory(void *x) : x(x) {
+	}
+	void *getInterface(int global_lock) {
+		return x;
+	}
+	START_DISPATCH
+		CB(WASERVICEFACTORY_GETINTERFACE, getInterface)
+		END_DISPATCH
+		void *x;
+};
+static ServiceFactory languageServiceFactory(&languageService);
+static ServiceFactory applicationServiceFactory(&applicationService);
+static ServiceFactory syscbServiceFactory(&syscbService);
+static ServiceFactory fallbackServiceFactory(&fallbackService);
+#undef CBCLASS
+
+#define CBCLASS ApiService
+class ApiService : public api_service {
+public:
+	waServiceFactory *service_getServiceByGuid(GUID guid) {
+		if (guid == languageApiGUID)
+			return &languageServiceFactory;
+		if (guid == applicationApiServiceGuid)
+			return &applicationServiceFactory;
+		if (guid == syscbApiServiceGuid)
+			return &syscbServiceFactory;
+		return &fallbackServiceFactory;
+	}
+	START_DISPATCH
+		CB(API_SERVICE_SERVICE_GETSERVICEBYGUID, service_getServiceByGuid)
+		END_DISPATCH
+};
+static ApiService apiService;
+#undef CBCLASS
+
+#define ID_START 10001
+#define ID_STOP 10002
+#define ID_CONFIG 10003
+#define ID_EXIT 10004
+#define ID_TRACE 10005
+#define ID_PAUSE 10006
+#define ID_RESUME 10007
+// Backlog, in 44.1 kHz samples, the drift compensator leaves behind after each window.
+#define DRIFT_TARGET_SAMPLES (2*576)
+// Capture pauses above this backlog; the compensator should keep it from ever getting there.
+// It leaves room for a batch and a slow frame's worth of packets on top of the target.
+#define DRIFT_MAX_SAMPLES (8*576)
+#define DRIFT_MAX_PPM 2000
+// The backlog ring is sized for the cap plus a resampler batch and one large packet landing on
+// top of it, so it never has to grow in steady state.
+#define BACKLOG_HEADROOM_MS 200
+// A frame longer than this dumps the trace rings when tracing is enabled.
+#define TRACE_FRAME_BUDGET_MS 50.0
+// Capture packets are batched up to this much audio before each resampler call
+// (/batch=N overrides, 0 resamples every packet), and no packet waits longer than
+// the deadline (/batchdeadline=N).
+#define RESAMPLE_BATCH_MS 20
+#define RESAMPLE_BATCH_DEADLINE_MS 30
+#define RESAMPLE_STATS_SECONDS 10
+// Filter quality streams start at, and the CPU the resampler may use in milliseconds
+// per second of audio before the governor lowers it (/resamplebudget=N, 0 keeps it fixed).
+#define RESAMPLE_QUALITY 5
+#define RESAMPLE_BUDGET_MS 5
+#define FRAME_STATS_SECONDS 10
+// Time from Render() to light leaving the screen, taken off the audio output latency when
+// delaying windows (/displaylatency=N). Per-endpoint corrections in milliseconds live under
+// HKCU\Software\milkbottle\Latency as DWORD values named by endpoint ID.
+#define AV_DISPLAY_LATENCY_MS 16
+#define AV_LATENCY_KEY L"Software\\milkbottle\\Latency"
+// Most windows of a feature file handed to the visualizer in one frame; a longer gap, such as
+// the start of a /playoffset run, is skipped rather than fed in one burst.
+#define FEATURE_HANDOFF_WINDOWS 16
+// With /vishost, a visualizer child that finishes no frame for this long is restarted (/vishang=N).
+#define VIS_CHILD_HANG_MS 10000
+// Longest wait for a device switch that is still opening its endpoint when capture stops, and
+// for streams still closing in the background when milkbottle exits.
+#define PENDING_STREAM_CANCEL_MS 1000
+#define CLOSING_STREAMS_EXIT_MS 2000
+// How a mix format other than float stereo 44.1 kHz reaches the pipeline. Autoconvert is used
+// wherever the endpoint accepts it; otherwise the choice comes from a short calibration cached
+// under HKCU\Software\milkbottle\Conversion. /convert=resampler, /convert=autoconvert or
+// /convert=inprocess forces one.
+#define CONVERT_NONE 0
+#define CONVERT_RESAMPLER 1
+#define CONVERT_AUTOCONVERT 2
+#define CONVERT_INPROCESS 3
+#define CONVERT_KEY L"Software\\milkbottle\\Conversion"
+#define CONVERT_CALIBRATION_MS 200
+#define CONVERT_CALIBRATION_PACKET_MS 10
+
+Visualizer *visualizer;
+IMMDeviceEnumerator *pMMDeviceEnumerator = NULL;
+LPWSTR noSuitableDev = L"No Suitable Device or Resampler Missing";
+LPWSTR selectedDevMissing = L"Selected Device Missing or Resampler Missing";
+// Points into the current CaptureStream while one is open.
+LPCWSTR audioDeviceName = noSuitableDev;
+StateMachine stateMachine(STATE_RUNNING);
+volatile bool deviceChanged;
+bool noAudio;
+// Endpoints listed in the tray menu. UI thread only.
+UINT numDevices = 0;
+std::deque<LPWSTR> deviceList;
+// Endpoint ID chosen from the tray menu, empty for the default device. Set by the UI
+// thread, read by the render thread whenever it opens a stream.
+CRITICAL_SECTION selectedDeviceLock;
+wchar_t selectedDeviceId[256];
+
+BYTE* chunk = new BYTE[2*576];
+float windowLeft[576];
+float windowRight[576];
+SharedWaveformWriter sharedWaveform;
+Analyzer analyzer;
+AnalysisResult analysis;
+int resampleBatchMs = RESAMPLE_BATCH_MS;
+int resampleBatchDeadlineMs = RESAMPLE_BATCH_DEADLINE_MS;
+int resampleBudgetMs = RESAMPLE_BUDGET_MS;
+int displayLatencyMs = AV_DISPLAY_LATENCY_MS;
+// CONVERT_NONE lets each endpoint's calibration decide.
+int forcedConversion = CONVERT_NONE;
+// Feature file played in place of live capture (/play=), and its offset from the wall clock.
+FeatureFileReader features;
+int playOffsetMs = 0;
+// Open the next endpoint beside the current one when switching devices (/nogapless closes first).
+bool gaplessSwitch = true;
+
+// For handling messages expected to go to Winamp. The window lives on the render thread because
+// the plug-in sends to it synchronously from inside Render().
+LRESULT WINAPI WinampWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+	switch (msg) {
+	case WM_WA_IPC:
+		switch (lParam) {
+		case IPC_ISPLAYING:
+			return true;
+			break;
+		case IPC_GETLISTPOS:
+			return 0;
+			break;
+		case IPC_GETPLAYLISTTITLEW:
+			return (LRESULT) audioDeviceName;
+			break;
+		case IPC_GET_API_SERVICE:
+			return (LPARAM) &apiService;
+			break;
+		default:
+			LOG(L"Unsupported Winamp IPC: %d", lParam);
+			return 0;
+			break;
+		}
+		break;
+	}
+	return DefWindowProc(hWnd, msg, wParam, lParam);
+}
+
+static void SelectDevice(LPCWSTR id) {
+	EnterCriticalSection(&selectedDeviceLock);
+	wcscpy_s(selectedDeviceId, id ? id : L"");
+	LeaveCriticalSection(&selectedDeviceLock);
+	deviceChanged = true;
+}
+
+// Copies the selected endpoint ID. Returns false when the default device is selected.
+static bool GetSelectedDevice(wchar_t *id, size_t size) {
+	EnterCriticalSection(&selectedDeviceLock);
+	wcscpy_s(id, size, selectedDeviceId);
+	LeaveCriticalSection(&selectedDeviceLock);
+	return id[0] != L'\0';
+}
+
+// Runs on the UI thread. TrackPopupMenu is modal, so the render thread keeps drawing
+// while the menu is open and only sees the commands it results in.
+LRESULT WINAPI MainWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+	switch (msg) {
+	case WM_USER + 1:
+		if (lParam == WM_LBUTTONUP) {
+			stateMachine.Post(COMMAND_TOGGLE);
+		}
+		else if (lParam == WM_RBUTTONUP && stateMachine.Get() != STATE_CONFIG) {
+			POINT pt;
+			GetCursorPos(&pt);
+			HMENU hMenu = CreatePopupMenu();
+			int state = stateMachine.Get();
+			if (state == STATE_STOPPED)
+				InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_START, "Start");
+			else if (state == STATE_RUNNING)
+				InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_PAUSE, "Pause");
+			else if (state == STATE_PAUSED)
+				InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_RESUME, "Resume");
+			if (state == STATE_RUNNING || state == STATE_PAUSED)
+				InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_STOP, "Stop");
+
+			HMENU hSubmenu = CreatePopupMenu();
+			InsertMenuW(hSubmenu, -1, MF_BYPOSITION | MF_STRING, 0, L"Use the default device");
+			InsertMenuW(hSubmenu, -1, MF_BYPOSITION | MF_SEPARATOR, 0, NULL);
+			IMMDeviceCollection *pCollection = NULL;
+			if (pMMDeviceEnumerator &&
+				SUCCEEDED(pMMDeviceEnumerator->EnumAudioEndpoints(eAll, DEVICE_STATE_ACTIVE | DEVICE_STATE_UNPLUGGED, &pCollection)) &&
+				SUCCEEDED(pCollection->GetCount(&numDevices)) &&
+				numDevices > 0) {
+					IMMDevice *pEndpoint = NULL;
+					LPWSTR pwszID = NULL;
+					IPropertyStore *pProps = NULL;
+					PROPVARIANT varName;
+					PropVariantInit(&varName);
+					for (UINT i = 0; i < deviceList.size(); i++) if (deviceList[i]) CoTaskMemFree(deviceList[i]);
+					deviceList.clear();
+					for (UINT i = 0; i < numDevices; i++) {
+						pwszID = NULL;
+						if (SUCCEEDED(pCollection->Item(i, &pEndpoint)) &&
+							SUCCEEDED(pEndpoint->GetId(&pwszID)) &&
+							SUCCEEDED(pEndpoint->OpenPropertyStore(STGM_READ, &pProps)) &&
+							SUCCEEDED(pProps->GetValue(PKEY_Device_FriendlyName, &varName))) {
+								deviceList.push_back(pwszID);
+								InsertMenuW(hSubmenu, -1, MF_BYPOSITION | MF_STRING, i + 1, varName.pwszVal);
+						} else {
+							if (pwszID) CoTaskMemFree(pwszID);
+							deviceList.push_back(NULL);
+						}
+						PropVariantClear(&varName);
+						SafeRelease(&pProps);
+						SafeRelease(&pEndpoint);
+					}
+			}
+			SafeRelease(&pCollection);
+			InsertMenu(hMenu, -1, MF_BYPOSITION | MF_POPUP | MF_STRING, (UINT_PTR)hSubmenu, "Select Device");
+
+			InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_CONFIG, "Configure");
+			if (traceEnabled)
+				InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_TRACE, "Dump Trace");
+			InsertMenu(hMenu, -1, MF_BYPOSITION | MF_STRING, ID_EXIT, "Quit");
+			SetForegroundWindow(hWnd);
+			{
+				TRACE_SPAN("TrayMenu");
+				TrackPopupMenu(hMenu, TPM_LEFTALIGN | TPM_RIGHTBUTTON | TPM_BOTTOMALIGN, pt.x, pt.y, 0, hWnd, NULL);
+			}
+			DestroyMenu(hMenu);
+		}
+		break;
+	case WM_COMMAND:
+		switch (wParam) {
+		case LOWORD(ID_CONFIG):
+			stateMachine.Post(COMMAND_CONFIG);
+			break;
+		case LOWORD(ID_START):
+			stateMachine.Post(COMMAND_START);
+			break;
+		case LOWORD(ID_STOP):
+			stateMachine.Post(COMMAND_STOP);
+			break;
+		case LOWORD(ID_PAUSE):
+			stateMachine.Post(COMMAND_PAUSE);
+			break;
+		case LOWORD(ID_RESUME):
+			stateMachine.Post(COMMAND_RESUME);
+			break;
+		case LOWORD(ID_TRACE):
+			if (TraceDumpToTemp(L"manual"))
+				LOG(L"Trace dumped to %%TEMP%%");
+			break;
+		case LOWORD(ID_EXIT):
+			stateMachine.Post(COMMAND_EXIT);
+			break;
+		default:
+			if (wParam == 0)
+				SelectDevice(NULL);
+			else if (wParam <= numDevices && wParam <= deviceList.size() && deviceList[wParam - 1])
+				SelectDevice(deviceList[wParam - 1]);
+		}
+		break;
+	case WM_DESTROY:
+		PostQuitMessage(0);
+		break;
+	}
+	return DefWindowProc(hWnd, msg, wParam, lParam);
+}
+
+class MMNotificationClient : public IMMNotificationClient {
+public:
+	ULONG STDMETHODCALLTYPE AddRef() {
+		return 0;
+	}
+	ULONG STDMETHODCALLTYPE Release() {
+		return 0;
+	}
+	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, VOID **ppvInterface) {
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(EDataFlow flow, ERole role, LPCWSTR pwstrDeviceId) {
+		deviceChanged = true;
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR pwstrDeviceId) {
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR pwstrDeviceId) {
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(LPCWSTR pwstrDeviceId, DWORD dwNewState) {
+		deviceChanged = true;
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(LPCWSTR pwstrDeviceId, const PROPERTYKEY key) {
+		deviceChanged = true;
+		return S_OK;
+	}
+};
+
+class SessionEvents : public IAudioSessionEvents {
+
+private:
+	LONG rc;
+	~SessionEvents() {}
+
+public:
+	SessionEvents() :
+	  rc(1) {}
+
+	  ULONG STDMETHODCALLTYPE AddRef() {
+		  return InterlockedIncrement(&rc);
+	  }
+
+	  ULONG STDMETHODCALLTYPE Release() {
+		  ULONG rc = InterlockedDecrement(&this->rc);
+		  if (rc == 0) {
+			  delete this;
+		  }
+		  return rc;
+	  }
+
+	  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppv) {
+		  if (IID_IUnknown == riid) {
+			  AddRef();
+			  *ppv = static_cast<IUnknown*>(this);
+			  return S_OK;
+		  }
+		  else if (__uuidof(IAudioSessionEvents) == riid) {
+			  AddRef();
+			  *ppv = static_cast<IAudioSessionEvents*>(this);
+			  return S_OK;
+		  }
+		  else {
+			  *ppv = nullptr;
+			  return E_NOINTERFACE;
+		  }
+	  }
+
+	  HRESULT STDMETHODCALLTYPE OnDisplayNameChanged(LPCWSTR NewDisplayName, LPCGUID EventContext) {
+		  return S_OK;
+	  }
+
+	  HRESULT STDMETHODCALLTYPE OnIconPathChanged(LPCWSTR NewIconPath, LPCGUID EventContext) {
+		  return S_OK;
+	  }
+
+	  HRESULT STDMETHODCALLTYPE OnSimpleVolumeChanged(float NewVolume, BOOL NewMute, LPCGUID EventContext) {
+		  return S_OK;
+	  }
+
+	  HRESULT STDMETHODCALLTYPE OnChannelVolumeChanged(DWORD ChannelCount, float NewChannelVolumeArray[], DWORD ChangedChannel, LPCGUID EventContext) {
+		  return S_OK;
+	  }
+
+	  HRESULT STDMETHODCALLTYPE OnGroupingParamChanged(LPCGUID NewGroupingParam, LPCGUID EventContext) {
+		  return S_OK;
+	  }
+
+	  HRESULT STDMETHODCALLTYPE OnStateChanged(AudioSessionState NewState) {
+		  if (NewState == AudioSessionStateInactive) deviceChanged = true;
+		  return S_OK;
+	  }
+
+	  HRESULT STDMETHODCALLTYPE OnSessionDisconnected(AudioSessionDisconnectReason DisconnectReason) {
+		  return S_OK;
+	  }
+};
+
+SessionEvents *sessionEvents = new SessionEvents();
+
+// Resampler cost counters and quality governor for the current stream.
+struct ResampleStats {
+	UINT64 calls;
+	LONGLONG ticks;
+	double audioSeconds;
+	LONGLONG since;
+	ResamplerGovernor governor;
+};
+
+static void ResampleStatsReset(ResampleStats &stats) {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	stats.calls = 0;
+	stats.ticks = 0;
+	stats.audioSeconds = 0;
+	stats.since = now.QuadPart;
+}
+
+// Logs and restarts the counters once every RESAMPLE_STATS_SECONDS. The counters also cover the
+// in-process converter, which has no batching or quality to report.
+static void ResampleStatsReport(ResampleStats &stats, DWORD batchFrames, bool resampler) {
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	double seconds = (double)(now.QuadPart - stats.since) / frequency.QuadPart;
+	if (seconds < RESAMPLE_STATS_SECONDS)
+		return;
+	if (stats.audioSeconds > 0 && resampler)
+		LOG(L"Resampler: %.1f calls/s, %.3f ms CPU per second of audio, batch %u frames, quality %d",
+			stats.calls / seconds, stats.ticks * 1000.0 / frequency.QuadPart / stats.audioSeconds, batchFrames,
+			stats.governor.GetHalfFilterLength());
+	else if (stats.audioSeconds > 0)
+		LOG(L"In-process converter: %.1f calls/s, %.3f ms CPU per second of audio",
+			stats.calls / seconds, stats.ticks * 1000.0 / frequency.QuadPart / stats.audioSeconds);
+	ResampleStatsReset(stats);
+}
+
+// Resamples one buffer of captured frames and appends the result to the backlog, marked with
+// the capture time of the first frame unless it is 0. The output stays in the resampler's own
+// buffer, so nothing is allocated per call.
+static HRESULT ResampleToBacklog(WWMFResampler &resampler, const BYTE *data, DWORD bytes, LONGLONG captured,
+	const WAVEFORMATEX *pwfx, Backlog &backlog, ResampleStats &stats) {
+	const BYTE *output = NULL;
+	DWORD outputBytes = 0;
+	LARGE_INTEGER start, end;
+	HRESULT hr;
+
+	QueryPerformanceCounter(&start);
+	{
+		TRACE_SPAN("Resample");
+		hr = resampler.ResamplePooled(data, bytes, &output, &outputBytes);
+	}
+	QueryPerformanceCounter(&end);
+	stats.calls++;
+	stats.ticks += end.QuadPart - start.QuadPart;
+	stats.audioSeconds += (double)bytes / pwfx->nAvgBytesPerSec;
+	stats.governor.Record(end.QuadPart - start.QuadPart, (double)bytes / pwfx->nAvgBytesPerSec);
+
+	if (SUCCEEDED(hr)) {
+		TRACE_SPAN("Backlog");
+		if (captured)
+			backlog.Mark(captured);
+		const float *samples = (const float*)output;
+		for (DWORD i = 0; i < outputBytes / sizeof(float); i+=2)
+			backlog.Push(samples[i], samples[i + 1]);
+	}
+	return hr;
+}
+
+static HRESULT FlushBatch(WWMFResampler &resampler, PacketBatcher &batcher, const WAVEFORMATEX *pwfx,
+	Backlog &backlog, ResampleStats &stats) {
+	HRESULT hr = ResampleToBacklog(resampler, batcher.Data(), batcher.Bytes(), batcher.Captured(), pwfx, backlog, stats);
+	batcher.Clear();
+	return hr;
+}
+
+// Render time of the visualizer, logged once every FRAME_STATS_SECONDS so backends can be compared,
+// together with the analyzer's cost per window. The worst interval between frames shows any stall
+// of the render thread, such as one caused by UI work.
+struct FrameStats {
+	LONGLONG ticks;
+	LONGLONG maxTicks;
+	LONGLONG lastEnd;
+	LONGLONG maxIntervalTicks;
+	UINT frames;
+	LONGLONG analysisTicks;
+	UINT windows;
+	// Time spent in Visualizer::AddWindow(), to compare in-process hosting with /vishost.
+	LONGLONG handoffTicks;
+	UINT handoffs;
+	LONGLONG since;
+};
+FrameStats frameStats;
+
+static void FrameStatsRecord(FrameStats &stats, LONGLONG start, LONGLONG end) {
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	if (!stats.since)
+		stats.since = start;
+	stats.ticks += end - start;
+	if (end - start > stats.maxTicks)
+		stats.maxTicks = end - start;
+	if (stats.lastEnd && end - stats.lastEnd > stats.maxIntervalTicks)
+		stats.maxIntervalTicks = end - stats.lastEnd;
+	stats.lastEnd = end;
+	stats.frames++;
+	if (end - stats.since < FRAME_STATS_SECONDS * frequency.QuadPart)
+		return;
+	LOG(L"Visualizer %s: %.1f fps, render %.2f ms average, %.2f ms worst, %.2f ms worst interval", visualizer->Name(),
+		stats.frames * (double)frequency.QuadPart / (end - stats.since),
+		stats.ticks * 1000.0 / frequency.QuadPart / stats.frames, stats.maxTicks * 1000.0 / frequency.QuadPart,
+		stats.maxIntervalTicks * 1000.0 / frequency.QuadPart);
+	if (stats.handoffs)
+		LOG(L"Window hand-off to %s: %.2f us average", visualizer->Name(),
+			stats.handoffTicks * 1000000.0 / frequency.QuadPart / stats.handoffs);
+	if (stats.windows)
+		LOG(L"Analyzer: %.1f us per window, tempo %.1f bpm (confidence %.2f)",
+			stats.analysisTicks * 1000000.0 / frequency.QuadPart / stats.windows, analysis.tempo, analysis.tempoConfidence);
+	AllocProfileReport();
+	stats.ticks = 0;
+	stats.maxTicks = 0;
+	stats.maxIntervalTicks = 0;
+	stats.frames = 0;
+	stats.analysisTicks = 0;
+	stats.windows = 0;
+	stats.handoffTicks = 0;
+	stats.handoffs = 0;
+	stats.since = end;
+}
+
+// Gives the visualizer the next window of the stream, timing the hand-off.
+static void HandOffWindow(const float *left, const float *right) {
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	visualizer->AddWindow(left, right, 576);
+	QueryPerformanceCounter(&end);
+	frameStats.handoffTicks += end.QuadPart - start.QuadPart;
+	frameStats.handoffs++;
+}
+
+// Called when rendering stops on purpose (pause, device change) so the gap is not counted as a stall.
+static void FrameStatsBreak(FrameStats &stats) {
+	stats.lastEnd = 0;
+}
+
+// Analyzes the current window and publishes it, with the analysis, to the shared ring, stamped
+// with its capture time. start is when the window was taken, for the analysis cost.
+static void AnalyzeAndPublish(LONGLONG start, LONGLONG captured) {
+	LARGE_INTEGER analysisEnd;
+	{
+		TRACE_SPAN("Analyze");
+		analyzer.Analyze(windowLeft, windowRight, 576, &analysis);
+	}
+	QueryPerformanceCounter(&analysisEnd);
+	frameStats.analysisTicks += analysisEnd.QuadPart - start;
+	frameStats.windows++;
+
+	SharedWaveformAnalysis shared;
+	shared.bass = analysis.bass;
+	shared.mid = analysis.mid;
+	shared.treble = analysis.treble;
+	shared.bassAtt = analysis.bassAtt;
+	shared.midAtt = analysis.midAtt;
+	shared.trebleAtt = analysis.trebleAtt;
+	shared.flux = analysis.flux;
+	shared.tempo = analysis.tempo;
+	shared.tempoConfidence = analysis.tempoConfidence;
+	shared.reserved = 0;
+	QuantizeWaveform(windowLeft, windowRight, 576, chunk);
+	sharedWaveform.Publish(chunk, analysis.spectrum[0], &shared, analysis.onset ? SHARED_WAVEFORM_ONSET : 0, captured);
+}
+
+#define AUTOCONVERT_UNTRIED 0
+#define AUTOCONVERT_WORKS 1
+#define AUTOCONVERT_FAILS 2
+// Calibration result not taken yet. A strategy is only timed once it is about to be used or
+// compared, so an endpoint that accepts autoconvert opens without calibrating.
+#define CONVERT_UNMEASURED -2.0f
+
+// One endpoint's calibration, valid while its mix format stays the same.
+struct ConversionCache {
+	// wFormatTag, or the first field of the subformat GUID for WAVE_FORMAT_EXTENSIBLE.
+	DWORD formatTag;
+	DWORD channels;
+	DWORD sampleRate;
+	DWORD bits;
+	DWORD autoconvert;
+	// CPU per second of audio, -1 where the strategy is unavailable, or CONVERT_UNMEASURED.
+	float resamplerMs;
+	float inProcessMs;
+};
+
+static const wchar_t *ConversionName(int conversion) {
+	switch (conversion) {
+	case CONVERT_RESAMPLER:
+		return L"resampler";
+	case CONVERT_AUTOCONVERT:
+		return L"autoconvert";
+	case CONVERT_INPROCESS:
+		return L"in-process";
+	default:
+		return L"none";
+	}
+}
+
+static void ConversionFormat(const WAVEFORMATEX *pwfx, ConversionCache *cache) {
+	cache->formatTag = pwfx->wFormatTag;
+	if (pwfx->wFormatTag == WAVE_FORMAT_EXTENSIBLE)
+		cache->formatTag = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(pwfx)->SubFormat.Data1;
+	cache->channels = pwfx->nChannels;
+	cache->sampleRate = pwfx->nSamplesPerSec;
+	cache->bits = pwfx->wBitsPerSample;
+}
+
+static bool ConversionLoad(const wchar_t *id, const WAVEFORMATEX *pwfx, ConversionCache *cache) {
+	HKEY key;
+	DWORD size = sizeof(*cache);
+	DWORD type = 0;
+	ConversionCache format;
+	if (RegOpenKeyExW(HKEY_CURRENT_USER, CONVERT_KEY, 0, KEY_QUERY_VALUE, &key) != ERROR_SUCCESS)
+		return false;
+	LONG result = RegQueryValueExW(key, id, NULL, &type, (BYTE*)cache, &size);
+	RegCloseKey(key);
+	if (result != ERROR_SUCCESS || type != REG_BINARY || size != sizeof(*cache))
+		return false;
+	ConversionFormat(pwfx, &format);
+	return cache->formatTag == format.formatTag && cache->channels == format.channels &&
+		cache->sampleRate == format.sampleRate && cache->bits == format.bits;
+}
+
+static void ConversionSave(const wchar_t *id, const ConversionCache &cache) {
+	HKEY key;
+	if (RegCreateKeyExW(HKEY_CURRENT_USER, CONVERT_KEY, 0, NULL, 0, KEY_SET_VALUE, NULL, &key, NULL) != ERROR_SUCCESS)
+		return;
+	RegSetValueExW(key, id, 0, REG_BINARY, (const BYTE*)&cache, sizeof(cache));
+	RegCloseKey(key);
+}
+
+// CONVERT_CALIBRATION_MS of a 1 kHz tone in the mix format, for timing the in-process strategies.
+static BYTE *CalibrationSignal(const WAVEFORMATEX *pwfx, DWORD *frames_return) {
+	DWORD frames = pwfx->nSamplesPerSec * CONVERT_CALIBRATION_MS / 1000;
+	BYTE *data = new (std::nothrow) BYTE[frames * pwfx->nBlockAlign];
+	if (!data)
+		return NULL;
+	bool isFloat = pwfx->wFormatTag == WAVE_FORMAT_IEEE_FLOAT || (pwfx->wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+		IsEqualGUID(KSDATAFORMAT_SUBTYPE_IEEE_FLOAT, reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(pwfx)->SubFormat));
+	int sampleBytes = pwfx->wBitsPerSample / 8;
+	for (DWORD i = 0; i < frames; i++) {
+		double value = 0.5 * sin(2 * 3.14159265358979 * 1000 * i / pwfx->nSamplesPerSec);
+		for (int c = 0; c < pwfx->nChannels; c++) {
+			BYTE *sample = data + i * pwfx->nBlockAlign + c * sampleBytes;
+			if (isFloat && sampleBytes == 4) {
+				*(float*)sample = (float)value;
+			} else {
+				int scaled = (int)(value * 2147483647.0);
+				// Little-endian: the top sampleBytes bytes of the 32-bit value.
+				for (int b = 0; b < sampleBytes; b++)
+					sample[b] = (BYTE)(scaled >> (8 * (4 - sampleBytes + b)));
+			}
+		}
+	}
+	*frames_return = frames;
+	return data;
+}
+
+// Milliseconds of CPU per second of audio for the Media Foundation resampler, or -1.
+static double CalibrateResampler(const WAVEFORMATEX *pwfx, const WWMFPcmFormat &inputFormat, const WWMFPcmFormat &outputFormat) {
+	WWMFResampler resampler;
+	DWORD frames = 0;
+	BYTE *data = CalibrationSignal(pwfx, &frames);
+	double cost = -1;
+	if (data && SUCCEEDED(resampler.Initialize(inputFormat, outputFormat, RESAMPLE_QUALITY))) {
+		DWORD packetFrames = pwfx->nSamplesPerSec * CONVERT_CALIBRATION_PACKET_MS / 1000;
+		LARGE_INTEGER start, end, frequency;
+		HRESULT hr = S_OK;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&start);
+		for (DWORD i = 0; i + packetFrames <= frames && SUCCEEDED(hr); i += packetFrames) {
+			WWMFSampleData sampleData;
+			hr = resampler.Resample(data + i * pwfx->nBlockAlign, packetFrames * pwfx->nBlockAlign, &sampleData);
+			sampleData.Release();
+		}
+		QueryPerformanceCounter(&end);
+		if (SUCCEEDED(hr))
+			cost = (end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart / (CONVERT_CALIBRATION_MS / 1000.0);
+	}
+	resampler.Finalize();
+	delete[] data;
+	return cost;
+}
+
+// Milliseconds of CPU per second of audio for FormatConverter, or -1.
+static double CalibrateInProcess(const WAVEFORMATEX *pwfx) {
+	FormatConverter converter;
+	if (FAILED(converter.Reset(pwfx, 44100)))
+		return -1;
+	DWORD frames = 0;
+	BYTE *data = CalibrationSignal(pwfx, &frames);
+	if (!data)
+		return -1;
+	Backlog backlog;
+	// Room for one packet's output at any input rate the converter accepts.
+	if (FAILED(backlog.Reset(44100 * CONVERT_CALIBRATION_PACKET_MS / 1000 * 2))) {
+		delete[] data;
+		return -1;
+	}
+	DWORD packetFrames = pwfx->nSamplesPerSec * CONVERT_CALIBRATION_PACKET_MS / 1000;
+	LARGE_INTEGER start, end, frequency;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	for (DWORD i = 0; i + packetFrames <= frames; i += packetFrames) {
+		converter.Convert(data + i * pwfx->nBlockAlign, packetFrames, backlog);
+		// The pipeline consumes the backlog as it goes.
+		backlog.Clear();
+	}
+	QueryPerformanceCounter(&end);
+	delete[] data;
+	return (end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart / (CONVERT_CALIBRATION_MS / 1000.0);
+}
+
+// Times conversion on milkbottle's own thread unless the cache already holds its cost.
+static void ConversionMeasure(int conversion, const WAVEFORMATEX *pwfx, const WWMFPcmFormat &inputFormat,
+	const WWMFPcmFormat &outputFormat, ConversionCache *cache) {
+	if (conversion == CONVERT_RESAMPLER && cache->resamplerMs == CONVERT_UNMEASURED) {
+		cache->resamplerMs = (float)CalibrateResampler(pwfx, inputFormat, outputFormat);
+		LOG(L"Calibrated the resampler from %u Hz, %u channels, %u bits: %.3f ms CPU per second of audio",
+			pwfx->nSamplesPerSec, pwfx->nChannels, pwfx->wBitsPerSample, cache->resamplerMs);
+	} else if (conversion == CONVERT_INPROCESS && cache->inProcessMs == CONVERT_UNMEASURED) {
+		cache->inProcessMs = (float)CalibrateInProcess(pwfx);
+		LOG(L"Calibrated in-process conversion from %u Hz, %u channels, %u bits: %.3f ms CPU per second of audio",
+			pwfx->nSamplesPerSec, pwfx->nChannels, pwfx->wBitsPerSample, cache->inProcessMs);
+	}
+}
+
+// The cheaper of the two strategies that run on milkbottle's own thread, timing both if need be.
+static int CheaperConversion(const WAVEFORMATEX *pwfx, const WWMFPcmFormat &inputFormat,
+	const WWMFPcmFormat &outputFormat, ConversionCache *cache) {
+	ConversionMeasure(CONVERT_RESAMPLER, pwfx, inputFormat, outputFormat, cache);
+	ConversionMeasure(CONVERT_INPROCESS, pwfx, inputFormat, outputFormat, cache);
+	if (cache->inProcessMs >= 0 && (cache->resamplerMs < 0 || cache->inProcessMs < cache->resamplerMs))
+		return CONVERT_INPROCESS;
+	return CONVERT_RESAMPLER;
+}
+
+// Picks a conversion for an endpoint whose mix format is not the pipeline format. Only the
+// strategies the choice depends on are calibrated, and only if the cache has no cost for them.
+static int ChooseConversion(const wchar_t *id, const WAVEFORMATEX *pwfx, const WWMFPcmFormat &inputFormat,
+	const WWMFPcmFormat &outputFormat, ConversionCache *cache) {
+	if (!ConversionLoad(id, pwfx, cache)) {
+		ConversionFormat(pwfx, cache);
+		cache->autoconvert = AUTOCONVERT_UNTRIED;
+		cache->resamplerMs = CONVERT_UNMEASURED;
+		cache->inProcessMs = CONVERT_UNMEASURED;
+	}
+	if (forcedConversion == CONVERT_INPROCESS) {
+		ConversionMeasure(CONVERT_INPROCESS, pwfx, inputFormat, outputFormat, cache);
+		if (cache->inProcessMs < 0)
+			return CONVERT_RESAMPLER;
+	}
+	if (forcedConversion != CONVERT_NONE)
+		return forcedConversion;
+	// The audio engine converts on its own thread, at no cost to milkbottle's, so it wins
+	// wherever the endpoint accepts it.
+	if (cache->autoconvert != AUTOCONVERT_FAILS)
+		return CONVERT_AUTOCONVERT;
+	return CheaperConversion(pwfx, inputFormat, outputFormat, cache);
+}
+
+// One open capture endpoint and everything between it and the window backlog. audioLoop keeps
+// a current stream and, while switching devices, opens the next one beside it.
+class CaptureStream {
+public:
+	CaptureStream(void);
+	~CaptureStream(void);
+
+	/// Opens deviceId, or the default endpoint when it is NULL, and starts capturing.
+	/// Any thread in the multithreaded apartment may call this.
+	HRESULT Open(IMMDeviceEnumerator *enumerator, const wchar_t *deviceId, bool loopback);
+
+	/// Moves every available packet into the backlog.
+	HRESULT Read(LONGLONG now);
+
+	/// Discards every available packet, so a paused stream does not fall behind.
+	HRESULT Drain(void);
+
+	/// Drops the backlog and restarts drift tracking.
+	void Restart(void);
+
+	/// Takes the next 576-sample window if one is due at QPC time now and the backlog holds it.
+	/// Windows fall due every 576 samples of audio time, so a frame may take none or several.
+	/// @param captured_return QPC time the endpoint captured the window's first sample, or now
+	/// if the endpoint reported no capture times
+	bool TakeWindow(float *left, float *right, LONGLONG now, LONGLONG *captured_return);
+
+	void Close(void);
+
+	const wchar_t *Name(void) const {
+		return name;
+	}
+
+	const wchar_t *Id(void) const {
+		return id;
+	}
+
+	/// Time from capture to the speakers: for loopback, the stream latency plus one device
+	/// period; 0 for capture endpoints.
+	double LatencyMs(void) const {
+		return latencyMs;
+	}
+
+	/// True if the last failure means the endpoint is unusable rather than gone.
+	bool NoAudio(void) const {
+		return noAudio;
+	}
+
+private:
+	IMMDevice *device;
+	IAudioSessionManager2 *manager;
+	SessionNotification *notification;
+	IAudioClient *audioClient;
+	IAudioCaptureClient *captureClient;
+	WAVEFORMATEX *pwfx;
+	WWMFResampler resampler;
+	FormatConverter converter;
+	int conversion;
+	bool useResampler;
+	bool started;
+	bool noAudio;
+	UINT32 passes;
+	UINT32 frames;
+	Backlog backlog;
+	DriftCompensator drift;
+	PacketBatcher batcher;
+	ResampleStats resampleStats;
+	LONGLONG frequency;
+	double latencyMs;
+	wchar_t name[256];
+	wchar_t id[256];
+};
+
+CaptureStream::CaptureStream(void) : device(NULL), manager(NULL), notification(NULL), audioClient(NULL), captureClient(NULL),
+	pwfx(NULL), conversion(CONVERT_NONE), useResampler(false), started(false), noAudio(false), passes(0), frames(0), latencyMs(0) {
+	LARGE_INTEGER qpcFrequency;
+	QueryPerformanceFrequency(&qpcFrequency);
+	frequency = qpcFrequency.QuadPart;
+	name[0] = L'\0';
+	id[0] = L'\0';
+}
+
+CaptureStream::~CaptureStream(void) {
+	Close();
+}
+
+HRESULT CaptureStream::Open(IMMDeviceEnumerator *enumerator, const wchar_t *deviceId, bool loopback) {
+	HRESULT hr = S_OK;
+	CComPtr<IAudioSessionEnumerator> sessions = NULL;
+	CComPtr<IAudioSessionControl> control;
+	IPropertyStore *pPropertyStore = NULL;
+	PROPVARIANT pv;
+	PropVariantInit(&pv);
+	LPWSTR pwszID = NULL;
+	REFERENCE_TIME streamLatency = 0;
+	REFERENCE_TIME defaultPeriod = 0;
+	ConversionCache cache;
+	WAVEFORMATEX pipelineFormat;
+	WWMFPcmFormat inputFormat;
+	WWMFPcmFormat outputFormat;
+	int sessionCount = 0;
+	LARGE_INTEGER openStart, openEnd, qpcFrequency;
+	QueryPerformanceFrequency(&qpcFrequency);
+	QueryPerformanceCounter(&openStart);
+	noAudio = true;
+
+	if (deviceId)
+		hr = enumerator->GetDevice(deviceId, &device);
+	else
+		hr = enumerator->GetDefaultAudioEndpoint(loopback ? eRender : eCapture, eConsole, &device);
+
+	if (FAILED(hr)) {
+		ERR(L"IMMDeviceEnumerator::%s failed: hr = 0x%08x", deviceId ? L"GetDevice" : L"GetDefaultAudioEndpoint", hr);
+		goto cleanup;
+	}
+
+	if (S_FALSE == hr) {
+		hr = E_FAIL;
+		goto cleanup;
+	}
+
+	hr = device->GetId(&pwszID);
+	if (FAILED(hr)) {
+		ERR(L"IMMDevice::GetId failed: hr = 0x%08x", hr);
+		goto cleanup;
+	}
+	wcsncpy_s(id, _countof(id), pwszID, _TRUNCATE);
+
+	notification = new SessionNotification(sessionEvents);
+	hr = device->Activate(__uuidof(IAudioSessionManager2), CLSCTX_ALL, nullptr, reinterpret_cast<void**>(&manager));
+	if (FAILED(hr)) {
+		ERR(L"IMMDevice::Activate(IAudioSessionManager2) failed: hr = 0x%08x", hr);
+		manager = NULL;
+	} else {
+		manager->RegisterSessionNotification(notification);
+		hr = manager->GetSessionEnumerator(&sessions);
+		if (FAILED(hr)) {
+			ERR(L"IAudioSessionManager2::GetSessionEnumerator failed: hr = 0x%08x", hr);
+		} else {
+			sessions->GetCount(&sessionCount);
+			for(int s = 0; s < sessionCount; s++) {
+				if (SUCCEEDED(sessions->GetSession(s, &control)))
+					notification->Track(control);
+				SafeRelease(&control);
+			}
+		}
+		SafeRelease(&sessions);
+	}
+
+	hr = device->OpenPropertyStore(STGM_READ, &pPropertyStore);
+	if (FAILED(hr)) {
+		ERR(L"IMMDevice::OpenPropertyStore failed: hr = 0x%08x", hr);
+		goto cleanup;
+	}
+
+	hr = pPropertyStore->GetValue(PKEY_Device_FriendlyName, &pv);
+	if (FAILED(hr)) {
+		ERR(L"IPropertyStore::GetValue failed: hr = 0x%08x", hr);
+		goto cleanup;
+	}
+
+	if (VT_LPWSTR != pv.vt) {
+		ERR(L"PKEY_Device_FriendlyName variant type is %u - expected VT_LPWSTR", pv.vt);
+		hr = E_UNEXPECTED;
+		goto cleanup;
+	}
+
+	wcsncpy_s(name, _countof(name), pv.pwszVal, _TRUNCATE);
+
+	hr = device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&audioClient);
+	if (FAILED(hr)) {
+		ERR(L"IMMDevice::Activate(IAudioClient) failed: hr = 0x%08x", hr);
+		goto cleanup;
+	}
+
+	hr = audioClient->GetMixFormat(&pwfx);
+	if (FAILED(hr)) {
+		ERR(L"IAudioClient::GetMixFormat failed: hr = 0x%08x", hr);
+		goto cleanup;
+	}
+
+	inputFormat.sampleFormat = WWMFBitFormatFloat;
+	inputFormat.nChannels = pwfx->nChannels;
+	inputFormat.sampleRate = pwfx->nSamplesPerSec;
+	inputFormat.bits = pwfx->wBitsPerSample;
+
+	// The pipeline carries float stereo at 44.1 kHz; each visualizer backend narrows it if it must.
+	outputFormat.sampleFormat = WWMFBitFormatFloat;
+	outputFormat.nChannels = 2;
+	outputFormat.sampleRate = 44100;
+	outputFormat.bits = 32;
+	outputFormat.validBitsPerSample = 32;
+	outputFormat.dwChannelMask = 3;
+
+	pipelineFormat.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+	pipelineFormat.nChannels = 2;
+	pipelineFormat.nSamplesPerSec = 44100;
+	pipelineFormat.wBitsPerSample = 32;
+	pipelineFormat.nBlockAlign = 8;
+	pipelineFormat.nAvgBytesPerSec = 44100 * 8;
+	pipelineFormat.cbSize = 0;
+
+	conversion = CONVERT_RESAMPLER;
+
+	if (pwfx->wFormatTag == WAVE_FORMAT_IEEE_FLOAT && pwfx->nChannels == 2 && pwfx->nSamplesPerSec == 44100 && pwfx->wBitsPerSample == 32) {
+		conversion = CONVERT_NONE;
+	} else if (pwfx->wFormatTag == WAVE_FORMAT_EXTENSIBLE) {
+		PWAVEFORMATEXTENSIBLE pEx = reinterpret_cast<PWAVEFORMATEXTENSIBLE>(pwfx);
+		inputFormat.validBitsPerSample = pEx->Samples.wValidBitsPerSample;
+		inputFormat.dwChannelMask = pEx->dwChannelMask;
+		if (IsEqualGUID(KSDATAFORMAT_SUBTYPE_IEEE_FLOAT, pEx->SubFormat) && pwfx->nChannels == 2 && pwfx->nSamplesPerSec == 44100 && pwfx->wBitsPerSample == 32) {
+			conversion = CONVERT_NONE;
+		}
+	}
+
+	if (conversion != CONVERT_NONE)
+		conversion = ChooseConversion(id, pwfx, inputFormat, outputFormat, &cache);
+
+	if (conversion == CONVERT_AUTOCONVERT) {
+		hr = audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, (loopback ? AUDCLNT_STREAMFLAGS_LOOPBACK : 0) |
+			AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY, 0, 0, &pipelineFormat, 0);
+		if (SUCCEEDED(hr)) {
+			cache.autoconvert = AUTOCONVERT_WORKS;
+			// From here on packets arrive in the pipeline format.
+			CoTaskMemFree(pwfx);
+			pwfx = (WAVEFORMATEX*)CoTaskMemAlloc(sizeof(WAVEFORMATEX));
+			if (!pwfx) {
+				hr = E_OUTOFMEMORY;
+				goto cleanup;
+			}
+			*pwfx = pipelineFormat;
+		} else {
+			ERR(L"IAudioClient::Initialize with AUTOCONVERTPCM failed: hr = 0x%08x", hr);
+			// Only a format error says the endpoint refuses to convert. Anything else, such as
+			// a capture endpoint turning down loopback, is no reason to stop trying it.
+			if (hr == AUDCLNT_E_UNSUPPORTED_FORMAT || hr == E_INVALIDARG)
+				cache.autoconvert = AUTOCONVERT_FAILS;
+			conversion = forcedConversion == CONVERT_AUTOCONVERT ? CONVERT_RESAMPLER : CheaperConversion(pwfx, inputFormat, outputFormat, &cache);
+			// A client whose Initialize failed cannot be initialized again.
+			SafeRelease(&audioClient);
+			hr = device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&audioClient);
+			if (FAILED(hr)) {
+				ERR(L"IMMDevice::Activate(IAudioClient) failed: hr = 0x%08x", hr);
+				goto cleanup;
+			}
+		}
+	}
+	// The cost logged is that of the path in use; the periodic resampler line follows it while streaming.
+	if (conversion == CONVERT_AUTOCONVERT) {
+		LOG(L"Conversion for %s: autoconvert, on the audio engine's thread at no CPU cost to milkbottle's", name);
+	} else if (conversion != CONVERT_NONE) {
+		ConversionMeasure(conversion, pwfx, inputFormat, outputFormat, &cache);
+		LOG(L"Conversion for %s: %s at %.3f ms CPU per second of audio (autoconvert %s)",
+			name, ConversionName(conversion), conversion == CONVERT_RESAMPLER ? cache.resamplerMs : cache.inProcessMs,
+			cache.autoconvert == AUTOCONVERT_FAILS ? L"refused" :
+			forcedConversion == CONVERT_NONE || forcedConversion == CONVERT_AUTOCONVERT ? L"failed" : L"not chosen");
+	}
+
+	useResampler = conversion == CONVERT_RESAMPLER;
+	if (useResampler) {
+		hr = resampler.Initialize(inputFormat, outputFormat, RESAMPLE_QUALITY);
+		if (FAILED(hr)) {
+			ERR(L"WWMFResampler::Initialize failed: hr = 0x%08x", hr);
+			goto cleanup;
+		}
+	} else if (conversion == CONVERT_INPROCESS) {
+		hr = converter.Reset(pwfx, 44100);
+		if (FAILED(hr)) {
+			ERR(L"FormatConverter::Reset failed: hr = 0x%08x", hr);
+			goto cleanup;
+		}
+	}
+
+	if (conversion != CONVERT_AUTOCONVERT) {
+		hr = audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, loopback ? AUDCLNT_STREAMFLAGS_LOOPBACK : 0, 0, 0, pwfx, 0);
+		if (FAILED(hr)) {
+			ERR(L"IAudioClient::Initialize failed: hr = 0x%08x", hr);
+			goto cleanup;
+		}
+	}
+
+	// Loopback sees samples as they enter the engine; they reach the speakers a stream
+	// latency and a device period later.
+	latencyMs = 0;
+	if (loopback && SUCCEEDED(audioClient->GetStreamLatency(&streamLatency)) && SUCCEEDED(audioClient->GetDevicePeriod(&defaultPeriod, NULL)))
+		latencyMs = (streamLatency + defaultPeriod) / 10000.0;
+
+	hr = audioClient->GetService(__uuidof(IAudioCaptureClient), (void**)&captureClient);
+	if (FAILED(hr)) {
+		ERR(L"IAudioClient::GetService(IAudioCaptureClient) failed: hr = 0x%08x", hr);
+		goto cleanup;
+	}
+
+	hr = audioClient->Start();
+	if (FAILED(hr)) {
+		ERR(L"IAudioClient::Start failed: hr = 0x%08x", hr);
+		goto cleanup;
+	}
+	started = true;
+
+	drift.Reset(DRIFT_TARGET_SAMPLES, DRIFT_MAX_PPM, 44100);
+	hr = backlog.Reset(DRIFT_MAX_SAMPLES + 44100 * (resampleBatchMs + BACKLOG_HEADROOM_MS) / 1000);
+	if (FAILED(hr)) {
+		ERR(L"Backlog::Reset failed: hr = 0x%08x", hr);
+		goto cleanup;
+	}
+	ResampleStatsReset(resampleStats);
+	resampleStats.governor.Reset(resampleBudgetMs, RESAMPLE_QUALITY);
+	if (useResampler) {
+		hr = batcher.Reset(pwfx->nBlockAlign, pwfx->nSamplesPerSec, pwfx->nSamplesPerSec * resampleBatchMs / 1000, resampleBatchDeadlineMs);
+		if (FAILED(hr)) {
+			ERR(L"PacketBatcher::Reset failed: hr = 0x%08x", hr);
+			goto cleanup;
+		}
+	}
+
+	// Cached only once the stream works, so a failed open never records its guesses.
+	if (conversion != CONVERT_NONE)
+		ConversionSave(id, cache);
+
+	noAudio = false;
+	QueryPerformanceCounter(&openEnd);
+	TraceRecord("OpenDevice", openStart.QuadPart, openEnd.QuadPart);
+	LOG(L"Opened %s in %.1f ms", name, (openEnd.QuadPart - openStart.QuadPart) * 1000.0 / qpcFrequency.QuadPart);
+
+cleanup:
+	PropVariantClear(&pv);
+	SafeRelease(&pPropertyStore);
+	if (pwszID)
+		CoTaskMemFree(pwszID);
+	if (FAILED(hr))
+		Close();
+	return hr;
+}
+
+HRESULT CaptureStream::Read(LONGLONG now) {
+	HRESULT hr;
+	UINT32 nNextPacketSize = 0;
+	BYTE *pData = NULL;
+	UINT32 nNumFramesToRead = 0;
+	DWORD dwFlags = 0;
+	UINT64 qpcPosition = 0;
+
+	passes++;
+	hr = captureClient->GetNextPacketSize(&nNextPacketSize);
+	while (SUCCEEDED(hr) && nNextPacketSize > 0 && backlog.Size() < DRIFT_MAX_SAMPLES) {
+		{
+			TRACE_SPAN("GetBuffer");
+			hr = captureClient->GetBuffer(&pData, &nNumFramesToRead, &dwFlags, NULL, &qpcPosition);
+		}
+		if (FAILED(hr)) {
+			ERR(L"IAudioCaptureClient::GetBuffer failed on pass %u after %u frames: hr = 0x%08x", passes, frames, hr);
+			return hr;
+		}
+
+		AllocProfilePacket();
+		frames += nNumFramesToRead;
+		// GetBuffer reports the capture time of the packet's first frame in 100 ns units.
+		LONGLONG captured = 0;
+		if (!(dwFlags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR) && qpcPosition)
+			captured = (LONGLONG)(qpcPosition / 10000000 * frequency + qpcPosition % 10000000 * frequency / 10000000);
+
+		if (dwFlags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY) {
+			backlog.Clear();
+			batcher.Clear();
+			drift.Reset(DRIFT_TARGET_SAMPLES, DRIFT_MAX_PPM, 44100);
+		}
+
+		if (dwFlags & AUDCLNT_BUFFERFLAGS_SILENT) {
+			// Batched frames precede the silence, so they go into the backlog first.
+			if (!batcher.Empty())
+				hr = FlushBatch(resampler, batcher, pwfx, backlog, resampleStats);
+			if (captured)
+				backlog.Mark(captured);
+			for (UINT32 i = 0; i < (UINT64)nNumFramesToRead * 44100 / pwfx->nSamplesPerSec; i++)
+				backlog.Push(0.0f, 0.0f);
+		} else if (useResampler) {
+			bool batched = batcher.BatchFrames() > 0 && batcher.Append(pData, nNumFramesToRead, now, captured);
+			if (!batched && !batcher.Empty()) {
+				hr = FlushBatch(resampler, batcher, pwfx, backlog, resampleStats);
+				batched = SUCCEEDED(hr) && batcher.BatchFrames() > 0 && batcher.Append(pData, nNumFramesToRead, now, captured);
+			}
+			if (SUCCEEDED(hr) && !batched)
+				hr = ResampleToBacklog(resampler, pData, nNumFramesToRead * pwfx->nBlockAlign, captured, pwfx, backlog, resampleStats);
+		} else if (conversion == CONVERT_INPROCESS) {
+			TRACE_SPAN("Convert");
+			LARGE_INTEGER start, end;
+			QueryPerformanceCounter(&start);
+			if (captured)
+				backlog.Mark(captured);
+			converter.Convert(pData, nNumFramesToRead, backlog);
+			QueryPerformanceCounter(&end);
+			resampleStats.calls++;
+			resampleStats.ticks += end.QuadPart - start.QuadPart;
+			resampleStats.audioSeconds += (double)nNumFramesToRead / pwfx->nSamplesPerSec;
+		} else {
+			TRACE_SPAN("Backlog");
+			if (captured)
+				backlog.Mark(captured);
+			const float *samples = (const float*)pData;
+			for (UINT32 i = 0; i < nNumFramesToRead * 2; i+=2)
+				backlog.Push(samples[i], samples[i + 1]);
+		}
+
+		if (FAILED(hr)) {
+			ERR(L"WWMFResampler::Resample failed: hr = 0x%08x", hr);
+			noAudio = true;
+			return hr;
+		}
+
+		hr = captureClient->ReleaseBuffer(nNumFramesToRead);
+		if (FAILED(hr)) {
+			ERR(L"IAudioCaptureClient::ReleaseBuffer failed on pass %u after %u frames: hr = 0x%08x", passes, frames, hr);
+			return hr;
+		}
+
+		hr = captureClient->GetNextPacketSize(&nNextPacketSize);
+	}
+
+	if (!SUCCEEDED(hr)) {
+		ERR(L"IAudioCaptureClient::GetNextPacketSize failed on pass %u after %u frames: hr = 0x%08x", passes, frames, hr);
+		return hr;
+	}
+	// Flush early rather than leave the visualizer without a window.
+	if (batcher.Due(now) || (!batcher.Empty() && backlog.Size() < drift.Needed(576))) {
+		hr = FlushBatch(resampler, batcher, pwfx, backlog, resampleStats);
+		if (FAILED(hr)) {
+			ERR(L"WWMFResampler::Resample failed: hr = 0x%08x", hr);
+			noAudio = true;
+			return hr;
+		}
+	}
+	if (conversion == CONVERT_INPROCESS)
+		ResampleStatsReport(resampleStats, 0, false);
+	if (useResampler) {
+		ResampleStatsReport(resampleStats, batcher.BatchFrames(), true);
+		int quality = resampleStats.governor.Evaluate(now);
+		if (resampleStats.governor.MeasuredAfterChange())
+			LOG(L"Resampler quality %d measured at %.3f ms CPU per second of audio (%.3f ms at quality %d)",
+				resampleStats.governor.GetHalfFilterLength(), resampleStats.governor.GetCostMs(),
+				resampleStats.governor.GetPreviousCostMs(), resampleStats.governor.GetPreviousHalfFilterLength());
+		if (quality) {
+			// Replaces the transform; the backlog bridges the few frames lost in the old filter.
+			hr = resampler.SetHalfFilterLength(quality);
+			if (SUCCEEDED(hr)) {
+				LOG(L"Resampler quality %d -> %d at %.3f ms CPU per second of audio (budget %d ms)",
+					resampleStats.governor.GetHalfFilterLength(), quality, resampleStats.governor.GetCostMs(), resampleBudgetMs);
+				resampleStats.governor.Applied(quality);
+			} else {
+				ERR(L"WWMFResampler::SetHalfFilterLength(%d) failed: hr = 0x%08x", quality, hr);
+				resampleStats.governor.Disable();
+			}
+		}
+	}
+	return S_OK;
+}
+
+HRESULT CaptureStream::Drain(void) {
+	UINT32 nNextPacketSize = 0;
+	BYTE *pData = NULL;
+	UINT32 nNumFramesToRead = 0;
+	DWORD dwFlags = 0;
+
+	HRESULT hr = captureClient->GetNextPacketSize(&nNextPacketSize);
+	while (SUCCEEDED(hr) && nNextPacketSize > 0) {
+		hr = captureClient->GetBuffer(&pData, &nNumFramesToRead, &dwFlags, NULL, NULL);
+		if (SUCCEEDED(hr))
+			hr = captureClient->ReleaseBuffer(nNumFramesToRead);
+		if (SUCCEEDED(hr))
+			hr = captureClient->GetNextPacketSize(&nNextPacketSize);
+	}
+	if (FAILED(hr))
+		ERR(L"Draining paused capture failed: hr = 0x%08x", hr);
+	return hr;
+}
+
+void CaptureStream::Restart(void) {
+	backlog.Clear();
+	batcher.Clear();
+	drift.Reset(DRIFT_TARGET_SAMPLES, DRIFT_MAX_PPM, 44100);
+}
+
+bool CaptureStream::TakeWindow(float *left, float *right, LONGLONG now, LONGLONG *captured_return) {
+	if (!drift.Due((double)now / frequency, (double)backlog.Size(), 576))
+		return false;
+	TRACE_SPAN("Window");
+	if (!backlog.CaptureTime(0, (double)frequency / 44100, captured_return))
+		*captured_return = now;
+	return drift.Take(backlog, left, right, 576);
+}
+
+void CaptureStream::Close(void) {
+	if (!device)
+		return;
+	LARGE_INTEGER closeStart, closeEnd;
+	QueryPerformanceCounter(&closeStart);
+	if (started)
+		audioClient->Stop();
+	started = false;
+	if (useResampler)
+		resampler.Finalize();
+	useResampler = false;
+	conversion = CONVERT_NONE;
+	SafeRelease(&captureClient);
+	if (pwfx)
+		CoTaskMemFree(pwfx);
+	pwfx = NULL;
+	SafeRelease(&audioClient);
+	if (manager)
+		manager->UnregisterSessionNotification(notification);
+	if (notification) {
+		LOG(L"Releasing %u audio session registrations", (UINT)notification->TrackedCount());
+		notification->UntrackAll();
+		SafeRelease(&notification);
+	}
+	SafeRelease(&manager);
+	SafeRelease(&device);
+	backlog.Clear();
+	QueryPerformanceCounter(&closeEnd);
+	TraceRecord("CloseDevice", closeStart.QuadPart, closeEnd.QuadPart);
+}
+
+// Device switch timing, from the request to the first window from the new endpoint, with the
+// longest gap between windows in that span. Logged for both switching paths so they can be compared.
+struct SwitchStats {
+	LONGLONG requested;
+	LONGLONG lastWindow;
+	LONGLONG maxGap;
+};
+SwitchStats switchStats;
+
+static void SwitchStatsRequest(SwitchStats &stats) {
+	if (stats.requested)
+		return;
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	stats.requested = now.QuadPart;
+	stats.lastWindow = now.QuadPart;
+	stats.maxGap = 0;
+}
+
+static void SwitchStatsWindow(SwitchStats &stats, LONGLONG qpc) {
+	if (stats.requested && qpc - stats.lastWindow > stats.maxGap)
+		stats.maxGap = qpc - stats.lastWindow;
+	stats.lastWindow = qpc;
+}
+
+// Called with the first window from the new endpoint.
+static void SwitchStatsDone(SwitchStats &stats, LONGLONG qpc, const wchar_t *how) {
+	if (!stats.requested)
+		return;
+	SwitchStatsWindow(stats, qpc);
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	LOG(L"Switched to %s (%s) %.1f ms after the request, longest gap between windows %.1f ms", audioDeviceName, how,
+		(qpc - stats.requested) * 1000.0 / frequency.QuadPart, stats.maxGap * 1000.0 / frequency.QuadPart);
+	stats.requested = 0;
+}
+
+// Streams handed to background threads to be closed, and switches abandoned while opening.
+// Stopping a client and unregistering its session notifications can block for a while on
+// some drivers, which must not stall the render thread at a cutover.
+static volatile LONG closingStreams;
+
+static DWORD WINAPI CloseStreamThread(LPVOID parameter) {
+	CaptureStream *stream = (CaptureStream*)parameter;
+	TraceSetThreadName("close");
+	HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	delete stream;
+	if (SUCCEEDED(hr))
+		CoUninitialize();
+	InterlockedDecrement(&closingStreams);
+	TraceThreadExit();
+	return 0;
+}
+
+// Closes and deletes stream on a thread of its own, or here if no thread can be started.
+static void CloseStreamAsync(CaptureStream *stream) {
+	InterlockedIncrement(&closingStreams);
+	HANDLE thread = CreateThread(NULL, 0, CloseStreamThread, stream, 0, NULL);
+	if (!thread) {
+		ERR(L"CreateThread failed: %u", GetLastError());
+		delete stream;
+		InterlockedDecrement(&closingStreams);
+		return;
+	}
+	CloseHandle(thread);
+}
+
+// Gives background closes a bounded time to finish before exit.
+static void WaitForClosingStreams(DWORD timeoutMs) {
+	DWORD start = GetTickCount();
+	while (closingStreams > 0 && GetTickCount() - start < timeoutMs)
+		Sleep(10);
+	if (closingStreams > 0)
+		ERR(L"%d capture streams still closing at exit", (int)closingStreams);
+}
+
+// State shared with the thread opening the next endpoint. It is freed by whichever side lets
+// go of it last, so a switch stuck in the driver can be abandoned without waiting for it.
+struct PendingOpen {
+	volatile LONG refs;
+	CaptureStream *stream;
+	IMMDeviceEnumerator *enumerator;
+	wchar_t deviceId[_countof(selectedDeviceId)];
+	bool useSelected;
+	HRESULT hr;
+};
+
+// A stream still attached when the last reference goes was abandoned; it is closed here.
+static void PendingOpenRelease(PendingOpen *open) {
+	if (InterlockedDecrement(&open->refs) != 0)
+		return;
+	if (open->stream) {
+		delete open->stream;
+		InterlockedDecrement(&closingStreams);
+	}
+	open->enumerator->Release();
+	delete open;
+}
+
+// The next endpoint of a gapless switch, opened on its own thread while the current one keeps
+// feeding windows. stream belongs to the opening thread until it has finished.
+struct PendingStream {
+	HANDLE thread;
+	CaptureStream *stream;
+	PendingOpen *open;
+	HRESULT hr;
+};
+
+static DWORD WINAPI OpenPendingStream(LPVOID parameter) {
+	PendingOpen *open = (PendingOpen*)parameter;
+	TraceSetThreadName("open");
+	HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	if (FAILED(hr)) {
+		ERR(L"CoInitialize failed on the device switch thread: hr = 0x%08x", hr);
+		open->hr = hr;
+		PendingOpenRelease(open);
+		TraceThreadExit();
+		return 1;
+	}
+	// Same preference as wWinMain: loopback of the render endpoint, else a capture endpoint.
+	hr = open->stream->Open(open->enumerator, open->useSelected ? open->deviceId : NULL, true);
+	if (FAILED(hr))
+		hr = open->stream->Open(open->enumerator, open->useSelected ? open->deviceId : NULL, false);
+	open->hr = hr;
+	PendingOpenRelease(open);
+	CoUninitialize();
+	TraceThreadExit();
+	return 0;
+}
+
+static bool PendingStreamStart(PendingStream &pending, IMMDeviceEnumerator *enumerator) {
+	PendingOpen *open = new PendingOpen;
+	open->refs = 2;
+	open->stream = new CaptureStream();
+	open->enumerator = enumerator;
+	enumerator->AddRef();
+	open->useSelected = GetSelectedDevice(open->deviceId, _countof(open->deviceId));
+	open->hr = E_PENDING;
+	pending.open = open;
+	pending.stream = open->stream;
+	pending.hr = E_PENDING;
+	pending.thread = CreateThread(NULL, 0, OpenPendingStream, open, 0, NULL);
+	if (!pending.thread) {
+		ERR(L"CreateThread failed: %u", GetLastError());
+		delete open->stream;
+		open->stream = NULL;
+		PendingOpenRelease(open);
+		PendingOpenRelease(open);
+		pending.open = NULL;
+		pending.stream = NULL;
+		return false;
+	}
+	return true;
+}
+
+// Takes the stream back once the opening thread has finished.
+static void PendingStreamJoin(PendingStream &pending) {
+	CloseHandle(pending.thread);
+	pending.thread = NULL;
+	pending.hr = pending.open->hr;
+	pending.open->stream = NULL;
+	PendingOpenRelease(pending.open);
+	pending.open = NULL;
+}
+
+// True once the pending stream has been opened and is capturing.
+static bool PendingStreamReady(PendingStream &pending) {
+	if (pending.thread && WaitForSingleObject(pending.thread, 0) == WAIT_OBJECT_0)
+		PendingStreamJoin(pending);
+	return pending.stream && !pending.thread && SUCCEEDED(pending.hr);
+}
+
+// Waits a bounded time for a switch still opening its endpoint. If it does not finish, the
+// stream is left to its thread, which closes it whenever Open() returns.
+static void PendingStreamCancel(PendingStream &pending) {
+	if (pending.thread) {
+		if (WaitForSingleObject(pending.thread, PENDING_STREAM_CANCEL_MS) == WAIT_OBJECT_0) {
+			PendingStreamJoin(pending);
+		} else {
+			ERR(L"Next device still opening after %d ms; leaving it to close on its own", PENDING_STREAM_CANCEL_MS);
+			InterlockedIncrement(&closingStreams);
+			CloseHandle(pending.thread);
+			pending.thread = NULL;
+			PendingOpenRelease(pending.open);
+			pending.open = NULL;
+			pending.stream = NULL;
+		}
+	}
+	if (pending.stream)
+		CloseStreamAsync(pending.stream);
+	pending.stream = NULL;
+}
+
+// Per-endpoint correction from the registry, in milliseconds; 0 if none is set.
+static int LatencyOffsetMs(const wchar_t *id) {
+	HKEY key;
+	DWORD value = 0;
+	DWORD size = sizeof(value);
+	DWORD type = 0;
+	if (RegOpenKeyExW(HKEY_CURRENT_USER, AV_LATENCY_KEY, 0, KEY_QUERY_VALUE, &key) != ERROR_SUCCESS)
+		return 0;
+	if (RegQueryValueExW(key, id, NULL, &type, (BYTE*)&value, &size) != ERROR_SUCCESS || type != REG_DWORD)
+		value = 0;
+	RegCloseKey(key);
+	return (int)value;
+}
+
+// Delays windows by the stream's output latency, less the display's, plus the endpoint's correction.
+static void UpdateDelay(DelayLine &delayLine, const CaptureStream *stream) {
+	int offsetMs = LatencyOffsetMs(stream->Id());
+	HRESULT hr = delayLine.SetDelay(stream->LatencyMs() - displayLatencyMs + offsetMs);
+	if (FAILED(hr)) {
+		ERR(L"DelayLine::SetDelay failed: hr = 0x%08x", hr);
+		return;
+	}
+	LOG(L"A/V delay for %s: %.1f ms (output latency %.1f ms, display %d ms, correction %d ms)",
+		stream->Name(), delayLine.GetDelay(), stream->LatencyMs(), displayLatencyMs, offsetMs);
+}
+
+// Fades from the outgoing window to the incoming one across a single window.
+static void Crossfade(float *left, float *right, const float *nextLeft, const float *nextRight, int samples) {
+	for (int i = 0; i < samples; i++) {
+		float t = (i + 0.5f) / samples;
+		left[i] += (nextLeft[i] - left[i]) * t;
+		right[i] += (nextRight[i] - right[i]) * t;
+	}
+}
+
+long audioLoop(IMMDeviceEnumerator *pMMDeviceEnumerator, bool loopback) {
+	HRESULT hr = S_OK;
+	noAudio = false;
+
+	MSG msg;
+	msg.message = WM_NULL;
+	LARGE_INTEGER frameStart, frameEnd, renderStart, windowTime, presentTime;
+	LONGLONG captured = 0;
+	LONGLONG nextCaptured = 0;
+	float nextLeft[576];
+	float nextRight[576];
+	float delayedLeft[576];
+	float delayedRight[576];
+	bool firstWindow = true;
+	DelayLine delayLine;
+	PendingStream pending;
+	pending.thread = NULL;
+	pending.stream = NULL;
+	pending.open = NULL;
+	CaptureStream *stream = new CaptureStream();
+	FrameStatsBreak(frameStats);
+
+	wchar_t deviceId[_countof(selectedDeviceId)];
+	bool useSelected = GetSelectedDevice(deviceId, _countof(deviceId));
+	hr = stream->Open(pMMDeviceEnumerator, useSelected ? deviceId : NULL, loopback);
+	if (FAILED(hr)) {
+		noAudio = true;
+		goto cleanup;
+	}
+	audioDeviceName = stream->Name();
+	analyzer.Reset(44100, 576);
+	UpdateDelay(delayLine, stream);
+
+	while (stateMachine.IsActive()) {
+		if (deviceChanged && !pending.stream) {
+			SwitchStatsRequest(switchStats);
+			if (!gaplessSwitch)
+				break;
+			deviceChanged = false;
+			if (!PendingStreamStart(pending, pMMDeviceEnumerator)) {
+				deviceChanged = true;
+				break;
+			}
+		}
+		if (pending.stream && !pending.thread && FAILED(pending.hr)) {
+			// The new endpoint would not open; fall back to a full reopen.
+			ERR(L"Opening the next device failed: hr = 0x%08x", pending.hr);
+			deviceChanged = true;
+			break;
+		}
+
+		if (PeekMessage(&msg, NULL, 0U, 0U, PM_REMOVE)) {
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+			if (WM_QUIT == msg.message)
+				stateMachine.Post(COMMAND_EXIT);
+		} else if (stateMachine.Pump()) {
+			// Paused capture was drained and discarded, so the backlog restarts from scratch.
+			stream->Restart();
+			if (PendingStreamReady(pending))
+				pending.stream->Restart();
+			analyzer.Reset(44100, 576);
+			delayLine.Clear();
+			FrameStatsBreak(frameStats);
+		} else if (stateMachine.Get() == STATE_PAUSED) {
+			hr = stream->Drain();
+			if (SUCCEEDED(hr) && PendingStreamReady(pending))
+				hr = pending.stream->Drain();
+			if (FAILED(hr))
+				goto cleanup;
+			stateMachine.Settled();
+			HANDLE commandEvent = stateMachine.GetEvent();
+			MsgWaitForMultipleObjectsEx(1, &commandEvent, 10, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+		} else {
+			QueryPerformanceCounter(&frameStart);
+			hr = stream->Read(frameStart.QuadPart);
+			if (FAILED(hr)) {
+				noAudio = stream->NoAudio();
+				goto cleanup;
+			}
+			bool nextReady = PendingStreamReady(pending);
+			if (nextReady) {
+				hr = pending.stream->Read(frameStart.QuadPart);
+				if (FAILED(hr)) {
+					// The next endpoint failed before taking over; fall back to a full reopen.
+					deviceChanged = true;
+					goto cleanup;
+				}
+			}
+
+			// Windows are taken by audio time rather than one per frame, so every window that
+			// fell due since the last frame is analyzed and published, however fast Render() runs.
+			for (;;) {
+				bool haveWindow = stream->TakeWindow(windowLeft, windowRight, frameStart.QuadPart, &captured);
+				// Cut over on a window boundary once the next stream has a window of its own,
+				// fading into it if the current stream still produced one.
+				if (nextReady && pending.stream->TakeWindow(nextLeft, nextRight, frameStart.QuadPart, &nextCaptured)) {
+					if (haveWindow) {
+						Crossfade(windowLeft, windowRight, nextLeft, nextRight, 576);
+					} else {
+						memcpy(windowLeft, nextLeft, sizeof(windowLeft));
+						memcpy(windowRight, nextRight, sizeof(windowRight));
+					}
+					haveWindow = true;
+					nextReady = false;
+					captured = nextCaptured;
+					CaptureStream *previous = stream;
+					stream = pending.stream;
+					pending.stream = NULL;
+					audioDeviceName = stream->Name();
+					CloseStreamAsync(previous);
+					UpdateDelay(delayLine, stream);
+					QueryPerformanceCounter(&windowTime);
+					SwitchStatsDone(switchStats, windowTime.QuadPart, L"overlapped");
+					firstWindow = false;
+				}
+				if (!haveWindow)
+					break;
+				TRACE_SPAN("Waveform");
+				QueryPerformanceCounter(&windowTime);
+				if (firstWindow)
+					SwitchStatsDone(switchStats, windowTime.QuadPart, L"reopened");
+				firstWindow = false;
+				SwitchStatsWindow(switchStats, windowTime.QuadPart);
+				// External consumers get the window straight away, stamped with its capture time.
+				AnalyzeAndPublish(windowTime.QuadPart, captured);
+				delayLine.Push(windowLeft, windowRight, captured);
+			}
+			// Every window that fell due goes over in order; stream backends such as projectM need all of them.
+			QueryPerformanceCounter(&presentTime);
+			while (delayLine.Pop(presentTime.QuadPart, delayedLeft, delayedRight))
+				HandOffWindow(delayedLeft, delayedRight);
+			QueryPerformanceCounter(&renderStart);
+			{
+				TRACE_SPAN("Render");
+				visualizer->Render();
+			}
+			stateMachine.Settled();
+			QueryPerformanceCounter(&frameEnd);
+			FrameStatsRecord(frameStats, renderStart.QuadPart, frameEnd.QuadPart);
+			TraceFrame(frameStart.QuadPart, frameEnd.QuadPart, TRACE_FRAME_BUDGET_MS);
+		}
+	}
+
+cleanup:
+	PendingStreamCancel(pending);
+	audioDeviceName = useSelected ? selectedDevMissing : noSuitableDev;
+	delete stream;
+
+	return hr;
+}
+
+// Publishes one precomputed window to the shared ring, as AnalyzeAndPublish() does for a live one.
+static void PublishRecord(const FeatureRecord &record, LONGLONG qpc) {
+	float spectrum[2 * SHARED_WAVEFORM_BINS];
+	FeatureFileReader::Waveform(record, windowLeft, windowRight);
+	FeatureFileReader::Spectrum(record, spectrum);
+	QuantizeWaveform(windowLeft, windowRight, 576, chunk);
+	sharedWaveform.Publish(chunk, spectrum, &record.analysis, record.flags, qpc);
+}
+
+// Plays the feature file in place of capture. The position advances with wall-clock time
+// while rendering and holds while paused, so it follows a track started together with
+// milkbottle; /playoffset=N shifts it. Stopping starts the file over.
+static void featureLoop(void) {
+	MSG msg;
+	msg.message = WM_NULL;
+	LARGE_INTEGER frequency, frameStart, frameEnd, renderStart;
+	QueryPerformanceFrequency(&frequency);
+	LONGLONG playTicks = 0;
+	LONGLONG last = 0;
+	LONGLONG published = 0;
+	LONGLONG handed = 0;
+	bool ended = false;
+	HANDLE commandEvent = stateMachine.GetEvent();
+	FrameStatsBreak(frameStats);
+	LOG(L"Playing %.1f s of features", features.Duration());
+
+	while (stateMachine.IsActive()) {
+		if (PeekMessage(&msg, NULL, 0U, 0U, PM_REMOVE)) {
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+			if (WM_QUIT == msg.message)
+				stateMachine.Post(COMMAND_EXIT);
+		} else if (stateMachine.Pump()) {
+			last = 0;
+			FrameStatsBreak(frameStats);
+		} else if (stateMachine.Get() == STATE_PAUSED) {
+			stateMachine.Settled();
+			MsgWaitForMultipleObjectsEx(1, &commandEvent, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+			last = 0;
+		} else {
+			QueryPerformanceCounter(&frameStart);
+			if (last)
+				playTicks += frameStart.QuadPart - last;
+			last = frameStart.QuadPart;
+			double seconds = (double)playTicks / frequency.QuadPart + playOffsetMs / 1000.0;
+
+			// The ring gets every window up to the playback position, at most a ring's worth at once.
+			LONGLONG current = (LONGLONG)(seconds * 44100 / 576);
+			if (current - published >= SHARED_WAVEFORM_SLOTS)
+				published = current - SHARED_WAVEFORM_SLOTS + 1;
+			if (published < 0)
+				published = 0;
+			for (; published <= current && published < features.RecordCount(); published++)
+				PublishRecord(*features.Record(published), frameStart.QuadPart);
+
+			// The visualizer runs ahead by the display latency, so the frame shows what is heard when it lands.
+			// It gets every window up to there once and in order, as with live capture, and none twice
+			// when frames come faster than windows.
+			LONGLONG due = features.IndexAt(seconds + displayLatencyMs / 1000.0);
+			if (due - handed >= FEATURE_HANDOFF_WINDOWS)
+				handed = due - FEATURE_HANDOFF_WINDOWS + 1;
+			if (due >= 0 && handed < features.RecordCount()) {
+				for (; handed <= due && handed < features.RecordCount(); handed++) {
+					FeatureFileReader::Waveform(*features.Record(handed), windowLeft, windowRight);
+					HandOffWindow(windowLeft, windowRight);
+				}
+				ended = false;
+			} else if (!ended) {
+				visualizer->Clear();
+				ended = true;
+			}
+			QueryPerformanceCounter(&renderStart);
+			{
+				TRACE_SPAN("Render");
+				visualizer->Render();
+			}
+			stateMachine.Settled();
+			QueryPerformanceCounter(&frameEnd);
+			FrameStatsRecord(frameStats, renderStart.QuadPart, frameEnd.QuadPart);
+			TraceFrame(frameStart.QuadPart, frameEnd.QuadPart, TRACE_FRAME_BUDGET_MS);
+		}
+	}
+}
+
+// The child side of /vishost: renders the windows the parent publishes until told to quit,
+// or until the parent goes away.
+static int visualizerChild(const wchar_t *channelName) {
+	VisualizerChannel channel;
+	HRESULT hr = channel.Open(channelName);
+	if (FAILED(hr)) {
+		ERR(L"Opening visualizer channel %s failed: hr = 0x%08x", channelName, hr);
+		return 1;
+	}
+	HANDLE parent = OpenProcess(SYNCHRONIZE, FALSE, channel.View()->parentProcessId);
+	hr = visualizer->Init();
+	if (FAILED(hr)) {
+		ERR(L"%s visualizer Init failed: hr = 0x%08x", visualizer->Name(), hr);
+		if (parent)
+			CloseHandle(parent);
+		return 1;
+	}
+	channel.Ready();
+
+	MSG msg;
+	msg.message = WM_NULL;
+	LARGE_INTEGER frameStart, frameEnd;
+	LONGLONG published;
+	bool quit = false;
+	FrameStatsBreak(frameStats);
+	while (!quit) {
+		if (PeekMessage(&msg, NULL, 0U, 0U, PM_REMOVE)) {
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+			if (WM_QUIT == msg.message)
+				quit = true;
+			continue;
+		}
+		for (LONG command = channel.TakeCommand(); command; command = channel.TakeCommand()) {
+			if (command == VISUALIZER_COMMAND_CLEAR)
+				visualizer->Clear();
+			else if (command == VISUALIZER_COMMAND_QUIT)
+				quit = true;
+		}
+		if (parent && WaitForSingleObject(parent, 0) != WAIT_TIMEOUT)
+			quit = true;
+		if (quit)
+			break;
+		while (channel.TakeNext(windowLeft, windowRight, &published))
+			HandOffWindow(windowLeft, windowRight);
+		QueryPerformanceCounter(&frameStart);
+		{
+			TRACE_SPAN("Render");
+			visualizer->Render();
+		}
+		QueryPerformanceCounter(&frameEnd);
+		channel.FrameDone(frameEnd.QuadPart);
+		FrameStatsRecord(frameStats, frameStart.QuadPart, frameEnd.QuadPart);
+	}
+	visualizer->Quit();
+	if (parent)
+		CloseHandle(parent);
+	return 0;
+}
+
+// Returns the integer following name on the command line, e.g. /batch=10.
+static int GetIntOption(PCWSTR cmdLine, PCWSTR name, int defaultValue) {
+	const wchar_t *option = wcsstr(cmdLine, name);
+	return option ? _wtoi(option + wcslen(name)) : defaultValue;
+}
+
+// Copies the value following name on the command line, e.g. /preset="C:\My Presets\a.milk".
+static bool GetStringOption(PCWSTR cmdLine, PCWSTR name, wchar_t *value, size_t size) {
+	const wchar_t *option = wcsstr(cmdLine, name);
+	if (!option || size == 0)
+		return false;
+	option += wcslen(name);
+	wchar_t end = L' ';
+	if (*option == L'"') {
+		end = L'"';
+		option++;
+	}
+	size_t i = 0;
+	while (option[i] && option[i] != end && i + 1 < size) {
+		value[i] = option[i];
+		i++;
+	}
+	value[i] = L'\0';
+	return i > 0;
+}
+
+// The options a /vishost child needs to pick and set up its backend. Capture, playback and
+// profiling options belong to the parent alone.
+static void VisualizerChildArguments(PCWSTR cmdLine, wchar_t *arguments, size_t size) {
+	wchar_t presetPath[MAX_PATH];
+	arguments[0] = L'\0';
+	if (wcsstr(cmdLine, L"/projectm"))
+		wcscat_s(arguments, size, L"/projectm ");
+	if (GetStringOption(cmdLine, L"/preset=", presetPath, _countof(presetPath))) {
+		wcscat_s(arguments, size, L"/preset=\"");
+		wcscat_s(arguments, size, presetPath);
+		wcscat_s(arguments, size, L"\" ");
+	}
+	if (wcsstr(cmdLine, L"/headless"))
+		wcscat_s(arguments, size, L"/headless");
+}
+
+struct UiThreadStart {
+	HINSTANCE instance;
+	HANDLE ready;
+	HWND window;
+};
+
+// Owns the tray icon, its menu and device selection. Talks to the render thread only
+// through stateMachine and SelectDevice(), so a blocked UI never costs a frame.
+static DWORD WINAPI UiThread(LPVOID parameter) {
+	UiThreadStart *start = (UiThreadStart*)parameter;
+	HINSTANCE hInstance = start->instance;
+	TraceSetThreadName("ui");
+
+	// Multithreaded like the render thread, so the shared IMMDeviceEnumerator can be used here.
+	HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	if (FAILED(hr)) {
+		ERR(L"CoInitialize failed on the UI thread: hr = 0x%08x", hr);
+		SetEvent(start->ready);
+		return 1;
+	}
+
+	char mainClassName[] = "MilkDrop 2";
+	char mainWindowName[] = "MilkDrop 2";
+
+	WNDCLASS mainClass;
+	mainClass.style = 0;
+	mainClass.lpfnWndProc = MainWndProc;
+	mainClass.cbClsExtra = 0;
+	mainClass.cbWndExtra = 0;
+	mainClass.hInstance = hInstance;
+	mainClass.hIcon = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_PLUGIN_ICON));
+	mainClass.hCursor = NULL;
+	mainClass.hbrBackground = NULL;
+	mainClass.lpszMenuName = NULL;
+	mainClass.lpszClassName = mainClassName;
+
+	if (!RegisterClass(&mainClass)) {
+		ERR(L"RegisterClass failed");
+		CoUninitialize();
+		SetEvent(start->ready);
+		return 1;
+	}
+
+	HWND mainWindow = CreateWindow(mainWindowName, NULL, 0, 0, 0, 0, 0, NULL, NULL, hInstance, NULL);
+	if (mainWindow == NULL) {
+		ERR(L"CreateWindow failed");
+		CoUninitialize();
+		SetEvent(start->ready);
+		return 1;
+	}
+
+	NOTIFYICONDATA nid;
+	nid.hWnd = mainWindow;
+	nid.uCallbackMessage = WM_USER + 1;
+	nid.hIcon = mainClass.hIcon;
+	strcpy_s(nid.szTip, mainWindowName);
+	nid.uFlags = NIF_MESSAGE | NIF_ICON | NIF_TIP;
+	Shell_NotifyIcon(NIM_ADD, &nid);
+
+	start->window = mainWindow;
+	SetEvent(start->ready);
+
+	MSG msg;
+	while (GetMessage(&msg, NULL, 0U, 0U) > 0) {
+		TranslateMessage(&msg);
+		DispatchMessage(&msg);
+	}
+
+	Shell_NotifyIcon(NIM_DELETE, &nid);
+	for (UINT i = 0; i < deviceList.size(); i++) if (deviceList[i]) CoTaskMemFree(deviceList[i]);
+	deviceList.clear();
+	CoUninitialize();
+	return 0;
+}
+
+int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PWSTR pCmdLine, int nCmdShow)
+{
+	// Offline analysis needs no window, tray icon, visualizer or audio device.
+	wchar_t analyzePath[MAX_PATH];
+	if (GetStringOption(pCmdLine, L"/analyze=", analyzePath, _countof(analyzePath)))
+		return BatchAnalyze(analyzePath, GetIntOption(pCmdLine, L"/threads=", 0)) == 0 ? 0 : 4;
+
+	char winampClassName[] = "Winamp";
+	char winampWindowName[] = "Winamp";
+
+	WNDCLASS winampClass;
+	winampClass.style = 0;
+	winampClass.lpfnWndProc = WinampWndProc;
+	winampClass.cbClsExtra = 0;
+	winampClass.cbWndExtra = 0;
+	winampClass.hInstance = hInstance;
+	winampClass.hIcon = NULL;
+	winampClass.hCursor = NULL;
+	winampClass.hbrBackground = NULL;
+	winampClass.lpszMenuName = NULL;
+	winampClass.lpszClassName = winampClassName;
+
+	if (!RegisterClass(&winampClass)) {
+		ERR(L"RegisterClass failed");
+		MessageBox(NULL, "RegisterClass failed.", "Error", 0);
+		return 1;
+	}
+
+	HWND winampWindow = CreateWindow(winampClassName, winampWindowName, 0, 0, 0, 0, 0, NULL, NULL, hInstance, NULL);
+	if (winampWindow == NULL) {
+		ERR(L"CreateWindow failed");
+		MessageBox(NULL, "CreateWindow failed.", "Error", 0);
+		return 1;
+	}
+
+	HRESULT hr;
+	wchar_t childChannel[64];
+	bool isChild = GetStringOption(pCmdLine, L"/vischild=", childChannel, _countof(childChannel));
+	// A crashing plug-in must end the child at once, so the parent can restart it, rather than
+	// leave it waiting on a Windows error dialog until the hang timeout.
+	if (isChild)
+		SetErrorMode(SEM_NOGPFAULTERRORBOX | SEM_FAILCRITICALERRORS);
+	if (!isChild && wcsstr(pCmdLine, L"/vishost")) {
+		// The plug-in runs in a child copy of milkbottle started with the same backend options.
+		wchar_t childArguments[MAX_PATH + 64];
+		VisualizerChildArguments(pCmdLine, childArguments, _countof(childArguments));
+		visualizer = new ProcessVisualizer(childArguments, GetIntOption(pCmdLine, L"/vishang=", VIS_CHILD_HANG_MS));
+	} else if (wcsstr(pCmdLine, L"/projectm")) {
+#ifdef MILKBOTTLE_PROJECTM
+		wchar_t presetPath[MAX_PATH];
+		bool hasPreset = GetStringOption(pCmdLine, L"/preset=", presetPath, _countof(presetPath));
+		visualizer = new ProjectMVisualizer(hasPreset ? presetPath : NULL, wcsstr(pCmdLine, L"/headless") != NULL);
+#else
+		ERR(L"/projectm given but this build has no projectM backend");
+		MessageBox(NULL, "This build has no projectM backend.", "Error", 0);
+		return 1;
+#endif
+	} else {
+		WinampVisualizer *winampVisualizer = new WinampVisualizer();
+		hr = winampVisualizer->Load("vis_milk2.dll", winampWindow);
+		if (FAILED(hr)) {
+			ERR(L"Loading vis_milk2.dll failed: hr = 0x%08x", hr);
+			MessageBox(NULL, "Loading vis_milk2.dll failed.", "Error", 0);
+			delete winampVisualizer;
+			return 1;
+		}
+		visualizer = winampVisualizer;
+	}
+
+	resampleBatchMs = GetIntOption(pCmdLine, L"/batch=", RESAMPLE_BATCH_MS);
+	resampleBatchDeadlineMs = GetIntOption(pCmdLine, L"/batchdeadline=", RESAMPLE_BATCH_DEADLINE_MS);
+	resampleBudgetMs = GetIntOption(pCmdLine, L"/resamplebudget=", RESAMPLE_BUDGET_MS);
+	gaplessSwitch = wcsstr(pCmdLine, L"/nogapless") == NULL;
+	displayLatencyMs = GetIntOption(pCmdLine, L"/displaylatency=", AV_DISPLAY_LATENCY_MS);
+	wchar_t convert[32];
+	if (GetStringOption(pCmdLine, L"/convert=", convert, _countof(convert))) {
+		if (!wcscmp(convert, L"resampler"))
+			forcedConversion = CONVERT_RESAMPLER;
+		else if (!wcscmp(convert, L"autoconvert"))
+			forcedConversion = CONVERT_AUTOCONVERT;
+		else if (!wcscmp(convert, L"inprocess"))
+			forcedConversion = CONVERT_INPROCESS;
+		else
+			ERR(L"Unknown /convert=%s; choosing per device", convert);
+	}
+	TraceSetThreadName("main");
+	if (wcsstr(pCmdLine, L"/trace"))
+		TraceEnable(true);
+	wchar_t playPath[MAX_PATH];
+	if (GetStringOption(pCmdLine, L"/play=", playPath, _countof(playPath))) {
+		hr = features.Open(playPath);
+		if (FAILED(hr)) {
+			ERR(L"Opening feature file %s failed: hr = 0x%08x", playPath, hr);
+			MessageBox(NULL, "Opening the feature file failed.", "Error", 0);
+			return 1;
+		}
+		playOffsetMs = GetIntOption(pCmdLine, L"/playoffset=", 0);
+	}
+	int allocWarmupPackets = GetIntOption(pCmdLine, L"/allocassert=", 0);
+	if (allocWarmupPackets > 0)
+		AllocProfileAssertSteadyState(allocWarmupPackets);
+
+	hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	if (FAILED(hr)) {
+		ERR(L"CoInitialize failed: hr = 0x%08x", hr);
+		return -__LINE__;
+	}
+
+	// A /vishost child only renders: no capture, shared ring or tray icon of its own.
+	if (isChild) {
+		TraceSetThreadName("vischild");
+		int result = 0;
+		if (wcsstr(pCmdLine, L"/visconfig"))
+			visualizer->Config();
+		else
+			result = visualizerChild(childChannel);
+		delete visualizer;
+		delete[] chunk;
+		CoUninitialize();
+		return result;
+	}
+
+	hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL, __uuidof(IMMDeviceEnumerator), (void**)&pMMDeviceEnumerator);
+	if (FAILED(hr)) {
+		ERR(L"CoCreateInstance(IMMDeviceEnumerator) failed: hr = 0x%08x", hr);
+		pMMDeviceEnumerator = NULL;
+	}
+
+	hr = sharedWaveform.Open(SHARED_WAVEFORM_NAME);
+	if (hr == HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS)) {
+		LOG(L"Another milkbottle is publishing the shared waveform; not publishing");
+	} else if (FAILED(hr)) {
+		ERR(L"SharedWaveformWriter::Open failed: hr = 0x%08x", hr);
+	}
+
+	InitializeCriticalSection(&selectedDeviceLock);
+	UiThreadStart uiStart;
+	uiStart.instance = hInstance;
+	uiStart.ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+	uiStart.window = NULL;
+	HANDLE uiThread = uiStart.ready ? CreateThread(NULL, 0, UiThread, &uiStart, 0, NULL) : NULL;
+	if (uiThread)
+		WaitForSingleObject(uiStart.ready, INFINITE);
+	if (uiStart.ready)
+		CloseHandle(uiStart.ready);
+	if (!uiStart.window) {
+		ERR(L"Starting the UI thread failed");
+		MessageBox(NULL, "Creating the tray icon failed.", "Error", 0);
+		if (uiThread) {
+			WaitForSingleObject(uiThread, INFINITE);
+			CloseHandle(uiThread);
+		}
+		return 1;
+	}
+
+	MSG msg;
+	msg.message = WM_NULL;
+	MMNotificationClient notificationClient;
+	HANDLE commandEvent = stateMachine.GetEvent();
+	while (stateMachine.Get() != STATE_EXIT) {
+		stateMachine.Pump();
+		if (stateMachine.IsActive()) {
+			hr = visualizer->Init();
+			if (FAILED(hr))
+				ERR(L"%s visualizer Init failed: hr = 0x%08x", visualizer->Name(), hr);
+			while (stateMachine.IsActive()) {
+				if (features.IsOpen()) {
+					featureLoop();
+				} else if (!pMMDeviceEnumerator) {
+					noAudio = true;
+				} else {
+					noAudio = false;
+					pMMDeviceEnumerator->RegisterEndpointNotificationCallback(&notificationClient);
+					deviceChanged = false;
+					audioLoop(pMMDeviceEnumerator, true);
+					if (noAudio) {
+						noAudio = false;
+						audioLoop(pMMDeviceEnumerator, false);
+					}
+				}
+				if (noAudio) {
+					deviceChanged = false;
+					visualizer->Clear();
+					FrameStatsBreak(frameStats);
+					while (stateMachine.IsActive() && !deviceChanged) {
+						if (PeekMessage(&msg, NULL, 0U, 0U, PM_REMOVE)) {
+							TranslateMessage(&msg);
+							DispatchMessage(&msg);
+							if (WM_QUIT == msg.message) {
+								stateMachine.Post(COMMAND_EXIT);
+							}
+						} else if (stateMachine.Pump()) {
+							FrameStatsBreak(frameStats);
+							continue;
+						} else if (stateMachine.Get() == STATE_PAUSED) {
+							stateMachine.Settled();
+							MsgWaitForMultipleObjectsEx(1, &commandEvent, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+						} else {
+							LARGE_INTEGER renderStart, renderEnd;
+							QueryPerformanceCounter(&renderStart);
+							{
+								TRACE_SPAN("Render");
+								visualizer->Render();
+							}
+							stateMachine.Settled();
+							QueryPerformanceCounter(&renderEnd);
+							FrameStatsRecord(frameStats, renderStart.QuadPart, renderEnd.QuadPart);
+						}
+					}
+				}
+				if (pMMDeviceEnumerator && !features.IsOpen()) {
+					pMMDeviceEnumerator->UnregisterEndpointNotificationCallback(&notificationClient);
+				}
+			}
+			visualizer->Quit();
+			while (PeekMessage(&msg, NULL, 0U, 0U, PM_REMOVE)) {
+				TranslateMessage(&msg);
+				DispatchMessage(&msg);
+			}
+		} else if (stateMachine.Get() == STATE_STOPPED) {
+			stateMachine.Settled();
+			MsgWaitForMultipleObjectsEx(1, &commandEvent, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+			while (PeekMessage(&msg, NULL, 0U, 0U, PM_REMOVE)) {
+				TranslateMessage(&msg);
+				DispatchMessage(&msg);
+				if (WM_QUIT == msg.message)
+					stateMachine.Post(COMMAND_EXIT);
+			}
+		} else if (stateMachine.Get() == STATE_CONFIG) {
+			stateMachine.Settled();
+			visualizer->Config();
+			stateMachine.Post(COMMAND_CONFIG_DONE);
+		}
+	}
+
+	// The UI thread removes the tray icon and frees the device list on its way out.
+	PostMessage(uiStart.window, WM_CLOSE, 0, 0);
+	WaitForSingleObject(uiThread, INFINITE);
+	CloseHandle(uiThread);
+	DeleteCriticalSection(&selectedDeviceLock);
+
+	WaitForClosingStreams(CLOSING_STREAMS_EXIT_MS);
+	sharedWaveform.Close();
+	features.Close();
+	SafeRelease(&pMMDeviceEnumerator);
+	delete visualizer;
+	delete[] chunk;
+	CoUninitialize();
+
+	// A nonzero exit code lets a headless run fail on steady-state allocations.
+	AllocProfileReport();
+	if (AllocProfileViolations() > 0)
+		return 3;
+	return 0;
+}
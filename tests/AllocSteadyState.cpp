@@ -0,0 +1,123 @@
+// Runs the capture thread's steady-state path the way CaptureStream::Read() and audioLoop do:
+// packets through PacketBatcher and WWMFResampler::ResamplePooled() into the backlog, and
+// windows out of it through DriftCompensator. The allocation profiler's steady-state assertion
+// is armed as /allocassert does, so any allocation after the warm-up fails the test, including
+// the Media Foundation samples and buffers the resampler reports. A deliberate allocation at the
+// end checks that the assertion catches one. Exits nonzero on failure.
+
+#include <stdio.h>
+#include <math.h>
+#include <windows.h>
+#include <objbase.h>
+
+#include "../AllocProfile.h"
+#include "../Backlog.h"
+#include "../DriftCompensator.h"
+#include "../PacketBatcher.h"
+#include "../WWMFResampler.h"
+
+#ifndef MILKBOTTLE_ALLOC_PROFILE
+#  error AllocSteadyState needs MILKBOTTLE_ALLOC_PROFILE
+#endif
+
+// As in milkbottle.cpp.
+#define RESAMPLE_QUALITY 5
+#define RESAMPLE_BATCH_MS 20
+#define DRIFT_TARGET_SAMPLES (2*576)
+#define DRIFT_MAX_SAMPLES (8*576)
+#define DRIFT_MAX_PPM 2000
+#define BACKLOG_HEADROOM_MS 200
+
+// A shared-mode endpoint mixing at 48 kHz, read in 10 ms packets.
+#define INPUT_RATE 48000
+#define PACKET_FRAMES 480
+#define RUN_PACKETS 6000
+// Packets before the assertion is armed, long enough for every buffer to reach its size.
+#define WARMUP_PACKETS 500
+#define PI 3.14159265358979323846
+
+int main(void) {
+	static float packet[PACKET_FRAMES * 2];
+	float windowLeft[576];
+	float windowRight[576];
+	WWMFResampler resampler;
+	PacketBatcher batcher;
+	Backlog backlog;
+	DriftCompensator drift;
+	WWMFPcmFormat inputFormat(WWMFBitFormatFloat, 2, 32, INPUT_RATE, 3, 32);
+	WWMFPcmFormat outputFormat(WWMFBitFormatFloat, 2, 32, 44100, 3, 32);
+	DWORD frameBytes = 2 * sizeof(float);
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	if (FAILED(hr)) {
+		printf("CoInitializeEx failed: hr = 0x%08x\n", hr);
+		return 1;
+	}
+	AllocProfileSetThreadName("capture");
+	hr = resampler.Initialize(inputFormat, outputFormat, RESAMPLE_QUALITY);
+	if (SUCCEEDED(hr))
+		hr = batcher.Reset(frameBytes, INPUT_RATE, INPUT_RATE * RESAMPLE_BATCH_MS / 1000, RESAMPLE_BATCH_MS * 1.5);
+	if (SUCCEEDED(hr))
+		hr = backlog.Reset(DRIFT_MAX_SAMPLES + 44100 * (RESAMPLE_BATCH_MS + BACKLOG_HEADROOM_MS) / 1000);
+	drift.Reset(DRIFT_TARGET_SAMPLES, DRIFT_MAX_PPM, 44100);
+	AllocProfileAssertSteadyState(WARMUP_PACKETS);
+
+	long windows = 0;
+	for (int n = 0; n < RUN_PACKETS && SUCCEEDED(hr); n++) {
+		for (int i = 0; i < PACKET_FRAMES; i++) {
+			double t = (double)(n * PACKET_FRAMES + i) / INPUT_RATE;
+			packet[2 * i] = (float)(0.5 * sin(2 * PI * 440 * t));
+			packet[2 * i + 1] = (float)(0.5 * sin(2 * PI * 660 * t));
+		}
+		LONGLONG qpc = (LONGLONG)n * PACKET_FRAMES * frequency.QuadPart / INPUT_RATE;
+
+		// As CaptureStream::Read(), with the packet's capture time marked on the backlog.
+		AllocProfilePacket();
+		bool batched = batcher.Append((const BYTE*)packet, PACKET_FRAMES, qpc, qpc);
+		const BYTE *output;
+		DWORD outputBytes;
+		if (!batched || batcher.Due(qpc)) {
+			{
+				ALLOC_TAG("Resample");
+				hr = resampler.ResamplePooled(batcher.Data(), batcher.Bytes(), &output, &outputBytes);
+			}
+			if (SUCCEEDED(hr)) {
+				ALLOC_TAG("Backlog");
+				backlog.Mark(batcher.Captured());
+				const float *samples = (const float*)output;
+				for (DWORD i = 0; i < outputBytes / sizeof(float); i += 2)
+					backlog.Push(samples[i], samples[i + 1]);
+			}
+			batcher.Clear();
+			if (!batched)
+				batcher.Append((const BYTE*)packet, PACKET_FRAMES, qpc, qpc);
+		}
+
+		// As audioLoop: every window due by the render clock.
+		ALLOC_TAG("Window");
+		double now = (double)(n + 1) * PACKET_FRAMES / INPUT_RATE;
+		while (drift.Due(now, (double)backlog.Size(), 576) && drift.Take(backlog, windowLeft, windowRight, 576))
+			windows++;
+	}
+	resampler.Finalize();
+	if (FAILED(hr)) {
+		printf("FAIL: resampling failed: hr = 0x%08x\n", hr);
+		CoUninitialize();
+		return 1;
+	}
+
+	LONG violations = AllocProfileViolations();
+	printf("%s: %d packets, %ld windows: %d allocations after %d warm-up packets\n",
+		violations == 0 ? "PASS" : "FAIL", RUN_PACKETS, windows, violations, WARMUP_PACKETS);
+
+	// The assertion must see an allocation on a hot thread.
+	char *volatile probe = new char[16];
+	delete[] probe;
+	bool caught = AllocProfileViolations() == violations + 1;
+	printf("%s: an allocation after the warm-up %s\n", caught ? "PASS" : "FAIL", caught ? "is reported" : "is not reported");
+
+	CoUninitialize();
+	return violations == 0 && caught ? 0 : 1;
+}
@@ -0,0 +1,228 @@
+// Feeds Analyzer synthetic signals in 576-sample hops, the way audioLoop does, and checks
+// its outputs against what the signals are known to contain: sine tones must peak in their
+// own FFT bin at their own amplitude without leaking into the other channel or band, and
+// click tracks must give one onset per click and their tempo. Then times Analyze() over a
+// stretch of music-like signal against the throughput the analyzer was built for. Exits
+// nonzero on failure.
+
+#include <stdio.h>
+#include <math.h>
+#include <windows.h>
+
+#include "../Analyzer.h"
+
+#define SAMPLE_RATE 44100.0
+#define HOP_SAMPLES 576
+#define PI 3.14159265358979323846
+
+// A bin-centred sine of amplitude a must read a +- this much.
+#define TONE_TOLERANCE 0.02
+// Largest magnitude allowed in the other channel at the tone's bin.
+#define CROSSTALK_LIMIT 1e-3
+#define CLICK_SECONDS 30
+// Clicks are ignored while the flux history fills.
+#define CLICK_SETTLE_SECONDS 1
+// An onset counts for a click if it lands within this many hops after it.
+#define ONSET_HOPS 2
+// Allowed tempo error, relative.
+#define TEMPO_TOLERANCE 0.02
+// Windows analyzed by the timed run, about 10 minutes of audio.
+#define SPEED_WINDOWS 46000
+// Slowest acceptable analyzer. Capture needs about 77 windows a second, so this leaves the
+// capture thread well over 99.9% of its time; the analyzer is meant to manage several hundred.
+#define SPEED_MIN_WINDOWS_PER_MS 100
+
+// Aligned like the globals in milkbottle.cpp; Analyzer uses aligned SSE loads on its members.
+static Analyzer analyzer;
+static AnalysisResult result;
+
+struct Tone {
+	int leftBin;
+	double leftAmplitude;
+	int rightBin;
+	double rightAmplitude;
+};
+
+struct Clicks {
+	double bpm;
+	// Tempo the analyzer should report. Above about 170 bpm its preference for tempos near
+	// 120 picks half the click rate.
+	double tempo;
+};
+
+static unsigned int seed = 1;
+
+static float Noise(void) {
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 16) & 0x7FFF) / 16383.5f - 1.0f;
+}
+
+static int PeakBin(const float *spectrum) {
+	int peak = 1;
+	for (int k = 1; k < ANALYZER_BINS; k++)
+		if (spectrum[k] > spectrum[peak])
+			peak = k;
+	return peak;
+}
+
+static bool CheckTone(const Tone &test) {
+	float left[HOP_SAMPLES];
+	float right[HOP_SAMPLES];
+	double binHz = SAMPLE_RATE / ANALYZER_FFT_SIZE;
+	analyzer.Reset(SAMPLE_RATE, HOP_SAMPLES);
+	for (int hop = 0; hop < 8; hop++) {
+		for (int i = 0; i < HOP_SAMPLES; i++) {
+			double t = (hop * HOP_SAMPLES + i) / SAMPLE_RATE;
+			left[i] = (float)(test.leftAmplitude * sin(2 * PI * test.leftBin * binHz * t));
+			right[i] = (float)(test.rightAmplitude * sin(2 * PI * test.rightBin * binHz * t));
+		}
+		analyzer.Analyze(left, right, HOP_SAMPLES, &result);
+	}
+
+	int leftPeak = PeakBin(result.spectrum[0]);
+	int rightPeak = PeakBin(result.spectrum[1]);
+	float leftMagnitude = result.spectrum[0][test.leftBin];
+	float rightMagnitude = result.spectrum[1][test.rightBin];
+	float crosstalk = result.spectrum[1][test.leftBin];
+	if (result.spectrum[0][test.rightBin] > crosstalk)
+		crosstalk = result.spectrum[0][test.rightBin];
+
+	// The louder tone must put its energy in its own band.
+	double loudHz = (test.leftAmplitude >= test.rightAmplitude ? test.leftBin : test.rightBin) * binHz;
+	bool bandOk;
+	if (loudHz < 250)
+		bandOk = result.bass > result.mid && result.bass > result.treble;
+	else if (loudHz < 4000)
+		bandOk = result.mid > result.bass && result.mid > result.treble;
+	else
+		bandOk = result.treble > result.bass && result.treble > result.mid;
+
+	bool passed = leftPeak == test.leftBin && rightPeak == test.rightBin &&
+		fabs(leftMagnitude - test.leftAmplitude) < TONE_TOLERANCE && fabs(rightMagnitude - test.rightAmplitude) < TONE_TOLERANCE &&
+		crosstalk < CROSSTALK_LIMIT && bandOk;
+	printf("%s: tones %6.0f Hz @ %.2f / %6.0f Hz @ %.2f: peaks at bins %d / %d, magnitude %.3f / %.3f, crosstalk %.1e, bands %.3f %.3f %.3f\n",
+		passed ? "PASS" : "FAIL", test.leftBin * binHz, test.leftAmplitude, test.rightBin * binHz, test.rightAmplitude,
+		leftPeak, rightPeak, leftMagnitude, rightMagnitude, crosstalk, result.bass, result.mid, result.treble);
+	return passed;
+}
+
+// A click is a 60 ms burst of noise decaying like a drum hit, over quiet background noise.
+// Each hop analyzes only its last ANALYZER_FFT_SIZE samples, so a much shorter click that
+// starts right at a hop boundary can go unseen.
+static float ClickSample(long sample, double period) {
+	double sinceClick = fmod((double)sample, period);
+	float value = 0.01f * Noise();
+	if (sinceClick < SAMPLE_RATE * 0.06)
+		value += 0.8f * (float)exp(-sinceClick / (SAMPLE_RATE * 0.015)) * Noise();
+	return value;
+}
+
+static bool CheckClicks(const Clicks &test) {
+	float left[HOP_SAMPLES];
+	float right[HOP_SAMPLES];
+	double period = SAMPLE_RATE * 60.0 / test.bpm;
+	long hops = (long)(CLICK_SECONDS * SAMPLE_RATE / HOP_SAMPLES);
+	long settleHops = (long)(CLICK_SETTLE_SECONDS * SAMPLE_RATE / HOP_SAMPLES);
+	analyzer.Reset(SAMPLE_RATE, HOP_SAMPLES);
+
+	long clicks = 0;
+	long hits = 0;
+	long extra = 0;
+	// Hop holding the start of the last click, or -1 once it has been matched.
+	long pendingClick = -1;
+	for (long hop = 0; hop < hops; hop++) {
+		long first = hop * HOP_SAMPLES;
+		// A click starting in this hop.
+		long click = (long)ceil(first / period);
+		bool clickHere = click * period < first + HOP_SAMPLES;
+		for (int i = 0; i < HOP_SAMPLES; i++) {
+			left[i] = ClickSample(first + i, period);
+			right[i] = left[i];
+		}
+		analyzer.Analyze(left, right, HOP_SAMPLES, &result);
+
+		if (hop < settleHops)
+			continue;
+		if (clickHere) {
+			clicks++;
+			pendingClick = hop;
+		}
+		if (pendingClick >= 0 && hop - pendingClick > ONSET_HOPS)
+			pendingClick = -1;
+		if (result.onset) {
+			if (pendingClick >= 0) {
+				hits++;
+				pendingClick = -1;
+			} else {
+				extra++;
+			}
+		}
+	}
+
+	bool passed = hits == clicks && extra == 0 && fabs(result.tempo - test.tempo) < test.tempo * TEMPO_TOLERANCE;
+	printf("%s: clicks at %3.0f bpm: %ld of %ld found, %ld extra onsets, tempo %.1f bpm (confidence %.2f, expected %.0f)\n",
+		passed ? "PASS" : "FAIL", test.bpm, hits, clicks, extra, result.tempo, result.tempoConfidence, test.tempo);
+	return passed;
+}
+
+// Times Analyze() on clicks over tones, so the onset and tempo paths run as well as the FFT.
+// The signal is prepared first; only the analyzer is timed.
+static bool CheckSpeed(void) {
+	static float left[SPEED_WINDOWS / 64][HOP_SAMPLES];
+	static float right[SPEED_WINDOWS / 64][HOP_SAMPLES];
+	const int blocks = SPEED_WINDOWS / 64;
+	double period = SAMPLE_RATE * 60.0 / 128;
+	for (int hop = 0; hop < blocks; hop++) {
+		for (int i = 0; i < HOP_SAMPLES; i++) {
+			long sample = hop * HOP_SAMPLES + i;
+			double t = sample / SAMPLE_RATE;
+			left[hop][i] = ClickSample(sample, period) + 0.3f * (float)sin(2 * PI * 110 * t);
+			right[hop][i] = ClickSample(sample, period) + 0.3f * (float)sin(2 * PI * 1760 * t);
+		}
+	}
+	analyzer.Reset(SAMPLE_RATE, HOP_SAMPLES);
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	for (int window = 0; window < SPEED_WINDOWS; window++)
+		analyzer.Analyze(left[window % blocks], right[window % blocks], HOP_SAMPLES, &result);
+	QueryPerformanceCounter(&end);
+
+	double milliseconds = (end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+	double rate = SPEED_WINDOWS / milliseconds;
+#ifdef _DEBUG
+	// Unoptimized builds only report the rate.
+	bool passed = true;
+#else
+	bool passed = rate >= SPEED_MIN_WINDOWS_PER_MS;
+#endif
+	printf("%s: analyzed %d windows in %.1f ms: %.0f windows/ms, %.2f us per window (at least %d windows/ms expected)\n",
+		passed ? "PASS" : "FAIL", SPEED_WINDOWS, milliseconds, rate, milliseconds * 1000.0 / SPEED_WINDOWS, SPEED_MIN_WINDOWS_PER_MS);
+	return passed;
+}
+
+int main(void) {
+	static const Tone tones[] = {
+		{ 2, 0.5, 40, 0.25 },
+		{ 10, 1.0, 100, 0.5 },
+		{ 100, 0.25, 10, 0.75 },
+		{ 200, 0.5, 60, 0.1 },
+	};
+	static const Clicks clickTracks[] = {
+		{ 90, 90 },
+		{ 120, 120 },
+		{ 140, 140 },
+		{ 174, 87 },
+	};
+	int failures = 0;
+	for (int i = 0; i < sizeof(tones) / sizeof(tones[0]); i++)
+		if (!CheckTone(tones[i]))
+			failures++;
+	for (int i = 0; i < sizeof(clickTracks) / sizeof(clickTracks[0]); i++)
+		if (!CheckClicks(clickTracks[i]))
+			failures++;
+	if (!CheckSpeed())
+		failures++;
+	return failures ? 1 : 0;
+}
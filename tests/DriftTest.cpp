@@ -0,0 +1,121 @@
+// Drives DriftCompensator with a synthetic capture clock running off the render clock
+// by a fixed offset, the way audioLoop does, and checks that the backlog locks to its
+// target without overflowing or running dry. Exits nonzero on failure.
+
+#include <stdio.h>
+#include <math.h>
+
+#include "../DriftCompensator.h"
+
+// As in milkbottle.cpp.
+#define DRIFT_TARGET_SAMPLES (2*576)
+#define DRIFT_MAX_SAMPLES (8*576)
+#define DRIFT_MAX_PPM 2000
+#define BACKLOG_CAPACITY (DRIFT_MAX_SAMPLES + 44100 / 2)
+
+// Six hours of virtual time per case, long enough for the integrator to wind up
+// or a slow leak in the fill to show.
+#define SIMULATED_SECONDS (6 * 3600)
+// Time the controller gets to lock before the backlog is checked.
+#define SETTLE_SECONDS 120
+// Capture packets hold 10 ms of audio by the capture clock.
+#define PACKET_SAMPLES 441
+// Packets the endpoint buffers while capture is not reading; more are lost.
+#define ENDPOINT_PACKETS 5
+// Allowed error of the steady-state correction against the simulated offset.
+#define PPM_TOLERANCE 50
+
+struct Case {
+	double ppm;
+	double fps;
+};
+
+static unsigned int seed = 1;
+
+// Frame time jitter of up to +-25%, deterministic so every run sees the same frames.
+static double Jitter(void) {
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 16) & 0x7FFF) / 32767.0 * 0.5 - 0.25;
+}
+
+static bool Run(const Case &test) {
+	DriftCompensator drift;
+	Backlog backlog;
+	float windowLeft[576];
+	float windowRight[576];
+	drift.Reset(DRIFT_TARGET_SAMPLES, DRIFT_MAX_PPM, 44100);
+	backlog.Reset(BACKLOG_CAPACITY);
+
+	// Render time at which the next capture packet arrives.
+	double packetPeriod = PACKET_SAMPLES / (44100.0 * (1 + test.ppm * 1e-6));
+	double nextPacket = packetPeriod;
+	double now = 0;
+	long long sample = 0;
+	double maxFill = 0;
+	double minFill = DRIFT_MAX_SAMPLES;
+	double ppmSum = 0;
+	long ppmCount = 0;
+	int waiting = 0;
+	long settledWindows = 0;
+	long overflows = 0;
+	while (now < SIMULATED_SECONDS) {
+		now += (1 + Jitter()) / test.fps;
+		for (; nextPacket <= now; nextPacket += packetPeriod) {
+			if (waiting == ENDPOINT_PACKETS)
+				overflows++;
+			else
+				waiting++;
+		}
+		// As CaptureStream::Read(): packets stay with the endpoint while the backlog is at its cap.
+		for (; waiting > 0 && backlog.Size() < DRIFT_MAX_SAMPLES; waiting--) {
+			// The values do not matter to the controller; a ramp is cheaper than sin() over hours.
+			for (int i = 0; i < PACKET_SAMPLES; i++, sample++) {
+				float value = (float)(sample % 441) / 441.0f;
+				backlog.Push(value, -value);
+			}
+		}
+		if (now >= SETTLE_SECONDS) {
+			if (backlog.Size() > maxFill)
+				maxFill = (double)backlog.Size();
+			if (backlog.Size() < minFill)
+				minFill = (double)backlog.Size();
+		}
+		while (drift.Due(now, (double)backlog.Size(), 576)) {
+			if (!drift.Take(backlog, windowLeft, windowRight, 576)) {
+				printf("  Take failed after Due at %.1f s\n", now);
+				return false;
+			}
+			if (now >= SETTLE_SECONDS)
+				settledWindows++;
+		}
+		if (now >= SETTLE_SECONDS) {
+			ppmSum += drift.GetPpm();
+			ppmCount++;
+		}
+	}
+
+	// Windows come at the nominal rate; the read step takes up the offset.
+	double ppm = ppmSum / ppmCount;
+	double windowRate = settledWindows / (double)(SIMULATED_SECONDS - SETTLE_SECONDS);
+	double expectedRate = 44100.0 / 576;
+	bool passed = overflows == 0 && maxFill < DRIFT_MAX_SAMPLES && fabs(ppm - test.ppm) < PPM_TOLERANCE &&
+		fabs(windowRate - expectedRate) < expectedRate * 1e-3;
+	printf("%s: %+5.0f ppm at %3.0f fps: correction %+7.1f ppm, backlog %4.0f..%4.0f before taking, %.3f windows/s, %ld packets lost\n",
+		passed ? "PASS" : "FAIL", test.ppm, test.fps, ppm, minFill, maxFill, windowRate, overflows);
+	return passed;
+}
+
+int main(void) {
+	static const Case cases[] = {
+		{ -500, 60 },
+		{ 0, 60 },
+		{ 500, 60 },
+		{ 500, 144 },
+		{ -500, 30 },
+	};
+	int failures = 0;
+	for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		if (!Run(cases[i]))
+			failures++;
+	return failures ? 1 : 0;
+}
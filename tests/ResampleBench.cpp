@@ -0,0 +1,210 @@
+// Feeds capture packets through PacketBatcher and WWMFResampler the way CaptureStream::Read()
+// does, once per batch size, and prints resampler calls per second of audio and the time spent
+// in them per second of audio, the same two numbers milkbottle logs as "Resampler: ...".
+//
+// Usage: ResampleBench [recording.wav] [packetMs]
+// The recording is 16-bit or float PCM, mono or stereo, at any rate; it is converted to float
+// stereo, the shared-mode mix format, and cut into packets of packetMs (default 10). Without
+// one, a minute of tones and noise at 48 kHz is used. Exits nonzero if the resampler fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <windows.h>
+#include <objbase.h>
+
+#include "../PacketBatcher.h"
+#include "../WWMFResampler.h"
+
+// As in milkbottle.cpp.
+#define RESAMPLE_QUALITY 5
+// Audio run through the resampler per batch size; the recording is repeated to fill it.
+#define BENCH_SECONDS 120
+#define SYNTHETIC_RATE 48000
+#define SYNTHETIC_SECONDS 60
+#define PI 3.14159265358979323846
+
+struct Recording {
+	float *samples;
+	DWORD frames;
+	DWORD sampleRate;
+};
+
+static bool ReadChunk(FILE *file, char *id, DWORD *size) {
+	return fread(id, 1, 4, file) == 4 && fread(size, 4, 1, file) == 1;
+}
+
+// Reads a WAV file into interleaved float stereo.
+static bool LoadWav(const wchar_t *path, Recording *recording) {
+	FILE *file = NULL;
+	if (_wfopen_s(&file, path, L"rb") || !file)
+		return false;
+	char id[4];
+	DWORD size;
+	char wave[4];
+	WORD format = 0, channels = 0, bits = 0;
+	DWORD sampleRate = 0;
+	bool ok = false;
+	if (!ReadChunk(file, id, &size) || memcmp(id, "RIFF", 4) || fread(wave, 1, 4, file) != 4 || memcmp(wave, "WAVE", 4)) {
+		fclose(file);
+		return false;
+	}
+	while (ReadChunk(file, id, &size)) {
+		if (!memcmp(id, "fmt ", 4)) {
+			BYTE fmt[40];
+			DWORD read = size < sizeof(fmt) ? size : sizeof(fmt);
+			if (size < 16 || fread(fmt, 1, read, file) != read)
+				break;
+			format = *(WORD*)fmt;
+			channels = *(WORD*)(fmt + 2);
+			sampleRate = *(DWORD*)(fmt + 4);
+			bits = *(WORD*)(fmt + 14);
+			// WAVE_FORMAT_EXTENSIBLE: the subformat GUID starts with the format tag.
+			if (format == 0xFFFE && read >= 26)
+				format = *(WORD*)(fmt + 24);
+			fseek(file, (long)(size - read + (size & 1)), SEEK_CUR);
+		} else if (!memcmp(id, "data", 4)) {
+			bool pcm16 = format == 1 && bits == 16;
+			bool float32 = format == 3 && bits == 32;
+			if ((!pcm16 && !float32) || (channels != 1 && channels != 2) || sampleRate == 0)
+				break;
+			DWORD frameBytes = channels * bits / 8;
+			recording->frames = size / frameBytes;
+			recording->sampleRate = sampleRate;
+			recording->samples = new float[recording->frames * 2];
+			BYTE *data = new BYTE[recording->frames * frameBytes];
+			if (fread(data, frameBytes, recording->frames, file) == recording->frames) {
+				for (DWORD i = 0; i < recording->frames; i++) {
+					for (int c = 0; c < 2; c++) {
+						DWORD sample = i * channels + (channels == 2 ? c : 0);
+						recording->samples[2 * i + c] = pcm16 ? ((short*)data)[sample] / 32768.0f : ((float*)data)[sample];
+					}
+				}
+				ok = recording->frames > 0;
+			}
+			delete[] data;
+			break;
+		} else {
+			fseek(file, (long)(size + (size & 1)), SEEK_CUR);
+		}
+	}
+	fclose(file);
+	return ok;
+}
+
+static void Synthesize(Recording *recording) {
+	unsigned int seed = 1;
+	recording->sampleRate = SYNTHETIC_RATE;
+	recording->frames = SYNTHETIC_RATE * SYNTHETIC_SECONDS;
+	recording->samples = new float[recording->frames * 2];
+	for (DWORD i = 0; i < recording->frames; i++) {
+		double t = (double)i / SYNTHETIC_RATE;
+		seed = seed * 1103515245 + 12345;
+		float noise = ((seed >> 16) & 0x7FFF) / 163835.0f - 0.1f;
+		recording->samples[2 * i] = (float)(0.4 * sin(2 * PI * 220 * t) + 0.2 * sin(2 * PI * 3520 * t)) + noise;
+		recording->samples[2 * i + 1] = (float)(0.4 * sin(2 * PI * 330 * t) + 0.2 * sin(2 * PI * 7040 * t)) - noise;
+	}
+}
+
+struct Result {
+	LONGLONG calls;
+	LONGLONG ticks;
+};
+
+static HRESULT Resample(WWMFResampler &resampler, const BYTE *data, DWORD bytes, Result &result) {
+	const BYTE *output;
+	DWORD outputBytes;
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	HRESULT hr = resampler.ResamplePooled(data, bytes, &output, &outputBytes);
+	QueryPerformanceCounter(&end);
+	result.calls++;
+	result.ticks += end.QuadPart - start.QuadPart;
+	return hr;
+}
+
+// Runs BENCH_SECONDS of the recording through the batcher and resampler. Packet times are
+// audio time, so deadlines fall where they would in real time.
+static HRESULT Run(const Recording &recording, DWORD packetFrames, DWORD batchMs, LONGLONG frequency, Result &result) {
+	WWMFResampler resampler;
+	PacketBatcher batcher;
+	WWMFPcmFormat inputFormat(WWMFBitFormatFloat, 2, 32, recording.sampleRate, 3, 32);
+	WWMFPcmFormat outputFormat(WWMFBitFormatFloat, 2, 32, 44100, 3, 32);
+	DWORD frameBytes = 2 * sizeof(float);
+	result.calls = 0;
+	result.ticks = 0;
+
+	HRESULT hr = resampler.Initialize(inputFormat, outputFormat, RESAMPLE_QUALITY);
+	if (SUCCEEDED(hr))
+		hr = batcher.Reset(frameBytes, recording.sampleRate, recording.sampleRate * batchMs / 1000, batchMs * 1.5);
+	LONGLONG total = (LONGLONG)recording.sampleRate * BENCH_SECONDS;
+	DWORD position = 0;
+	for (LONGLONG done = 0; done < total && SUCCEEDED(hr); done += packetFrames) {
+		if (position + packetFrames > recording.frames)
+			position = 0;
+		const BYTE *packet = (const BYTE*)(recording.samples + 2 * position);
+		position += packetFrames;
+		LONGLONG qpc = done * frequency / recording.sampleRate;
+		if (batchMs == 0) {
+			hr = Resample(resampler, packet, packetFrames * frameBytes, result);
+			continue;
+		}
+		if (!batcher.Append(packet, packetFrames, qpc, 0)) {
+			hr = Resample(resampler, batcher.Data(), batcher.Bytes(), result);
+			batcher.Clear();
+			batcher.Append(packet, packetFrames, qpc, 0);
+		}
+		if (SUCCEEDED(hr) && batcher.Due(qpc)) {
+			hr = Resample(resampler, batcher.Data(), batcher.Bytes(), result);
+			batcher.Clear();
+		}
+	}
+	if (SUCCEEDED(hr) && !batcher.Empty())
+		hr = Resample(resampler, batcher.Data(), batcher.Bytes(), result);
+	resampler.Finalize();
+	return hr;
+}
+
+int wmain(int argc, wchar_t **argv) {
+	static const DWORD batches[] = { 0, 5, 10, 20, 40, 80 };
+	Recording recording;
+	if (argc > 1 && !LoadWav(argv[1], &recording)) {
+		wprintf(L"Cannot read %s: 16-bit or float WAV, mono or stereo, expected\n", argv[1]);
+		return 1;
+	} else if (argc <= 1) {
+		Synthesize(&recording);
+	}
+	DWORD packetMs = argc > 2 ? (DWORD)_wtoi(argv[2]) : 10;
+	if (packetMs == 0)
+		packetMs = 10;
+	DWORD packetFrames = recording.sampleRate * packetMs / 1000;
+
+	HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	if (FAILED(hr)) {
+		printf("CoInitializeEx failed: hr = 0x%08x\n", hr);
+		return 1;
+	}
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	printf("Resampling %d s of %u Hz float stereo to 44100 Hz in %u ms packets at quality %d\n",
+		BENCH_SECONDS, recording.sampleRate, packetMs, RESAMPLE_QUALITY);
+
+	int failures = 0;
+	for (int i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+		Result result;
+		hr = Run(recording, packetFrames, batches[i], frequency.QuadPart, result);
+		if (FAILED(hr)) {
+			printf("FAIL: batch %u ms: resampling failed: hr = 0x%08x\n", batches[i], hr);
+			failures++;
+			continue;
+		}
+		double milliseconds = result.ticks * 1000.0 / frequency.QuadPart;
+		printf("batch %2u ms%s: %6.1f calls/s, %7.1f us per call, %.3f ms CPU per second of audio\n",
+			batches[i], batches[i] ? "" : " (per packet)", (double)result.calls / BENCH_SECONDS,
+			milliseconds * 1000.0 / result.calls, milliseconds / BENCH_SECONDS);
+	}
+	delete[] recording.samples;
+	CoUninitialize();
+	return failures ? 1 : 0;
+}
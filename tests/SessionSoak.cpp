@@ -0,0 +1,398 @@
+// Soaks SessionNotification through simulated device churn. A stand-in for the audio
+// service thread fires OnDefaultDeviceChanged and OnDeviceStateChanged at an
+// IMMNotificationClient like milkbottle's, and announces sessions through
+// OnSessionCreated before or while the stream is torn down. The main thread reconnects
+// the way audioLoop does: it unregisters and releases the old notification, then opens
+// a new one and tracks the sessions present at open. Every mock must be unregistered and
+// freed once nothing tracks it, private bytes must not grow once the heap has warmed up,
+// and the time from each device event to the reopened notification is reported.
+// Exits nonzero on failure.
+
+#include <algorithm>
+#include <stdio.h>
+#include <windows.h>
+#include <mmdeviceapi.h>
+#include <psapi.h>
+
+#include "../SessionNotification.h"
+
+#pragma comment(lib, "psapi")
+
+#define SOAK_CYCLES 20000
+#define SESSIONS_AT_OPEN 3
+#define SESSIONS_ANNOUNCED 8
+// Cycles run before the first memory sample, so the heap has reached its working size.
+#define WARMUP_CYCLES 500
+// Growth in private bytes tolerated between the samples, for heap bookkeeping that is not a leak.
+#define MEMORY_SLACK_BYTES (64 * 1024)
+
+static volatile LONG liveSessions;
+static volatile LONG registrations;
+
+class MockSession : public IAudioSessionControl {
+public:
+	MockSession(void) : rc(1), registered(NULL) {
+		InterlockedIncrement(&liveSessions);
+	}
+
+	ULONG STDMETHODCALLTYPE AddRef(void) {
+		return InterlockedIncrement(&rc);
+	}
+
+	ULONG STDMETHODCALLTYPE Release(void) {
+		ULONG rc = InterlockedDecrement(&this->rc);
+		if (rc == 0)
+			delete this;
+		return rc;
+	}
+
+	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv) {
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+
+	// Like the audio service, a registration holds a reference to the sink.
+	HRESULT STDMETHODCALLTYPE RegisterAudioSessionNotification(IAudioSessionEvents *events) {
+		if (registered)
+			return E_FAIL;
+		events->AddRef();
+		registered = events;
+		InterlockedIncrement(&registrations);
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE UnregisterAudioSessionNotification(IAudioSessionEvents *events) {
+		if (registered != events)
+			return E_INVALIDARG;
+		registered->Release();
+		registered = NULL;
+		InterlockedDecrement(&registrations);
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetState(AudioSessionState *state) {
+		*state = AudioSessionStateActive;
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE GetDisplayName(LPWSTR *name) {
+		return E_NOTIMPL;
+	}
+	HRESULT STDMETHODCALLTYPE SetDisplayName(LPCWSTR name, LPCGUID context) {
+		return E_NOTIMPL;
+	}
+	HRESULT STDMETHODCALLTYPE GetIconPath(LPWSTR *path) {
+		return E_NOTIMPL;
+	}
+	HRESULT STDMETHODCALLTYPE SetIconPath(LPCWSTR path, LPCGUID context) {
+		return E_NOTIMPL;
+	}
+	HRESULT STDMETHODCALLTYPE GetGroupingParam(GUID *grouping) {
+		return E_NOTIMPL;
+	}
+	HRESULT STDMETHODCALLTYPE SetGroupingParam(LPCGUID grouping, LPCGUID context) {
+		return E_NOTIMPL;
+	}
+
+private:
+	~MockSession(void) {
+		InterlockedDecrement(&liveSessions);
+	}
+
+	LONG rc;
+	IAudioSessionEvents *registered;
+};
+
+class MockEvents : public IAudioSessionEvents {
+public:
+	MockEvents(void) : rc(1) {
+	}
+
+	ULONG STDMETHODCALLTYPE AddRef(void) {
+		return InterlockedIncrement(&rc);
+	}
+
+	ULONG STDMETHODCALLTYPE Release(void) {
+		ULONG rc = InterlockedDecrement(&this->rc);
+		if (rc == 0)
+			delete this;
+		return rc;
+	}
+
+	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv) {
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+
+	HRESULT STDMETHODCALLTYPE OnDisplayNameChanged(LPCWSTR name, LPCGUID context) {
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnIconPathChanged(LPCWSTR path, LPCGUID context) {
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnSimpleVolumeChanged(float volume, BOOL mute, LPCGUID context) {
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnChannelVolumeChanged(DWORD count, float volumes[], DWORD changed, LPCGUID context) {
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnGroupingParamChanged(LPCGUID grouping, LPCGUID context) {
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnStateChanged(AudioSessionState state) {
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnSessionDisconnected(AudioSessionDisconnectReason reason) {
+		return S_OK;
+	}
+
+	LONG References(void) {
+		AddRef();
+		return Release();
+	}
+
+private:
+	LONG rc;
+};
+
+// Stands in for an endpoint's IAudioSessionManager2: holds the registered notification
+// and calls it from the service thread. A call can still be in flight when the
+// notification is unregistered, as with the real service.
+class MockDevice {
+public:
+	MockDevice(void) : registered(NULL) {
+		InitializeCriticalSection(&lock);
+	}
+
+	~MockDevice(void) {
+		DeleteCriticalSection(&lock);
+	}
+
+	void Register(SessionNotification *notification) {
+		EnterCriticalSection(&lock);
+		notification->AddRef();
+		registered = notification;
+		LeaveCriticalSection(&lock);
+	}
+
+	void Unregister(SessionNotification *notification) {
+		EnterCriticalSection(&lock);
+		if (registered == notification) {
+			registered->Release();
+			registered = NULL;
+		}
+		LeaveCriticalSection(&lock);
+	}
+
+	void Announce(int count) {
+		for (int i = 0; i < count; i++) {
+			EnterCriticalSection(&lock);
+			SessionNotification *notification = registered;
+			if (notification)
+				notification->AddRef();
+			LeaveCriticalSection(&lock);
+			if (!notification)
+				continue;
+			MockSession *session = new MockSession();
+			notification->OnSessionCreated(session);
+			session->Release();
+			notification->Release();
+		}
+	}
+
+private:
+	CRITICAL_SECTION lock;
+	SessionNotification *registered;
+};
+
+// As MMNotificationClient in milkbottle.cpp, but it wakes the reconnect loop and notes
+// when the change was announced.
+class MockNotificationClient : public IMMNotificationClient {
+public:
+	MockNotificationClient(void) : fired(0) {
+		event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+
+	~MockNotificationClient(void) {
+		CloseHandle(event);
+	}
+
+	ULONG STDMETHODCALLTYPE AddRef(void) {
+		return 1;
+	}
+	ULONG STDMETHODCALLTYPE Release(void) {
+		return 1;
+	}
+	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv) {
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+	HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(EDataFlow flow, ERole role, LPCWSTR id) {
+		Changed();
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR id) {
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR id) {
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(LPCWSTR id, DWORD state) {
+		Changed();
+		return S_OK;
+	}
+	HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(LPCWSTR id, const PROPERTYKEY key) {
+		return S_OK;
+	}
+
+	/// Signaled on every device change.
+	HANDLE Event(void) const {
+		return event;
+	}
+
+	/// QueryPerformanceCounter value of the last device change.
+	LONGLONG Fired(void) const {
+		return fired;
+	}
+
+private:
+	void Changed(void) {
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		fired = now.QuadPart;
+		SetEvent(event);
+	}
+
+	HANDLE event;
+	volatile LONGLONG fired;
+};
+
+static MockDevice device;
+static MockNotificationClient client;
+// Set by the service thread once a cycle's announcements are done, and by the main
+// thread once it has reconnected and checked the cycle.
+static HANDLE announced;
+static HANDLE reconnected;
+static double latencies[SOAK_CYCLES];
+
+// Stands in for the audio service's thread: every cycle it reports a device change and
+// announces sessions, on odd cycles before the change and on even ones while the
+// reconnect loop tears the stream down.
+static DWORD WINAPI Service(LPVOID parameter) {
+	for (int cycle = 0; cycle < SOAK_CYCLES; cycle++) {
+		if (cycle & 1)
+			device.Announce(SESSIONS_ANNOUNCED);
+		if (cycle & 2)
+			client.OnDeviceStateChanged(L"{mock}", DEVICE_STATE_UNPLUGGED);
+		else
+			client.OnDefaultDeviceChanged(eRender, eConsole, L"{mock}");
+		if (!(cycle & 1))
+			device.Announce(SESSIONS_ANNOUNCED);
+		SetEvent(announced);
+		WaitForSingleObject(reconnected, INFINITE);
+	}
+	return 0;
+}
+
+// As CaptureStream::Open(): registers a new notification and tracks the sessions already there.
+static SessionNotification *Open(IAudioSessionEvents *events) {
+	SessionNotification *notification = new SessionNotification(events);
+	device.Register(notification);
+	for (int i = 0; i < SESSIONS_AT_OPEN; i++) {
+		MockSession *session = new MockSession();
+		notification->Track(session);
+		session->Release();
+	}
+	return notification;
+}
+
+// As CaptureStream::Close().
+static void Close(SessionNotification *notification) {
+	device.Unregister(notification);
+	notification->UntrackAll();
+	notification->Release();
+}
+
+static SIZE_T PrivateBytes(void) {
+	PROCESS_MEMORY_COUNTERS_EX counters;
+	counters.cb = sizeof(counters);
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters)))
+		return 0;
+	return counters.PrivateUsage;
+}
+
+int main(void) {
+	MockEvents *events = new MockEvents();
+	announced = CreateEvent(NULL, FALSE, FALSE, NULL);
+	reconnected = CreateEvent(NULL, FALSE, FALSE, NULL);
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	SessionNotification *notification = Open(events);
+	HANDLE thread = CreateThread(NULL, 0, Service, NULL, 0, NULL);
+	if (!thread) {
+		printf("CreateThread failed: %u\n", GetLastError());
+		return 1;
+	}
+
+	int failures = 0;
+	LONG maxTracked = 0;
+	SIZE_T warmBytes = 0;
+	int cycle;
+	for (cycle = 0; cycle < SOAK_CYCLES; cycle++) {
+		WaitForSingleObject(client.Event(), INFINITE);
+		Close(notification);
+		notification = Open(events);
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		latencies[cycle] = (double)(now.QuadPart - client.Fired()) * 1000000.0 / frequency.QuadPart;
+
+		// Once the announcements are over, exactly the sessions the new notification tracks may be alive.
+		WaitForSingleObject(announced, INFINITE);
+		LONG tracked = (LONG)notification->TrackedCount();
+		if (tracked > maxTracked)
+			maxTracked = tracked;
+		if (liveSessions != tracked || registrations != tracked) {
+			if (failures < 10)
+				printf("FAIL: cycle %d has %d sessions alive and %d registrations for %d tracked\n",
+					cycle, liveSessions, registrations, tracked);
+			failures++;
+		}
+		if (cycle == WARMUP_CYCLES)
+			warmBytes = PrivateBytes();
+		SetEvent(reconnected);
+	}
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	Close(notification);
+	SIZE_T endBytes = PrivateBytes();
+
+	if (liveSessions != 0 || registrations != 0) {
+		printf("FAIL: %d sessions alive and %d registrations after the last close\n", liveSessions, registrations);
+		failures++;
+	}
+	LONG references = events->References();
+	if (references != 1) {
+		printf("FAIL: the event sink has %d references left, expected 1\n", references);
+		failures++;
+	}
+	events->Release();
+	CloseHandle(announced);
+	CloseHandle(reconnected);
+
+	LONGLONG growth = (LONGLONG)endBytes - (LONGLONG)warmBytes;
+	if (!warmBytes || !endBytes || growth > MEMORY_SLACK_BYTES) {
+		printf("FAIL: private bytes grew by %lld over %d reconnects\n", growth, SOAK_CYCLES - WARMUP_CYCLES);
+		failures++;
+	}
+
+	std::sort(latencies, latencies + SOAK_CYCLES);
+	double sum = 0;
+	for (int i = 0; i < SOAK_CYCLES; i++)
+		sum += latencies[i];
+	printf("Reconnect latency over %d device changes: min %.1f us, mean %.1f us, median %.1f us, p99 %.1f us, max %.1f us\n",
+		SOAK_CYCLES, latencies[0], sum / SOAK_CYCLES, latencies[SOAK_CYCLES / 2], latencies[SOAK_CYCLES * 99 / 100], latencies[SOAK_CYCLES - 1]);
+	printf("Private bytes: %u KB after %d reconnects, %u KB at the end, %+lld bytes\n",
+		(UINT)(warmBytes / 1024), WARMUP_CYCLES, (UINT)(endBytes / 1024), growth);
+	printf("%s: %d reconnects, up to %d sessions tracked at once\n", failures ? "FAIL" : "PASS", cycle, maxTracked);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,74 @@
+// Attaches to milkbottle's shared waveform ring the way an external consumer would and
+// reports how old windows are when a polling reader gets them. Run it next to a capturing
+// milkbottle. Exits nonzero if it cannot attach or no windows arrive.
+//
+// Usage: WaveformReader [seconds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "../SharedWaveform.h"
+
+#define DEFAULT_SECONDS 10
+// How often the reader polls; a consumer driving lights at display rate would do the same.
+#define POLL_MS 1
+
+int main(int argc, char **argv) {
+	int seconds = argc > 1 ? atoi(argv[1]) : DEFAULT_SECONDS;
+	if (seconds <= 0)
+		seconds = DEFAULT_SECONDS;
+
+	SharedWaveformReader reader;
+	HRESULT hr = reader.Open(SHARED_WAVEFORM_NAME);
+	if (FAILED(hr)) {
+		printf("FAIL: cannot attach to %ls (0x%08X); is milkbottle capturing?\n", SHARED_WAVEFORM_NAME, hr);
+		return 1;
+	}
+
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER start;
+	LARGE_INTEGER now;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	std::vector<double> latencies;
+	latencies.reserve(seconds * 100);
+	SharedWaveformSlot slot;
+	LONGLONG dropped = 0;
+	LONGLONG totalDropped = 0;
+	LONGLONG firstIndex = -1;
+	LONGLONG lastIndex = -1;
+	long onsets = 0;
+	do {
+		while (reader.Read(&slot, &dropped) == S_OK) {
+			latencies.push_back(reader.LatencyMs(slot));
+			totalDropped += dropped;
+			if (firstIndex < 0)
+				firstIndex = slot.index;
+			lastIndex = slot.index;
+			if (slot.flags & SHARED_WAVEFORM_ONSET)
+				onsets++;
+		}
+		Sleep(POLL_MS);
+		QueryPerformanceCounter(&now);
+	} while (now.QuadPart - start.QuadPart < seconds * frequency.QuadPart);
+
+	if (latencies.empty()) {
+		printf("FAIL: no windows published in %d s\n", seconds);
+		return 1;
+	}
+
+	double sum = 0;
+	for (size_t i = 0; i < latencies.size(); i++)
+		sum += latencies[i];
+	std::sort(latencies.begin(), latencies.end());
+	size_t count = latencies.size();
+	printf("%u windows (%lld to %lld) in %d s, %.1f per second, %lld dropped, %d writer changes, %ld onsets\n",
+		(unsigned)count, firstIndex, lastIndex, seconds, count / (double)seconds, totalDropped, reader.Resyncs(), onsets);
+	printf("latency ms: min %.2f, mean %.2f, median %.2f, 99th %.2f, max %.2f\n",
+		latencies[0], sum / count, latencies[count / 2], latencies[count * 99 / 100], latencies[count - 1]);
+	printf("PASS\n");
+	return 0;
+}